@@ -10,6 +10,26 @@ RHDatagram::RHDatagram(RHGenericDriver& driver, uint8_t thisAddress)
     _driver(driver),
     _thisAddress(thisAddress)
 {
+#if RH_DATAGRAM_QUEUE_CLASSES > 0
+    memset(_queueHead, 0, sizeof(_queueHead));
+    memset(_queueCount, 0, sizeof(_queueCount));
+    memset(_queueWeight, 0, sizeof(_queueWeight));
+    memset(_queueCredit, 0, sizeof(_queueCredit));
+    memset(_queueStats, 0, sizeof(_queueStats));
+    _queueHeld = false;
+#endif
+#if RH_DATAGRAM_COALESCING
+    _txCoalesced = NULL;
+    _txCoalescedLen = 0;
+    _coalesceMaxLen = 0;
+    _coalesceMaxDelay = 0;
+    _rxCoalesced = NULL;
+    _rxCoalescedLen = 0;
+    _rxCoalescedPos = 0;
+    _coalescedFrames = 0;
+    _coalescedMessages = 0;
+    _coalescedOctets = 0;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -36,8 +56,354 @@ bool RHDatagram::sendto(uint8_t* buf, uint8_t len, uint8_t address)
     return _driver.send(buf, len);
 }
 
+#if RH_DATAGRAM_COALESCING
+bool RHDatagram::sendtoCoalesced(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    uint8_t maxLen = _txCoalesced ? _coalesceMaxLen : 0;
+    if (maxLen > _driver.maxMessageLength())
+	maxLen = _driver.maxMessageLength();
+    if (len + 1 > maxLen)
+    {
+	// Cant be coalesced. Keep the messages in order
+	flushCoalesced();
+	return sendto(buf, len, address);
+    }
+    if (_txCoalescedLen && (address != _txCoalescedTo || _txCoalescedLen + len + 1 > maxLen))
+	flushCoalesced();
+    if (!_txCoalescedLen)
+    {
+	_txCoalescedTo = address;
+	_txCoalescedCount = 0;
+	_txCoalescedTime = millis();
+    }
+    _txCoalesced[_txCoalescedLen++] = len;
+    memcpy(_txCoalesced + _txCoalescedLen, buf, len);
+    _txCoalescedLen += len;
+    _txCoalescedCount++;
+    // Send it now if there is no room for another message
+    if (_txCoalescedLen + 2 > maxLen)
+	return flushCoalesced();
+    flushCoalescedIfDue();
+    return true;
+}
+#else
+bool RHDatagram::sendtoCoalesced(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    return sendto(buf, len, address);
+}
+#endif
+
+#if RH_DATAGRAM_QUEUE_CLASSES > 0
+bool RHDatagram::sendtoQueued(uint8_t* buf, uint8_t len, uint8_t address, uint8_t priority, uint8_t id, uint8_t flags)
+{
+    if (priority >= RH_DATAGRAM_QUEUE_CLASSES)
+	priority = RH_DATAGRAM_QUEUE_CLASSES - 1;
+    QueueStats* stats = &_queueStats[priority];
+    if (_queueCount[priority] >= RH_DATAGRAM_QUEUE_DEPTH || len > RH_DATAGRAM_QUEUE_MSG_LEN)
+    {
+	stats->dropped++;
+	return false;
+    }
+    QueuedFrame* frame = &_queue[priority][(_queueHead[priority] + _queueCount[priority]) % RH_DATAGRAM_QUEUE_DEPTH];
+    frame->to = address;
+    frame->id = id;
+    frame->flags = flags;
+    frame->len = len;
+    frame->time = millis();
+    memcpy(frame->data, buf, len);
+    _queueCount[priority]++;
+    stats->queued++;
+    // Maybe it can go now
+    serviceQueue();
+    return true;
+}
+
+bool RHDatagram::serviceQueue()
+{
+    if (_queueHeld)
+	return false; // Waiting for an acknowledgement
+    if (_driver.mode() == RHGenericDriver::RHModeTx)
+	return false; // Still sending the last one
+
+    // Find the highest priority class with messages waiting and some share left.
+    // In strict priority order, no class has a share, so thats always the highest priority class with messages
+    uint8_t i;
+    uint8_t first = RH_DATAGRAM_QUEUE_CLASSES;
+    uint8_t priority = RH_DATAGRAM_QUEUE_CLASSES;
+    for (i = 0; i < RH_DATAGRAM_QUEUE_CLASSES; i++)
+    {
+	if (!_queueCount[i])
+	    continue;
+	if (first == RH_DATAGRAM_QUEUE_CLASSES)
+	    first = i;
+	if (_queueCredit[i])
+	{
+	    priority = i;
+	    break;
+	}
+    }
+    if (first == RH_DATAGRAM_QUEUE_CLASSES)
+	return false; // Nothing to send
+    if (priority == RH_DATAGRAM_QUEUE_CLASSES)
+    {
+	// Start a new round
+	memcpy(_queueCredit, _queueWeight, sizeof(_queueCredit));
+	priority = first;
+    }
+    if (_queueCredit[priority])
+	_queueCredit[priority]--;
+
+    QueuedFrame* frame = &_queue[priority][_queueHead[priority]];
+    QueueStats* stats = &_queueStats[priority];
+    uint16_t delay = queueHeadDelay(priority);
+    // This may be in the middle of a sendtoWait(), so put its headers back afterwards
+    uint8_t savedId = _driver.txHeaderId();
+    uint8_t savedFlags = _driver.txHeaderFlags();
+    setHeaderId(frame->id);
+    setHeaderFlags(frame->flags, 0xff);
+    sendto(frame->data, frame->len, frame->to);
+    setHeaderId(savedId);
+    setHeaderFlags(savedFlags, 0xff);
+    _queueHead[priority] = (_queueHead[priority] + 1) % RH_DATAGRAM_QUEUE_DEPTH;
+    _queueCount[priority]--;
+
+    // Moving average with a gain of 1/8, scaled by 8
+    if (delay > 8000)
+	delay = 8000;
+    if (stats->sent)
+	stats->delay += delay - (stats->delay >> 3);
+    else
+	stats->delay = delay << 3;
+    if (delay > stats->maxDelay)
+	stats->maxDelay = delay;
+    stats->sent++;
+    queuedSent(frame->to, frame->id);
+    return true;
+}
+
+void RHDatagram::holdQueue(bool hold)
+{
+    _queueHeld = hold;
+}
+
+uint8_t RHDatagram::queueLength()
+{
+    uint8_t count = 0;
+    uint8_t i;
+    for (i = 0; i < RH_DATAGRAM_QUEUE_CLASSES; i++)
+	count += _queueCount[i];
+    return count;
+}
+
+void RHDatagram::setQueueWeights(uint8_t* weights)
+{
+    if (weights)
+	memcpy(_queueWeight, weights, sizeof(_queueWeight));
+    else
+	memset(_queueWeight, 0, sizeof(_queueWeight));
+    memcpy(_queueCredit, _queueWeight, sizeof(_queueCredit));
+}
+
+uint16_t RHDatagram::queueHeadDelay(uint8_t priority)
+{
+    if (priority < RH_DATAGRAM_QUEUE_CLASSES && _queueCount[priority])
+    {
+	unsigned long delay = millis() - _queue[priority][_queueHead[priority]].time;
+	return delay > 0xffff ? 0xffff : delay;
+    }
+    return 0;
+}
+
+RHDatagram::QueueStats* RHDatagram::getQueueStats(uint8_t priority)
+{
+    if (priority < RH_DATAGRAM_QUEUE_CLASSES)
+	return &_queueStats[priority];
+    return NULL;
+}
+#else
+bool RHDatagram::sendtoQueued(uint8_t* buf, uint8_t len, uint8_t address, uint8_t, uint8_t id, uint8_t flags)
+{
+    uint8_t savedId = _driver.txHeaderId();
+    uint8_t savedFlags = _driver.txHeaderFlags();
+    setHeaderId(id);
+    setHeaderFlags(flags, 0xff);
+    bool ret = sendto(buf, len, address);
+    setHeaderId(savedId);
+    setHeaderFlags(savedFlags, 0xff);
+    return ret;
+}
+
+bool RHDatagram::serviceQueue()
+{
+    return false;
+}
+
+void RHDatagram::holdQueue(bool)
+{
+}
+
+uint8_t RHDatagram::queueLength()
+{
+    return 0;
+}
+
+void RHDatagram::setQueueWeights(uint8_t*)
+{
+}
+
+uint16_t RHDatagram::queueHeadDelay(uint8_t)
+{
+    return 0;
+}
+
+RHDatagram::QueueStats* RHDatagram::getQueueStats(uint8_t)
+{
+    return NULL;
+}
+#endif
+
+void RHDatagram::queuedSent(uint8_t, uint8_t)
+{
+}
+
+#if RH_DATAGRAM_COALESCING
+void RHDatagram::setCoalescing(uint8_t* txBuf, uint8_t* rxBuf, uint8_t len, uint16_t maxDelay)
+{
+    flushCoalesced();
+    _txCoalesced = txBuf;
+    _rxCoalesced = rxBuf;
+    _rxCoalescedLen = 0;
+    _rxCoalescedPos = 0;
+    _coalesceMaxLen = len;
+    _coalesceMaxDelay = maxDelay;
+}
+
+bool RHDatagram::flushCoalesced()
+{
+    if (!_txCoalescedLen)
+	return true;
+    bool ret;
+    if (_txCoalescedCount == 1)
+    {
+	// Not worth a coalesced frame
+	ret = sendto(_txCoalesced + 1, _txCoalescedLen - 1, _txCoalescedTo);
+    }
+    else
+    {
+	setHeaderFlags(RH_FLAGS_COALESCED, RH_FLAGS_RESERVED);
+	ret = sendto(_txCoalesced, _txCoalescedLen, _txCoalescedTo);
+	setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_COALESCED);
+    }
+    if (ret)
+    {
+	_coalescedFrames++;
+	_coalescedMessages += _txCoalescedCount;
+	_coalescedOctets += _txCoalescedLen - _txCoalescedCount;
+    }
+    _txCoalescedLen = 0;
+    return ret;
+}
+
+void RHDatagram::flushCoalescedIfDue()
+{
+    if (_txCoalescedLen && (millis() - _txCoalescedTime) >= _coalesceMaxDelay)
+	flushCoalesced();
+}
+
+uint32_t RHDatagram::coalescedFrames()
+{
+    return _coalescedFrames;
+}
+
+uint32_t RHDatagram::coalescedMessages()
+{
+    return _coalescedMessages;
+}
+
+uint32_t RHDatagram::coalescedOctets()
+{
+    return _coalescedOctets;
+}
+#else
+void RHDatagram::setCoalescing(uint8_t*, uint8_t*, uint8_t, uint16_t)
+{
+}
+
+bool RHDatagram::flushCoalesced()
+{
+    return true;
+}
+
+uint32_t RHDatagram::coalescedFrames()
+{
+    return 0;
+}
+
+uint32_t RHDatagram::coalescedMessages()
+{
+    return 0;
+}
+
+uint32_t RHDatagram::coalescedOctets()
+{
+    return 0;
+}
+#endif
+
 bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {
+    serviceQueue();
+#if RH_DATAGRAM_COALESCING
+    flushCoalescedIfDue();
+    if (   _rxCoalescedPos >= _rxCoalescedLen
+	&& _driver.available()
+	&& (_driver.headerFlags() & RH_FLAGS_COALESCED) == RH_FLAGS_COALESCED)
+    {
+	if (!_rxCoalesced)
+	{
+	    // Nowhere to unpack it. Discard it rather than pass it off as an ordinary message
+	    _driver.recv(NULL, NULL);
+	    return false;
+	}
+	// A new coalesced frame: keep it and its headers to unpack
+	_rxCoalescedLen = _coalesceMaxLen;
+	_rxCoalescedPos = 0;
+	if (!_driver.recv(_rxCoalesced, &_rxCoalescedLen))
+	    _rxCoalescedLen = 0;
+	_rxCoalescedTo = headerTo();
+	_rxCoalescedFrom = headerFrom();
+	_rxCoalescedId = headerId();
+	_rxCoalescedFlags = headerFlags() & ~RH_FLAGS_COALESCED;
+    }
+    if (_rxCoalescedPos < _rxCoalescedLen)
+    {
+	// Return the next message from the coalesced frame
+	uint8_t msgLen = _rxCoalesced[_rxCoalescedPos++];
+	if (msgLen > _rxCoalescedLen - _rxCoalescedPos)
+	{
+	    // Truncated or corrupt: discard the rest of the frame
+	    _rxCoalescedPos = _rxCoalescedLen;
+	    return false;
+	}
+	if (*len > msgLen)
+	    *len = msgLen;
+	memcpy(buf, _rxCoalesced + _rxCoalescedPos, *len);
+	_rxCoalescedPos += msgLen;
+	if (from)  *from =  _rxCoalescedFrom;
+	if (to)    *to =    _rxCoalescedTo;
+	if (id)    *id =    _rxCoalescedId;
+	if (flags) *flags = _rxCoalescedFlags;
+	return true;
+    }
+#else
+    if (   _driver.available()
+	&& (_driver.headerFlags() & RH_FLAGS_COALESCED) == RH_FLAGS_COALESCED)
+    {
+	// Cant unpack it. Discard it rather than pass it off as an ordinary message
+	_driver.recv(NULL, NULL);
+	return false;
+    }
+#endif
     if (_driver.recv(buf, len))
     {
 	if (from)  *from =  headerFrom();
@@ -51,11 +417,21 @@ bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to
 
 bool RHDatagram::available()
 {
+    serviceQueue();
+#if RH_DATAGRAM_COALESCING
+    flushCoalescedIfDue();
+    if (_rxCoalescedPos < _rxCoalescedLen)
+	return true;
+#endif
     return _driver.available();
 }
 
 void RHDatagram::waitAvailable()
 {
+#if RH_DATAGRAM_COALESCING
+    if (_rxCoalescedPos < _rxCoalescedLen)
+	return;
+#endif
     _driver.waitAvailable();
 }
 
@@ -71,6 +447,10 @@ bool RHDatagram::waitPacketSent(uint16_t timeout)
 
 bool RHDatagram::waitAvailableTimeout(uint16_t timeout)
 {
+#if RH_DATAGRAM_COALESCING
+    if (_rxCoalescedPos < _rxCoalescedLen)
+	return true;
+#endif
     return _driver.waitAvailableTimeout(timeout);
 }
 
@@ -79,6 +459,11 @@ uint8_t RHDatagram::thisAddress()
     return _thisAddress;
 }
 
+uint8_t RHDatagram::maxMessageLength()
+{
+    return _driver.maxMessageLength();
+}
+
 void RHDatagram::setHeaderTo(uint8_t to)
 {
     _driver.setHeaderTo(to);
@@ -12,6 +12,39 @@
 // Not all radios support this length, and many are much smaller
 #define RH_MAX_MESSAGE_LEN 255
 
+// The number of priority classes in the transmit queue (see sendtoQueued()). Class 0 has the 
+// highest priority. 0 disables the queue and saves the RAM for it.
+#ifndef RH_DATAGRAM_QUEUE_CLASSES
+#define RH_DATAGRAM_QUEUE_CLASSES 0
+#endif
+
+// The maximum number of messages that can be waiting in each class of the transmit queue
+#ifndef RH_DATAGRAM_QUEUE_DEPTH
+#define RH_DATAGRAM_QUEUE_DEPTH 2
+#endif
+
+// The maximum length of messages that can be kept in the transmit queue
+#ifndef RH_DATAGRAM_QUEUE_MSG_LEN
+#define RH_DATAGRAM_QUEUE_MSG_LEN 32
+#endif
+
+// If 1, sendtoCoalesced() can coalesce small messages into one frame, and recvfrom() can unpack them 
+// (see setCoalescing()). 0 sends every message at once and saves the RAM for the coalescing state. 
+// Off by default on AVR
+#ifndef RH_DATAGRAM_COALESCING
+ #if defined(__AVR__)
+  #define RH_DATAGRAM_COALESCING 0
+ #else
+  #define RH_DATAGRAM_COALESCING 1
+ #endif
+#endif
+
+// Marks a frame containing several coalesced messages, each preceded by its length.
+// It is a combination of two RadioHead flags (RH_FLAGS_WINDOW and RH_FLAGS_GROUP in RHReliableDatagram) 
+// that are never sent together otherwise. It does not include RH_FLAGS_ACK, so a node that 
+// does not unpack coalesced frames can never mistake one for an acknowledgement.
+#define RH_FLAGS_COALESCED 0x50
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHDatagram RHDatagram.h <RHDatagram.h>
 /// \brief Manager class for addressed, unreliable messages
@@ -33,6 +66,53 @@
 /// sure that messages passed to sendto() do not exceed the capability of the radio. You can use the 
 /// *_MAX_MESSAGE_LENGTH definitions or driver->maxMessageLength() to help.
 ///
+/// \par Message Coalescing
+///
+/// Each frame sent by the radio carries a preamble, sync word, headers and CRC, so when an application
+/// sends many small messages (such as a few octets of sensor readings) most of the airtime is overhead. 
+/// Once it has been given a transmit buffer with setCoalescing(), sendtoCoalesced() 
+/// holds small messages for the same destination and sends them together in a single frame, 
+/// with RH_FLAGS_COALESCED set in FLAGS, each message preceded by 1 octet with its length. 
+/// The frame is sent when the next message would not fit in the buffer, or when a
+/// message is sent to a different destination, or when the oldest message has been held 
+/// for the maximum delay, or when flushCoalesced() is called. The delay is checked by 
+/// sendtoCoalesced(), available() and recvfrom(), so one of these must be called often enough, 
+/// else call flushCoalesced() yourself. If only one message is held, it is sent as an ordinary message.
+/// A receiver that has been given a receive buffer with setCoalescing() unpacks coalesced frames in recvfrom()
+/// and returns each message in turn, with the TO, FROM, ID and 
+/// FLAGS headers of the frame (with RH_FLAGS_COALESCED cleared). The receive buffer must be at least as 
+/// big as the senders' transmit buffers. Receivers without a receive buffer discard coalesced frames. 
+/// The buffers belong to the application. The rest of the coalescing state takes 32 octets of RAM on 8 bit processors,
+/// whether or not setCoalescing() is called, unless RadioHead is built with RH_DATAGRAM_COALESCING 0 
+/// (the default on AVR). Then sendtoCoalesced() always sends at once as by sendto(), setCoalescing() does nothing, 
+/// and coalesced frames are always discarded. The messages in a frame
+/// share its ID, so coalescing should only be used with RHDatagram: RHReliableDatagram and 
+/// the managers built on it would take all but the first message in a frame as duplicates.
+/// coalescedFrames(), coalescedMessages() and coalescedOctets() tell you how well it is working.
+///
+/// \par Transmit Queue
+///
+/// sendto() transmits at once, so an urgent message has to wait for the application to finish 
+/// whatever it is sending, including any retransmissions. If RadioHead is built with 
+/// RH_DATAGRAM_QUEUE_CLASSES greater than 0, sendtoQueued() instead copies the message into
+/// a statically allocated queue with that many priority classes, each holding up to 
+/// RH_DATAGRAM_QUEUE_DEPTH messages of up to RH_DATAGRAM_QUEUE_MSG_LEN octets. 
+/// Whenever the radio is not transmitting, serviceQueue() sends the message at the head of the highest priority 
+/// class (class 0) that has any. With setQueueWeights() you can instead give each class a share 
+/// of the frames, so that lower priority classes are not starved. serviceQueue() is called by available() and 
+/// recvfrom(), and by RHReliableDatagram while it waits for acknowledgements and in service(), 
+/// where messages sent with RHReliableDatagram::sendtoAsync() and their retransmissions also go 
+/// through the queue in the class given to sendtoAsync(). serviceQueue() puts back the ID and FLAGS 
+/// headers that were set before it, so it can run in the middle of another send.
+/// Only sendtoQueued() uses the queue: sendto(), acknowledgements, and the blocking 
+/// RHReliableDatagram::sendtoWait(), sendtoWaitWindowed() and sendtoGroupWait() still transmit at once, 
+/// ahead of anything in the queue. While they wait for an acknowledgement, the queue is held, because 
+/// the acknowledgement would be lost if it arrived during a transmission. One queued message goes 
+/// after each wait, when the acknowledgement has come or is overdue.
+/// So if urgent messages must not wait behind a blocking send, use sendtoAsync() for everything else.
+/// getQueueStats() reports how long the messages in each class spend in the queue, and 
+/// queueHeadDelay() how long the message at the head of a class has been waiting so far.
+///
 /// \par Headers
 ///
 /// Each message sent and received by a RadioHead driver includes 4 headers:<br>
@@ -70,6 +150,95 @@ public:
     /// \return true if the message not too loing fot eh driver, and the message was transmitted.
     bool sendto(uint8_t* buf, uint8_t len, uint8_t address);
 
+    /// Sends a message to the node(s) with the given address, coalesced with other small messages 
+    /// for the same address into one frame if possible. See the section on Message Coalescing above.
+    /// If there is no transmit buffer for coalescing, or the message is too long to be coalesced, any messages being held are 
+    /// sent, and then this message is sent at once as by sendto().
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send (> 0)
+    /// \param[in] address The address to send the message to.
+    /// \return true if the message was held for coalescing, or was sent
+    bool sendtoCoalesced(uint8_t* buf, uint8_t len, uint8_t address);
+
+    /// Puts a message in the transmit queue, to be sent by serviceQueue() according to its priority.
+    /// See the section on Transmit Queue above.
+    /// If the queue is disabled, the message is sent at once as by sendto().
+    /// \param[in] buf Pointer to the binary message to send. It is copied.
+    /// \param[in] len Number of octets to send (> 0). No more than RH_DATAGRAM_QUEUE_MSG_LEN
+    /// \param[in] address The address to send the message to.
+    /// \param[in] priority The priority class, from 0 (the highest) to RH_DATAGRAM_QUEUE_CLASSES - 1
+    /// \param[in] id The ID header to send with the message
+    /// \param[in] flags The FLAGS header to send with the message
+    /// \return true if the message was put in the queue (or sent). false if the class is full 
+    /// or the message is too long, in which case it is counted as dropped.
+    bool sendtoQueued(uint8_t* buf, uint8_t len, uint8_t address, uint8_t priority, uint8_t id = 0, uint8_t flags = RH_FLAGS_NONE);
+
+    /// If the radio is not transmitting, sends the next message from the transmit queue.
+    /// \return true if a message was sent
+    bool serviceQueue();
+
+    /// Returns the number of messages waiting in the transmit queue
+    /// \return The number of messages in all classes
+    uint8_t queueLength();
+
+    /// Sets how serviceQueue() shares the radio between the priority classes. 
+    /// By default, or if weights is NULL, the classes are served in strict priority order.
+    /// Else, in each round, class i may send weights[i] messages before a lower 
+    /// priority class that still has some of its share left. When no class that has messages waiting 
+    /// has any of its share left, a new round starts.
+    /// \param[in] weights Array of RH_DATAGRAM_QUEUE_CLASSES weights, or NULL
+    void setQueueWeights(uint8_t* weights);
+
+    /// Returns how long the message at the head of a priority class has been waiting.
+    /// \param[in] priority The priority class
+    /// \return The time in milliseconds, or 0 if there are no messages in the class
+    uint16_t queueHeadDelay(uint8_t priority);
+
+    /// Statistics about a priority class of the transmit queue
+    typedef struct
+    {
+	uint16_t      queued;      ///< Messages put in the queue
+	uint16_t      sent;        ///< Messages sent from the queue
+	uint16_t      dropped;     ///< Messages that could not be put in the queue because it was full
+	uint16_t      delay;       ///< Moving average of the time from queueing to sending in milliseconds * 8
+	uint16_t      maxDelay;    ///< Longest time from queueing to sending in milliseconds
+    } QueueStats;
+
+    /// Returns the statistics for a priority class of the transmit queue
+    /// \param[in] priority The priority class
+    /// \return Pointer to the QueueStats for the class, or NULL if there is no such class
+    QueueStats* getQueueStats(uint8_t priority);
+
+    /// Gives RHDatagram the buffers for coalescing messages, and sets the limits that decide when 
+    /// the messages held by sendtoCoalesced() are sent. Coalescing is disabled until this is called.
+    /// Does nothing if RH_DATAGRAM_COALESCING is 0.
+    /// Any messages being held are sent first.
+    /// \param[in] txBuf Buffer of len octets for sendtoCoalesced() to hold messages in, 
+    /// or NULL to send every message at once.
+    /// \param[in] rxBuf Buffer of len octets for recvfrom() to unpack coalesced frames in, 
+    /// or NULL to discard coalesced frames.
+    /// \param[in] len The length of the buffers. This is also the maximum length of a coalesced frame, 
+    /// including the length octets, although it is limited to maxMessageLength() when sending.
+    /// \param[in] maxDelay The maximum time in milliseconds that a message may be held
+    void setCoalescing(uint8_t* txBuf, uint8_t* rxBuf, uint8_t len, uint16_t maxDelay);
+
+    /// Sends any messages being held by sendtoCoalesced() at once.
+    /// \return true if there were no messages being held, or they were sent
+    bool flushCoalesced();
+
+    /// Returns the number of frames of coalesced messages sent by flushCoalesced()
+    /// \return The number of frames
+    uint32_t coalescedFrames();
+
+    /// Returns the number of messages sent by flushCoalesced()
+    /// \return The number of messages
+    uint32_t coalescedMessages();
+
+    /// Returns the number of message octets (not including the length octets) sent by flushCoalesced(). 
+    /// Divide by coalescedFrames() to get the average payload per frame.
+    /// \return The number of octets
+    uint32_t coalescedOctets();
+
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available for this node, copy it to buf and return true
     /// The SRC address is placed in *from if present and not NULL.
@@ -151,12 +320,109 @@ public:
     /// \return The address of this node
     uint8_t         thisAddress();
 
+    /// Returns the maximum message length that can be sent by the Driver
+    /// \return The maximum legal message length
+    uint8_t         maxMessageLength();
+
 protected:
     /// The Driver we are to use
     RHGenericDriver&        _driver;
 
     /// The address of this node
     uint8_t         _thisAddress;
+
+    /// Called by serviceQueue() when it has started to transmit a message from the queue. 
+    /// Subclasses can override this to find out when their queued messages go.
+    /// It is virtual whether or not the queue is enabled, so the class layout is the same either way.
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID of the message
+    virtual void    queuedSent(uint8_t to, uint8_t id);
+
+    /// Stops serviceQueue() sending anything while hold is true. RHReliableDatagram holds the queue 
+    /// while it waits for an acknowledgement, which a half-duplex radio would miss while transmitting.
+    /// \param[in] hold true to hold the queue, false to let it go again
+    void            holdQueue(bool hold);
+
+private:
+#if RH_DATAGRAM_QUEUE_CLASSES > 0
+    /// true while holdQueue() holds the queue
+    bool            _queueHeld;
+
+    /// A message in the transmit queue
+    typedef struct
+    {
+	uint8_t       to;        ///< TO header of the message
+	uint8_t       id;        ///< ID header of the message
+	uint8_t       flags;     ///< FLAGS header of the message
+	uint8_t       len;       ///< Length of the message
+	unsigned long time;      ///< millis() when the message was put in the queue
+	uint8_t       data[RH_DATAGRAM_QUEUE_MSG_LEN]; ///< The message
+    } QueuedFrame;
+
+    /// The transmit queue: a ring buffer for each priority class
+    QueuedFrame     _queue[RH_DATAGRAM_QUEUE_CLASSES][RH_DATAGRAM_QUEUE_DEPTH];
+
+    /// Index of the oldest message in each class of _queue
+    uint8_t         _queueHead[RH_DATAGRAM_QUEUE_CLASSES];
+
+    /// Number of messages in each class of _queue
+    uint8_t         _queueCount[RH_DATAGRAM_QUEUE_CLASSES];
+
+    /// Share of the frames in each round for each class. All 0 for strict priority
+    uint8_t         _queueWeight[RH_DATAGRAM_QUEUE_CLASSES];
+
+    /// What is left of the share of each class in this round
+    uint8_t         _queueCredit[RH_DATAGRAM_QUEUE_CLASSES];
+
+    /// Statistics for each class
+    QueueStats      _queueStats[RH_DATAGRAM_QUEUE_CLASSES];
+#endif
+
+#if RH_DATAGRAM_COALESCING
+    /// Sends the messages held by sendtoCoalesced() if the oldest one has been held for too long
+    void            flushCoalescedIfDue();
+
+    /// Buffer for the messages held by sendtoCoalesced(), each preceded by its length. NULL if not coalescing
+    uint8_t*        _txCoalesced;
+
+    /// Number of octets in _txCoalesced
+    uint8_t         _txCoalescedLen;
+
+    /// Number of messages in _txCoalesced
+    uint8_t         _txCoalescedCount;
+
+    /// Destination of the messages in _txCoalesced
+    uint8_t         _txCoalescedTo;
+
+    /// millis() when the first message was put in _txCoalesced
+    unsigned long   _txCoalescedTime;
+
+    /// Length of _txCoalesced and _rxCoalesced
+    uint8_t         _coalesceMaxLen;
+
+    /// Maximum time to hold a message, in milliseconds
+    uint16_t        _coalesceMaxDelay;
+
+    /// Buffer for the coalesced frame being unpacked by recvfrom(). NULL to discard coalesced frames
+    uint8_t*        _rxCoalesced;
+
+    /// Number of octets in _rxCoalesced
+    uint8_t         _rxCoalescedLen;
+
+    /// Index of the length octet of the next message to return from _rxCoalesced
+    uint8_t         _rxCoalescedPos;
+
+    /// Headers of the frame in _rxCoalesced
+    uint8_t         _rxCoalescedTo;
+    uint8_t         _rxCoalescedFrom;
+    uint8_t         _rxCoalescedId;
+    uint8_t         _rxCoalescedFlags;
+
+    /// Counts of what has been sent by flushCoalesced()
+    uint32_t        _coalescedFrames;
+    uint32_t        _coalescedMessages;
+    uint32_t        _coalescedOctets;
+#endif
 };
 
 #endif
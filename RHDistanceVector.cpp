@@ -0,0 +1,360 @@
+// RHDistanceVector.cpp
+//
+// Proactive distance vector routing with periodic HELLO beacons
+//
+// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers
+// (see http://www.hoperf.com)
+//
+// $Id: $
+
+#include <RHDistanceVector.h>
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHDistanceVector::RHDistanceVector(RHGenericDriver& driver, uint8_t thisAddress)
+    : RHRouter(driver, thisAddress)
+{
+    uint8_t i;
+    for (i = 0; i < RH_DV_TABLE_SIZE; i++)
+	_distances[i].dest = RH_BROADCAST_ADDRESS;
+    _seq = 0;
+    _beaconInterval = RH_DV_BEACON_INTERVAL;
+    _lastBeacon = 0;
+    _beaconDelay = 0;
+    _beaconsSent = 0;
+    _beaconOctets = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+
+////////////////////////////////////////////////////////////////////
+bool RHDistanceVector::init()
+{
+    bool ret = RHRouter::init();
+    // The first beacon is due soon, but not at the same moment as those of nodes that started with this one
+    _lastBeacon = millis();
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    _beaconDelay = (_beaconInterval / 8) * (random() & 0xFF) / 256;
+#else
+    _beaconDelay = (_beaconInterval / 8) * random(0, 256) / 256;
+#endif
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::setBeaconInterval(unsigned long interval)
+{
+    _beaconInterval = interval;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHDistanceVector::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t flags)
+{
+    if (len > RH_DV_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    // Routes are known in advance, so there is nothing to discover
+    DistanceVectorApplicationMessage* a = (DistanceVectorApplicationMessage*)&_tmpMessage;
+    a->header.msgType = RH_DV_MESSAGE_TYPE_APPLICATION;
+    memcpy(a->data, buf, len);
+    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHDistanceVector::DistanceVectorMessageHeader) + len, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::serviceRoutes()
+{
+    unsigned long now = millis();
+    unsigned long lifetime = _beaconInterval * RH_DV_ROUTE_LIFETIME;
+    uint8_t i;
+    for (i = 0; i < RH_DV_TABLE_SIZE; i++)
+    {
+	if (   _distances[i].dest == RH_BROADCAST_ADDRESS
+	    || now - _distances[i].updated <= lifetime)
+	    continue;
+	if (_distances[i].metric == RH_DV_INFINITY)
+	    _distances[i].dest = RH_BROADCAST_ADDRESS; // Broken for long enough that everyone knows
+	else
+	    breakRoute(&_distances[i]); // No longer advertised
+    }
+    if (now - _lastBeacon >= _beaconDelay)
+	sendBeacon();
+}
+
+////////////////////////////////////////////////////////////////////
+RHDistanceVector::DistanceVectorEntry* RHDistanceVector::getDistanceTo(uint8_t dest)
+{
+    uint8_t i;
+    for (i = 0; i < RH_DV_TABLE_SIZE; i++)
+	if (_distances[i].dest == dest)
+	    return &_distances[i];
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHDistanceVector::beaconsSent()
+{
+    return _beaconsSent;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHDistanceVector::beaconOctets()
+{
+    return _beaconOctets;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::resetBeaconStats()
+{
+    _beaconsSent = 0;
+    _beaconOctets = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::sendBeacon()
+{
+    _seq += 2;
+    DistanceVectorHelloMessage* h = (DistanceVectorHelloMessage*)&_tmpMessage;
+    h->header.msgType = RH_DV_MESSAGE_TYPE_HELLO;
+    h->seq = _seq;
+    uint8_t maxLen = maxMessageLength() - sizeof(RoutedMessageHeader);
+    if (maxLen > RH_ROUTER_MAX_MESSAGE_LEN)
+	maxLen = RH_ROUTER_MAX_MESSAGE_LEN;
+    uint8_t len = sizeof(DistanceVectorMessageHeader) + 1;
+    uint8_t messages = 0;
+    uint8_t i;
+    for (i = 0; i <= RH_DV_TABLE_SIZE; i++)
+    {
+	if (   i == RH_DV_TABLE_SIZE
+	    ? (len > sizeof(DistanceVectorMessageHeader) + 1 || !messages)
+	    : (_distances[i].dest != RH_BROADCAST_ADDRESS && len + 3 > maxLen))
+	{
+	    // Full, or the last one
+	    RHRouter::sendtoWait(_tmpMessage, len, RH_BROADCAST_ADDRESS);
+	    _beaconsSent++;
+	    _beaconOctets += sizeof(RoutedMessageHeader) + len;
+	    len = sizeof(DistanceVectorMessageHeader) + 1;
+	    messages++;
+	}
+	if (i == RH_DV_TABLE_SIZE || _distances[i].dest == RH_BROADCAST_ADDRESS)
+	    continue;
+	h->routes[len - sizeof(DistanceVectorMessageHeader) - 1] = _distances[i].dest;
+	h->routes[len - sizeof(DistanceVectorMessageHeader)]     = _distances[i].metric;
+	h->routes[len - sizeof(DistanceVectorMessageHeader) + 1] = _distances[i].seq;
+	len += 3;
+    }
+
+    // Next one in about a beacon interval, give or take an eighth
+    _lastBeacon = millis();
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    _beaconDelay = _beaconInterval - _beaconInterval / 8 + (_beaconInterval / 4) * (random() & 0xFF) / 256;
+#else
+    _beaconDelay = _beaconInterval - _beaconInterval / 8 + (_beaconInterval / 4) * random(0, 256) / 256;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::triggerBeacon()
+{
+    // Soon, but not so soon that a burst of changes causes a burst of beacons
+    if (_beaconDelay > _beaconInterval / 8)
+	_beaconDelay = _beaconInterval / 8;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::receivedBeacon(DistanceVectorHelloMessage* hello, uint8_t len, uint8_t from, uint8_t iface)
+{
+    // The neighbour itself is one hop away
+    updateRoute(from, from, 1, hello->seq, iface);
+
+    uint8_t i;
+    uint8_t numRoutes = (len - sizeof(DistanceVectorMessageHeader) - 1) / 3;
+    for (i = 0; i < numRoutes; i++)
+    {
+	uint8_t dest = hello->routes[i * 3];
+	uint8_t metric = hello->routes[i * 3 + 1];
+	uint8_t seq = hello->routes[i * 3 + 2];
+	if (dest == _thisAddress)
+	{
+	    // If we restarted, our neighbours may have heard a newer sequence number from us than
+	    // we have now, and would ignore our routes. Jump past it, and let them know
+	    if ((int8_t)(seq - _seq) > 0)
+	    {
+		_seq = (seq | 1) + 1;
+		triggerBeacon();
+	    }
+	    continue;
+	}
+	if (dest == from)
+	    continue; // Already know that
+	if (metric != RH_DV_INFINITY)
+	    metric = metric >= _max_hops ? RH_DV_INFINITY : metric + 1;
+	updateRoute(dest, from, metric, seq, iface);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::updateRoute(uint8_t dest, uint8_t next_hop, uint8_t metric, uint8_t seq, uint8_t iface)
+{
+    DistanceVectorEntry* entry = getDistanceTo(dest);
+    if (!entry)
+    {
+	// A new destination. No point keeping it if it is broken already
+	if (metric == RH_DV_INFINITY || !(entry = getDistanceTo(RH_BROADCAST_ADDRESS)))
+	    return;
+	entry->dest = dest;
+	entry->metric = RH_DV_INFINITY;
+	entry->seq = seq;
+	entry->next_hop = next_hop;
+    }
+    else
+    {
+	// Take a newer route, or a shorter one as new, or anything the destination says itself
+	int8_t newer = seq - entry->seq;
+	if (   dest != next_hop
+	    && newer < 0)
+	    return;
+	if (   dest != next_hop
+	    && newer == 0
+	    && metric >= entry->metric
+	    && (next_hop != entry->next_hop || metric > entry->metric))
+	    return;
+    }
+    if (entry->next_hop != next_hop)
+	deleteRouteTo(dest); // RHRouter might otherwise keep the old next hop as an alternate
+    if (   metric == RH_DV_INFINITY
+	? entry->metric != RH_DV_INFINITY
+	: entry->metric == RH_DV_INFINITY)
+	triggerBeacon(); // Broken or new
+    entry->next_hop = next_hop;
+    entry->metric = metric;
+    entry->seq = seq;
+    entry->iface = iface;
+    entry->updated = millis();
+    if (metric == RH_DV_INFINITY)
+	deleteRouteTo(dest);
+    else
+	addRouteTo(dest, next_hop, Valid, metric, iface);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHDistanceVector::breakRoute(DistanceVectorEntry* entry)
+{
+    // The destination itself will give the next even sequence number, with a new route
+    entry->metric = RH_DV_INFINITY;
+    entry->seq |= 1;
+    entry->updated = millis();
+    deleteRouteTo(entry->dest);
+    triggerBeacon();
+}
+
+////////////////////////////////////////////////////////////////////
+// This is called when a message is to be delivered to the next hop
+uint8_t RHDistanceVector::route(RoutedMessage* message, uint8_t messageLen)
+{
+    uint8_t from = _rxFrom; // Might get clobbered during call to superclass route()
+    uint8_t iface = _rxInterface;
+    uint8_t ret = RHRouter::route(message, messageLen);
+    if (   ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER
+	&& message->header.dest != RH_BROADCAST_ADDRESS)
+	routeFailed(message, messageLen, from, iface);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+// Called when a message cant be delivered to the next hop
+void RHDistanceVector::routeFailed(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface)
+{
+    // The link to the next hop is down. Break every route through it
+    DistanceVectorEntry* failed = getDistanceTo(message->header.dest);
+    if (!failed || failed->metric == RH_DV_INFINITY)
+	return;
+    uint8_t next_hop = failed->next_hop;
+    uint8_t i;
+    for (i = 0; i < RH_DV_TABLE_SIZE; i++)
+	if (   _distances[i].dest != RH_BROADCAST_ADDRESS
+	    && _distances[i].next_hop == next_hop
+	    && _distances[i].metric != RH_DV_INFINITY)
+	    breakRoute(&_distances[i]);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHDistanceVector::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+{
+    serviceRoutes();
+
+    uint8_t tmpMessageLen = sizeof(_tmpMessage);
+    uint8_t _source;
+    uint8_t _dest;
+    uint8_t _id;
+    uint8_t _flags;
+    if (RHRouter::recvfromAck(_tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags))
+    {
+	DistanceVectorMessageHeader* p = (DistanceVectorMessageHeader*)&_tmpMessage;
+
+	if (   tmpMessageLen >= 1
+	    && p->msgType == RH_DV_MESSAGE_TYPE_APPLICATION)
+	{
+	    DistanceVectorApplicationMessage* a = (DistanceVectorApplicationMessage*)p;
+	    // Handle application layer messages, presumably for our caller
+	    if (source) *source = _source;
+	    if (dest)   *dest   = _dest;
+	    if (id)     *id     = _id;
+	    if (flags)  *flags  = _flags;
+	    uint8_t msgLen = tmpMessageLen - sizeof(DistanceVectorMessageHeader);
+	    if (*len > msgLen)
+		*len = msgLen;
+	    memcpy(buf, a->data, *len);
+
+	    return true;
+	}
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Beacons are for us, not the application
+bool RHDistanceVector::isControlMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    DistanceVectorMessageHeader* p = (DistanceVectorMessageHeader*)message->data;
+    return    messageLen >= sizeof(RoutedMessageHeader) + 1
+	   && p->msgType == RH_DV_MESSAGE_TYPE_HELLO;
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by RHRouter::recvfromAck, even while sendtoWait() is waiting for an end-to-end acknowledgement
+void RHDistanceVector::handleControlMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    uint8_t len = messageLen - sizeof(RoutedMessageHeader);
+    if (   message->header.dest == RH_BROADCAST_ADDRESS
+	&& message->header.source == _rxFrom
+	&& len >= 2)
+    {
+	// A beacon from a neighbour
+	receivedBeacon((DistanceVectorHelloMessage*)message->data, len, _rxFrom, _rxInterface);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHDistanceVector::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+{
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	// Wake up in time to send the next beacon
+	unsigned long sinceBeacon = millis() - _lastBeacon;
+	if (sinceBeacon >= _beaconDelay)
+	    serviceRoutes();
+	else if (_beaconDelay - sinceBeacon < (unsigned long)timeLeft)
+	    timeLeft = _beaconDelay - sinceBeacon;
+	if (waitAvailableTimeout(timeLeft))
+	{
+	    if (recvfromAck(buf, len, from, to, id, flags))
+		return true;
+	}
+	YIELD;
+    }
+    return false;
+}
+
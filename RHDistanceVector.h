@@ -0,0 +1,296 @@
+// RHDistanceVector.h
+//
+// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers
+// (see http://www.hoperf.com)
+//
+// $Id: $
+
+#ifndef RHDistanceVector_h
+#define RHDistanceVector_h
+
+#include <RHRouter.h>
+
+// Types of RHDistanceVector message, used to set msgType in the DistanceVectorMessageHeader
+#define RH_DV_MESSAGE_TYPE_APPLICATION                      0
+#define RH_DV_MESSAGE_TYPE_HELLO                            1
+
+// The default interval in milliseconds between HELLO beacons
+#ifndef RH_DV_BEACON_INTERVAL
+#define RH_DV_BEACON_INTERVAL 5000
+#endif
+
+// The number of beacon intervals after which a route that has not been advertised again is broken,
+// and after which a broken route is forgotten
+#ifndef RH_DV_ROUTE_LIFETIME
+#define RH_DV_ROUTE_LIFETIME 3
+#endif
+
+// The maximum number of destinations in the distance vector table.
+// Routes to further destinations are ignored
+#ifndef RH_DV_TABLE_SIZE
+#define RH_DV_TABLE_SIZE RH_ROUTING_TABLE_SIZE
+#endif
+
+// The metric of a broken route
+#define RH_DV_INFINITY 0xff
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHDistanceVector RHDistanceVector.h <RHDistanceVector.h>
+/// \brief RHRouter subclass for sending addressed, optionally acknowledged datagrams
+/// multi-hop routed across a network, with routes kept up to date in advance by periodic beacons
+///
+/// Manager class that extends RHRouter to add proactive distance vector routing.
+///
+/// RHMesh is reactive: it discovers a route only when it has a message to send, so the first message to
+/// each destination waits for a route discovery (up to RH_MESH_ARP_TIMEOUT milliseconds), which floods
+/// the network. RHDistanceVector instead keeps routes to every node in the network in the routing table all the
+/// time, so that any message can be sent at once, at the cost of a small and steady amount of control traffic.
+/// Use it where the first message matters, such as for alarms, and RHMesh where traffic is rare and
+/// the network is large.
+/// All the nodes in a network must use the same one.
+///
+/// \par Beacons
+///
+/// Every node broadcasts a HELLO beacon (DistanceVectorHelloMessage) to its neighbours every beacon interval
+/// (RH_DV_BEACON_INTERVAL milliseconds by default, see setBeaconInterval()), give or take a random eighth
+/// of the interval so that neighbours do not keep colliding. The beacon carries the sequence number of the node,
+/// which it increases by 2 for each beacon, and for each destination in its distance vector table,
+/// the number of hops to it and the last sequence number it has heard from it.
+/// If they do not all fit in one message, the beacon is sent as several messages.
+/// A node that hears a beacon has a route to its neighbour with a metric of 1, and routes
+/// via its neighbour to each destination in the beacon with one more hop. It takes a route if
+/// its sequence number is newer than the one it has, or the same but with fewer hops,
+/// and adds it to the RHRouter routing table. Because sequence numbers only come from the destinations
+/// themselves, routes never form loops (this is the method of DSDV).
+/// New destinations and broken routes are advertised soon, with a beacon sent as soon as an eighth of the
+/// beacon interval has passed since the last one.
+///
+/// \par Broken Routes
+///
+/// If a route is not advertised again within RH_DV_ROUTE_LIFETIME beacon intervals, or a neighbour does
+/// not acknowledge a message sent through it, the route (and every other route through that neighbour)
+/// is broken: it is deleted from the routing table, and advertised with a metric of RH_DV_INFINITY and the next
+/// (odd) sequence number, so the nodes that were routing through this one stop doing so.
+/// A new route to the destination is taken as soon as a neighbour advertises one that is newer.
+/// A node that restarts with a sequence number lower than the one its neighbours have heard from it
+/// raises its own sequence number past theirs as soon as it hears them advertise it.
+///
+/// \par Message Format
+///
+/// RHDistanceVector uses message formats layered on top of RHRouter:
+/// - DistanceVectorApplicationMessage (message type RH_DV_MESSAGE_TYPE_APPLICATION).
+///   Carries an application layer message for the caller of RHDistanceVector
+/// - DistanceVectorHelloMessage (message type RH_DV_MESSAGE_TYPE_HELLO). A beacon, broadcast
+///   to the neighbours of a node: 1 octet SEQ, the sequence number of the node, then 3 octets for each
+///   destination: DEST, METRIC and SEQ.
+///
+/// \par Memory
+///
+/// The distance vector table has RH_DV_TABLE_SIZE entries of 9 octets, in addition to the RHRouter routing table.
+/// RH_DV_TABLE_SIZE defaults to RH_ROUTING_TABLE_SIZE, and should be at least the number of nodes in the network.
+///
+/// \par Performance
+///
+/// Each node sends at least one beacon of 2 + 3 * (number of destinations) octets (plus the RHRouter header)
+/// every beacon interval, whether or not there is any other traffic, so choose the beacon interval to suit
+/// how fast the network changes. After a node starts, it can reach destinations n hops away after n beacons
+/// at most, and usually much sooner because new destinations are advertised at once.
+class RHDistanceVector : public RHRouter
+{
+public:
+
+    /// The maximum length permitted for the application payload data in a RHDistanceVector message
+    #define RH_DV_MAX_MESSAGE_LEN (RH_ROUTER_MAX_MESSAGE_LEN - sizeof(RHDistanceVector::DistanceVectorMessageHeader))
+
+    /// Structure of the basic RHDistanceVector header.
+    typedef struct
+    {
+	uint8_t             msgType;  ///< Type of RHDistanceVector message, one of RH_DV_MESSAGE_TYPE_*
+    } DistanceVectorMessageHeader;
+
+    /// Signals an application layer message for the caller of RHDistanceVector
+    typedef struct
+    {
+	DistanceVectorMessageHeader header; ///< msgType = RH_DV_MESSAGE_TYPE_APPLICATION
+	uint8_t             data[RH_DV_MAX_MESSAGE_LEN]; ///< Application layer payload data
+    } DistanceVectorApplicationMessage;
+
+    /// Signals a HELLO beacon
+    typedef struct
+    {
+	DistanceVectorMessageHeader header; ///< msgType = RH_DV_MESSAGE_TYPE_HELLO
+	uint8_t             seq;     ///< Sequence number of the node sending the beacon
+	uint8_t             routes[RH_DV_MAX_MESSAGE_LEN - 1]; ///< DEST, METRIC and SEQ of each destination. Length is implicit
+    } DistanceVectorHelloMessage;
+
+    /// Defines an entry in the distance vector table
+    typedef struct
+    {
+	uint8_t             dest;     ///< Destination node address. RH_BROADCAST_ADDRESS if unused
+	uint8_t             next_hop; ///< The neighbour the route goes through
+	uint8_t             metric;   ///< Number of hops to dest. RH_DV_INFINITY if the route is broken
+	uint8_t             seq;      ///< Last sequence number heard from dest. Odd if the route is broken
+	uint8_t             iface;    ///< The interface next_hop is reached through
+	unsigned long       updated;  ///< Value of millis() when the route was last advertised
+    } DistanceVectorEntry;
+
+    /// Constructor.
+    /// \param[in] driver The RadioHead driver to use to transport messages.
+    /// \param[in] thisAddress The address to assign to this node. Defaults to 0
+    RHDistanceVector(RHGenericDriver& driver, uint8_t thisAddress = 0);
+
+    /// Initialises this instance and the radio module connected to it.
+    /// Overrides the init() function in RHRouter. The first beacon is sent soon afterwards
+    bool init();
+
+    /// Sends a message to the destination node. Initialises the RHRouter message header
+    /// (the SOURCE address is set to the address of this node, HOPS to 0) and calls
+    /// route() which looks up in the routing table the next hop to deliver to.
+    /// Then waits for an acknowledgement from the next hop
+    /// (but not from the destination node (if that is different), unless flags includes
+    /// RH_ROUTER_FLAGS_E2E_ACK_REQUEST (see RHRouter::sendtoWait()).
+    /// Unlike RHMesh, it does not discover routes: if none has been advertised yet, there is none.
+    /// \param [in] buf The application message data
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest The destination node address. If the address is RH_BROADCAST_ADDRESS (255)
+    /// the message will be broadcast to all the nearby nodes, but not routed or relayed.
+    /// \param [in] flags Optional flags for use by subclasses or application layer,
+    ///             delivered end-to-end to the dest address. The receiver can recover the flags with recvFromAck().
+    ///             The bits in RH_ROUTER_FLAGS_RESERVED are not delivered.
+    /// \return The result code:
+    ///         - RH_ROUTER_ERROR_NONE Message was routed and delivered to the next hop
+    ///           (not necessarily to the final dest address), or to the dest address if
+    ///           RH_ROUTER_FLAGS_E2E_ACK_REQUEST was set
+    ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
+    ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop
+    ///           (usually because it dod not acknowledge due to being off the air or out of range
+    ///         - RH_ROUTER_ERROR_NO_REPLY RH_ROUTER_FLAGS_E2E_ACK_REQUEST was set, and the dest address did not
+    ///           acknowledge the message end-to-end
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+
+    /// Starts the receiver if it is not running already, sends a beacon if one is due,
+    /// processes and possibly routes any received messages addressed to other nodes,
+    /// processes any received beacons, and delivers any messages addressed to this node.
+    /// If there is a valid application layer message available for this node (or RH_BROADCAST_ADDRESS),
+    /// copy the application message payload data to buf and return true
+    /// else return false.
+    /// You must call this (or recvfromAckTimeout()) often, or beacons will not be sent.
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was received for this node and copied to buf
+    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Starts the receiver if it is not running already.
+    /// Similar to recvfromAck(), this will block until either a valid application layer
+    /// message available for this node
+    /// or the timeout expires, sending beacons when they are due.
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was copied to buf
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Sends a beacon if one is due, and breaks routes that have not been advertised for too long.
+    /// Called by recvfromAck() and recvfromAckTimeout(). You only need to call it if your node
+    /// does not call them for a long time.
+    void serviceRoutes();
+
+    /// Sets the interval between beacons. All the nodes in a network should use the same interval.
+    /// \param [in] interval The interval in milliseconds. Defaults to RH_DV_BEACON_INTERVAL
+    void setBeaconInterval(unsigned long interval);
+
+    /// Finds the entry in the distance vector table for a destination
+    /// \param [in] dest The destination node address
+    /// \return Pointer to the entry, or NULL if there is none. Its route may be broken
+    DistanceVectorEntry* getDistanceTo(uint8_t dest);
+
+    /// Returns the number of beacon messages sent
+    /// since starting or since the last call to resetBeaconStats().
+    /// \return The number of beacon messages
+    uint32_t beaconsSent();
+
+    /// Returns the number of octets of beacon messages sent (including the RHRouter header)
+    /// \return The number of octets
+    uint32_t beaconOctets();
+
+    /// Resets the counts returned by beaconsSent() and beaconOctets() to 0.
+    void resetBeaconStats();
+
+protected:
+
+    /// Breaks the routes through the next hop that failed, so that they are advertised as broken
+    /// \param [in] message Pointer to the RHRouter message that could not be delivered
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node the message was received from
+    /// \param [in] iface The interface the message was received through
+    virtual void routeFailed(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface);
+
+    /// Calls RHRouter::route(), and routeFailed() if it fails
+    /// \param [in] message Pointer to the RHRouter message to be sent.
+    /// \param [in] messageLen Length of message in octets
+    virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
+
+    /// Says that beacons are for RHDistanceVector itself
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    /// \return true if the message is a beacon
+    virtual bool isControlMessage(RoutedMessage* message, uint8_t messageLen);
+
+    /// Processes beacons from neighbours, even while sendtoWait() is waiting for an end-to-end acknowledgement
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    virtual void handleControlMessage(RoutedMessage* message, uint8_t messageLen);
+
+private:
+    /// Sends a beacon, as several messages if necessary
+    void sendBeacon();
+
+    /// Processes a beacon received from a neighbour
+    void receivedBeacon(DistanceVectorHelloMessage* hello, uint8_t len, uint8_t from, uint8_t iface);
+
+    /// Takes a route advertised by a neighbour if it is better than the one in the distance vector table
+    void updateRoute(uint8_t dest, uint8_t next_hop, uint8_t metric, uint8_t seq, uint8_t iface);
+
+    /// Marks a route broken, and deletes it from the routing table
+    void breakRoute(DistanceVectorEntry* entry);
+
+    /// Brings the next beacon forward, to advertise a change soon
+    void triggerBeacon();
+
+    /// Temporary message buffer. Not static, so that several instances can be used at once
+    uint8_t             _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+
+    /// The distance vector table
+    DistanceVectorEntry _distances[RH_DV_TABLE_SIZE];
+
+    /// The sequence number of this node. Always even
+    uint8_t             _seq;
+
+    /// Interval between beacons in milliseconds
+    unsigned long       _beaconInterval;
+
+    /// Value of millis() when the last beacon was sent
+    unsigned long       _lastBeacon;
+
+    /// Time after _lastBeacon that the next beacon is due
+    unsigned long       _beaconDelay;
+
+    /// Count of beacon messages sent
+    uint32_t            _beaconsSent;
+
+    /// Count of octets of beacon messages sent
+    uint32_t            _beaconOctets;
+};
+
+/// @example simulator_distance_vector_node.pde
+
+#endif
+
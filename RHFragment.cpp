@@ -0,0 +1,425 @@
+// RHFragment.cpp
+//
+// Sends and receives long messages as a series of fragments
+//
+// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers
+// (see http://www.hoperf.com)
+//
+// $Id: $
+
+#include <RHFragment.h>
+#include <RHRouter.h>
+#include <RHMesh.h>
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHFragment::RHFragment(RHReliableDatagram& manager)
+    : _manager(manager),
+      _router(NULL),
+      _mesh(NULL)
+{
+    init();
+}
+
+RHFragment::RHFragment(RHRouter& router)
+    : _manager(router),
+      _router(&router),
+      _mesh(NULL)
+{
+    init();
+}
+
+RHFragment::RHFragment(RHMesh& mesh)
+    : _manager(mesh),
+      _router(&mesh),
+      _mesh(&mesh)
+{
+    init();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragment::init()
+{
+    _timeout = RH_FRAGMENT_DEFAULT_TIMEOUT;
+    _retries = RH_FRAGMENT_DEFAULT_RETRIES;
+    _reassemblyTimeout = RH_FRAGMENT_DEFAULT_REASSEMBLY_TIMEOUT;
+    _lastTransfer = 0;
+    _transferStarted = false;
+    _goodput = 0;
+    _retransmissions = 0;
+    _reassemblyTimeouts = 0;
+    _rxActive = false;
+    _rxSize = 0;
+    _rxDoneFrom = RH_BROADCAST_ADDRESS;
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+void RHFragment::setTimeout(uint16_t timeout)
+{
+    _timeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragment::setRetries(uint8_t retries)
+{
+    _retries = retries;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragment::setReassemblyTimeout(uint16_t timeout)
+{
+    _reassemblyTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHFragment::maxFragmentLength()
+{
+    uint16_t len = _manager.maxMessageLength();
+    if (_router)
+    {
+	// Less the end-to-end header
+	len = (len > sizeof(RHRouter::RoutedMessageHeader)) ? len - sizeof(RHRouter::RoutedMessageHeader) : 0;
+	if (len > RH_ROUTER_MAX_MESSAGE_LEN)
+	    len = RH_ROUTER_MAX_MESSAGE_LEN;
+    }
+    if (_mesh)
+	len = (len > sizeof(RHMesh::MeshMessageHeader)) ? len - sizeof(RHMesh::MeshMessageHeader) : 0;
+    // Leave room for the fragment header and something to go with it
+    return (len > 2 * RH_FRAGMENT_HEADER_LEN) ? len - RH_FRAGMENT_HEADER_LEN : 0;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHFragment::sendtoWait(uint8_t* buf, uint16_t len, uint8_t address)
+{
+    uint8_t size = maxFragmentLength();
+    if (!len || !size || address == RH_BROADCAST_ADDRESS)
+	return RH_FRAGMENT_ERROR_INVALID_LENGTH;
+
+    uint16_t count = (len + size - 1) / size;
+    uint16_t base = 0;         // All fragments before this have been received
+    uint32_t received = 0;     // Bit i set if fragment base + i has been received
+    uint16_t nextNew = 0;      // The first fragment that has never been sent
+    uint8_t tries = 0;
+    bool replied = true;
+    unsigned long startTime = millis();
+    if (!_transferStarted)
+    {
+	// Not from 0, or a receiver that remembers our last message from before a restart may take 
+	// the first one for it. Chosen now rather than in the constructor, after the caller has 
+	// had a chance to seed random()
+	_lastTransfer = random(0, 0x100) ^ startTime;
+	_transferStarted = true;
+    }
+    _lastTransfer++;
+
+    while (base < count)
+    {
+	if (tries++ > _retries)
+	    return RH_FRAGMENT_ERROR_NO_REPLY;
+
+	// Send all the fragments in the window that the receiver does not have yet,
+	// and ask for the status with the last of them. If we got no status last time, 
+	// the poll may have been lost, so just send it again
+	uint16_t end = (count - base > RH_FRAGMENT_WINDOW) ? base + RH_FRAGMENT_WINDOW : count;
+	uint16_t last = end - 1;
+	while (last > base && (received & (1UL << (last - base))))
+	    last--;
+	uint16_t i;
+	for (i = replied ? base : last; i <= last; i++)
+	{
+	    if (received & (1UL << (i - base)))
+		continue;
+	    if (i < nextNew)
+		_retransmissions++;
+	    else
+		nextNew = i + 1;
+	    if (!sendFragment(buf, len, address, i, i == last ? RH_FRAGMENT_TYPE_POLL : RH_FRAGMENT_TYPE_DATA))
+		return RH_FRAGMENT_ERROR_UNABLE_TO_DELIVER;
+	}
+
+	// Find out what got there
+	uint16_t oldBase = base;
+	uint32_t oldReceived = received;
+	uint8_t reply = waitStatus(address, &base, &received);
+	if (reply == RH_FRAGMENT_TYPE_REJECT)
+	    return RH_FRAGMENT_ERROR_REJECTED;
+	replied = (reply == RH_FRAGMENT_TYPE_STATUS);
+	if (base != oldBase || received != oldReceived)
+	    tries = 0; // Progress
+    }
+
+    unsigned long elapsed = millis() - startTime;
+    _goodput = (uint32_t)len * 1000 / (elapsed ? elapsed : 1);
+    return RH_FRAGMENT_ERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragment::recvfrom(uint8_t* buf, uint16_t* len, uint8_t* from)
+{
+    // Abandon a message that has stopped arriving
+    if (_rxActive && (millis() - _rxLastTime) > _reassemblyTimeout)
+    {
+	_rxActive = false;
+	_reassemblyTimeouts++;
+    }
+
+    // Receive the next fragment where we expect it to go: into the slot for the first missing fragment,
+    // with its header in the octets before the slot.
+    uint16_t slot = _rxActive ? _rxBase * _rxSize : 0;
+    uint16_t start = (slot >= RH_FRAGMENT_HEADER_LEN) ? slot - RH_FRAGMENT_HEADER_LEN : 0;
+    if (start >= *len)
+	return false;
+    uint16_t space = *len - start;
+    if (_rxActive && space > RH_FRAGMENT_HEADER_LEN + _rxSize)
+	space = RH_FRAGMENT_HEADER_LEN + _rxSize;
+    if (space > RH_MAX_MESSAGE_LEN)
+	space = RH_MAX_MESSAGE_LEN;
+
+    // The header may overwrite the end of the previous fragment, and if the first fragment is missing,
+    // the message may overwrite the start of the next. Those may have been received already, so save them.
+    uint8_t saved[RH_FRAGMENT_HEADER_LEN];
+    uint8_t savedBefore = slot - start;
+    uint8_t savedAfter = 0;
+    uint16_t next = slot + _rxSize;
+    if (_rxActive && start + space > next)
+	savedAfter = start + space - next;
+    memcpy(saved, buf + start, savedBefore);
+    memcpy(saved + savedBefore, buf + next, savedAfter);
+    bool wasActive = _rxActive;
+    bool nextReceived = _rxActive && (_rxReceived & 2);
+    uint8_t activeFrom = _rxFrom;
+    uint8_t activeTransfer = _rxTransfer;
+
+    uint8_t msgLen = space;
+    uint8_t msgFrom;
+    bool complete = false;
+    if (recvMessage(buf + start, &msgLen, &msgFrom) && msgLen >= RH_FRAGMENT_HEADER_LEN)
+    {
+	FragmentHeader* h = (FragmentHeader*)(buf + start);
+	uint8_t  type     = h->type;
+	uint8_t  transfer = h->transfer;
+	uint16_t index    = h->index[0] | (h->index[1] << 8);
+	uint16_t total    = h->total[0] | (h->total[1] << 8);
+	uint8_t  size     = h->size;
+	uint8_t  dataLen  = msgLen - RH_FRAGMENT_HEADER_LEN;
+
+	if (   (type == RH_FRAGMENT_TYPE_DATA || type == RH_FRAGMENT_TYPE_POLL)
+	    && !(_rxActive && msgFrom == _rxFrom && transfer == _rxTransfer))
+	{
+	    // Not part of the message we are reassembling
+	    if (   _rxDoneFrom != RH_BROADCAST_ADDRESS
+		&& (millis() - _rxDoneTime) > _reassemblyTimeout)
+		_rxDoneFrom = RH_BROADCAST_ADDRESS; // Too old to be a repeat of the last message
+	    if (   msgFrom == _rxDoneFrom 
+		&& transfer == _rxDoneTransfer
+		&& total == _rxDoneTotal
+		&& size == _rxDoneSize)
+	    {
+		// We already have all of it. Our final status must have been lost
+		if (type == RH_FRAGMENT_TYPE_POLL)
+		{
+		    sendStatus(RH_FRAGMENT_TYPE_STATUS, msgFrom, transfer, (total + size - 1) / size, 0);
+		    _rxDoneTime = millis();
+		}
+	    }
+	    else if (!_rxActive || msgFrom == _rxFrom)
+	    {
+		// A new message. If the sender has started another one, it has given up on the old one
+		if (   total == 0
+		    || size < RH_FRAGMENT_HEADER_LEN
+		    || (uint32_t)total + RH_FRAGMENT_HEADER_LEN > *len)
+		{
+		    // Cant take it. Tell the sender when it asks
+		    if (type == RH_FRAGMENT_TYPE_POLL)
+			sendStatus(RH_FRAGMENT_TYPE_REJECT, msgFrom, transfer, 0, 0);
+		}
+		else
+		{
+		    _rxActive = true;
+		    _rxFrom = msgFrom;
+		    _rxTransfer = transfer;
+		    _rxTotal = total;
+		    _rxSize = size;
+		    _rxBase = 0;
+		    _rxReceived = 0;
+		    _rxStartTime = millis();
+		}
+	    }
+	    // Else we are busy with another sender's message. It will have to try again later
+	}
+
+	if (   (type == RH_FRAGMENT_TYPE_DATA || type == RH_FRAGMENT_TYPE_POLL)
+	    && _rxActive && msgFrom == _rxFrom && transfer == _rxTransfer)
+	{
+	    uint16_t count = (_rxTotal + _rxSize - 1) / _rxSize;
+	    uint32_t offset = (uint32_t)index * _rxSize;
+	    uint8_t expectedLen = (index == count - 1) ? _rxTotal - offset : _rxSize;
+	    if (   index >= _rxBase
+		&& index < _rxBase + RH_FRAGMENT_WINDOW
+		&& index < count
+		&& dataLen == expectedLen
+		&& !(_rxReceived & (1UL << (index - _rxBase))))
+	    {
+		// A fragment we need. Move it into its slot, unless it is already there
+		memmove(buf + offset, buf + start + RH_FRAGMENT_HEADER_LEN, dataLen);
+		_rxReceived |= (1UL << (index - _rxBase));
+		while (_rxReceived & 1)
+		{
+		    _rxReceived >>= 1;
+		    _rxBase++;
+		}
+	    }
+	    _rxLastTime = millis();
+	    complete = (_rxBase == count);
+	    if (type == RH_FRAGMENT_TYPE_POLL || complete)
+		sendStatus(RH_FRAGMENT_TYPE_STATUS, _rxFrom, _rxTransfer, _rxBase, _rxReceived);
+	}
+    }
+
+    // Put back any octets of fragments received earlier that were overwritten
+    if (wasActive && _rxFrom == activeFrom && _rxTransfer == activeTransfer)
+    {
+	memcpy(buf + start, saved, savedBefore);
+	if (nextReceived)
+	    memcpy(buf + next, saved + savedBefore, savedAfter);
+    }
+
+    if (complete)
+    {
+	unsigned long elapsed = millis() - _rxStartTime;
+	_goodput = (uint32_t)_rxTotal * 1000 / (elapsed ? elapsed : 1);
+	_rxActive = false;
+	_rxDoneFrom = _rxFrom;
+	_rxDoneTransfer = _rxTransfer;
+	_rxDoneTotal = _rxTotal;
+	_rxDoneSize = _rxSize;
+	_rxDoneTime = millis();
+	*len = _rxTotal;
+	if (from) *from = _rxFrom;
+    }
+    return complete;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHFragment::goodput()
+{
+    return _goodput;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHFragment::retransmissions()
+{
+    return _retransmissions;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragment::resetRetransmissions()
+{
+    _retransmissions = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHFragment::reassemblyTimeouts()
+{
+    return _reassemblyTimeouts;
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+bool RHFragment::sendMessage(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    // The Managers sendtoWait() are not virtual, so call the right one for the type of Manager
+    if (_mesh)
+	return _mesh->sendtoWait(buf, len, address) == RH_ROUTER_ERROR_NONE;
+    else if (_router)
+	return _router->sendtoWait(buf, len, address) == RH_ROUTER_ERROR_NONE;
+    else
+	return _manager.sendtoWait(buf, len, address);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragment::recvMessage(uint8_t* buf, uint8_t* len, uint8_t* from)
+{
+    if (_mesh)
+	return _mesh->recvfromAck(buf, len, from);
+    else if (_router)
+	return _router->recvfromAck(buf, len, from);
+    else
+	return _manager.recvfromAck(buf, len, from);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragment::sendFragment(uint8_t* buf, uint16_t len, uint8_t address, uint16_t index, uint8_t type)
+{
+    uint8_t size = maxFragmentLength();
+    uint32_t offset = (uint32_t)index * size;
+    uint8_t dataLen = (len - offset > size) ? size : len - offset;
+
+    uint8_t msg[RH_MAX_MESSAGE_LEN];
+    FragmentHeader* h = (FragmentHeader*)msg;
+    h->type = type;
+    h->transfer = _lastTransfer;
+    h->index[0] = index & 0xff;
+    h->index[1] = index >> 8;
+    h->total[0] = len & 0xff;
+    h->total[1] = len >> 8;
+    h->size = size;
+    memcpy(msg + RH_FRAGMENT_HEADER_LEN, buf + offset, dataLen);
+    return sendMessage(msg, RH_FRAGMENT_HEADER_LEN + dataLen, address);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHFragment::waitStatus(uint8_t address, uint16_t* base, uint32_t* received)
+{
+    unsigned long startTime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = _timeout - (millis() - startTime)) > 0)
+    {
+	if (_manager.waitAvailableTimeout(timeLeft))
+	{
+	    FragmentStatus status;
+	    uint8_t len = sizeof(status);
+	    uint8_t from;
+	    if (   recvMessage((uint8_t*)&status, &len, &from)
+		&& from == address
+		&& len >= 2
+		&& status.transfer == _lastTransfer)
+	    {
+		if (status.type == RH_FRAGMENT_TYPE_REJECT)
+		    return RH_FRAGMENT_TYPE_REJECT;
+		if (status.type == RH_FRAGMENT_TYPE_STATUS && len == sizeof(status))
+		{
+		    uint16_t newBase = status.base[0] | (status.base[1] << 8);
+		    // Ignore stale reports from before ones we have already seen
+		    if (newBase >= *base)
+		    {
+			*base = newBase;
+			*received = (uint32_t)status.bitmap[0]
+			    | ((uint32_t)status.bitmap[1] << 8)
+			    | ((uint32_t)status.bitmap[2] << 16)
+			    | ((uint32_t)status.bitmap[3] << 24);
+		    }
+		    return RH_FRAGMENT_TYPE_STATUS;
+		}
+	    }
+	}
+	YIELD;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragment::sendStatus(uint8_t type, uint8_t address, uint8_t transfer, uint16_t base, uint32_t received)
+{
+    FragmentStatus status;
+    status.type = type;
+    status.transfer = transfer;
+    status.base[0] = base & 0xff;
+    status.base[1] = base >> 8;
+    status.bitmap[0] = received & 0xff;
+    status.bitmap[1] = (received >> 8) & 0xff;
+    status.bitmap[2] = (received >> 16) & 0xff;
+    status.bitmap[3] = (received >> 24) & 0xff;
+    sendMessage((uint8_t*)&status, sizeof(status), address);
+}
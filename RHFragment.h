@@ -0,0 +1,336 @@
+// RHFragment.h
+//
+// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers
+// (see http://www.hoperf.com)
+//
+// $Id: $
+
+#ifndef RHFragment_h
+#define RHFragment_h
+
+#include <RHReliableDatagram.h>
+
+class RHRouter;
+class RHMesh;
+
+// Types of RHFragment message, the first octet of each message
+#define RH_FRAGMENT_TYPE_DATA    1
+#define RH_FRAGMENT_TYPE_POLL    2
+#define RH_FRAGMENT_TYPE_STATUS  3
+#define RH_FRAGMENT_TYPE_REJECT  4
+
+// Error codes returned by sendtoWait()
+#define RH_FRAGMENT_ERROR_NONE              0
+#define RH_FRAGMENT_ERROR_INVALID_LENGTH    1
+#define RH_FRAGMENT_ERROR_UNABLE_TO_DELIVER 2
+#define RH_FRAGMENT_ERROR_NO_REPLY          3
+#define RH_FRAGMENT_ERROR_REJECTED          4
+
+/// The maximum length of a message that can be sent with RHFragment
+#define RH_FRAGMENT_MAX_MESSAGE_LEN 65535
+
+// The maximum number of fragments that may be sent before the receiver reports which it has.
+// Limited to 32 by the width of the status bitmap
+#ifndef RH_FRAGMENT_WINDOW
+#define RH_FRAGMENT_WINDOW 32
+#endif
+#if RH_FRAGMENT_WINDOW > 32
+#error RH_FRAGMENT_WINDOW must not be more than 32
+#endif
+
+/// The default time in milliseconds to wait for the receiver to report which fragments it has
+#define RH_FRAGMENT_DEFAULT_TIMEOUT 1000
+
+/// The default number of times to resend the missing fragments before giving up
+#define RH_FRAGMENT_DEFAULT_RETRIES 3
+
+/// The default time in milliseconds after the last fragment is received that a receiver abandons
+/// a partly reassembled message
+#define RH_FRAGMENT_DEFAULT_REASSEMBLY_TIMEOUT 5000
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHFragment RHFragment.h <RHFragment.h>
+/// \brief Sends and receives messages too long for a single radio message, by splitting them into fragments.
+///
+/// Every Manager is limited to messages no longer than the Driver's maxMessageLength(), less the space
+/// taken by the headers of the Manager itself, which for some radios can be less than 50 octets.
+/// RHFragment works on top of an RHReliableDatagram, RHRouter or RHMesh Manager, and sends
+/// messages of up to RH_FRAGMENT_MAX_MESSAGE_LEN octets (such as configuration data or firmware images)
+/// by splitting them into numbered fragments that are each sent with the Manager's sendtoWait().
+/// The receiving node, which must also be using RHFragment over the same type of Manager,
+/// reassembles the fragments in the buffer provided by the caller of recvfrom().
+///
+/// The sender sends up to RH_FRAGMENT_WINDOW fragments one after the other, without waiting
+/// for the final destination to confirm them, and the last one asks the receiver which fragments it has.
+/// The receiver replies with a status message listing the fragments it has received. The sender then
+/// sends only the fragments that are missing, followed by as many new fragments as will fit in the window.
+/// So over an RHRouter or RHMesh network, the fragments are pipelined along the route, and fragments
+/// lost between the hops (for example when a relay node gives up) are recovered end-to-end.
+///
+/// The receiver only reassembles one message at a time: fragments of a message from another node are ignored
+/// until it has been completed, or until no fragment has been received for the reassembly timeout
+/// (see setReassemblyTimeout()). The sender of the ignored message will get no reply and will eventually
+/// give up and can try again later.
+///
+/// \par Reassembly
+///
+/// Fragments are received directly into their position in the caller's buffer, without being copied
+/// through any other staging buffer. The fragment headers are received into the octets before
+/// the fragment's position, which are saved and restored around the reception.
+/// Fragments that arrive in order are not copied at all. This means that:
+/// - you must pass the same buffer to every call to recvfrom() until it returns true
+/// - the buffer must be at least RH_FRAGMENT_HEADER_LEN octets longer than the longest message you
+/// expect to receive. Longer messages are rejected, and sendtoWait() in the sending node
+/// returns RH_FRAGMENT_ERROR_REJECTED.
+/// - the contents of the buffer are undefined until recvfrom() returns true.
+///
+/// All messages received by the Manager are expected to be RHFragment messages, and any others are discarded.
+/// If you need to send other messages with the same Manager, use the application layer FLAGS to tell them apart
+/// and receive them yourself.
+///
+/// \par Message Format
+///
+/// Each fragment starts with an RHFragment::FragmentHeader, followed by the data of the fragment:
+/// - 1 octet TYPE, RH_FRAGMENT_TYPE_DATA, or RH_FRAGMENT_TYPE_POLL if the sender wants a status message
+/// - 1 octet TRANSFER, an ID distinct for each message sent by a node. The first one after a restart is random, 
+///   so that a receiver that remembers the last message from before the restart does not take it for that one
+/// - 2 octets INDEX, the number of the fragment, starting at 0, least significant octet first
+/// - 2 octets TOTAL, the length of the complete message, least significant octet first
+/// - 1 octet SIZE, the length of every fragment except perhaps the last one
+///
+/// The receiver replies to a RH_FRAGMENT_TYPE_POLL fragment with an RHFragment::FragmentStatus:
+/// - 1 octet TYPE, RH_FRAGMENT_TYPE_STATUS, or RH_FRAGMENT_TYPE_REJECT if the receiver can not
+///   accept the message
+/// - 1 octet TRANSFER, the TRANSFER of the message being reassembled
+/// - 2 octets BASE, the number of fragments received before the first missing one
+/// - 4 octets BITMAP, where bit i is set if fragment (BASE + i) has been received
+///
+/// \par Performance
+///
+/// goodput() returns the rate at which the application data of the last message was
+/// delivered or received, in octets per second.
+/// retransmissions() counts the fragments that had to be sent again.
+/// Since each fragment is sent with sendtoWait(), it is acknowledged at each hop by the Manager
+/// as well as being confirmed end-to-end by the status messages.
+class RHFragment
+{
+public:
+    /// Constructor for use with an RHReliableDatagram Manager.
+    /// \param[in] manager The Manager to send and receive the fragments.
+    RHFragment(RHReliableDatagram& manager);
+
+    /// Constructor for use with an RHRouter Manager.
+    /// \param[in] router The Manager to send and receive the fragments.
+    RHFragment(RHRouter& router);
+
+    /// Constructor for use with an RHMesh Manager.
+    /// \param[in] mesh The Manager to send and receive the fragments.
+    RHFragment(RHMesh& mesh);
+
+    /// Sets the time to wait for the receiver to report which fragments it has, after sending the
+    /// fragments in the window. Over multi-hop routes this must allow for the time to
+    /// deliver the fragments and the status across all the hops.
+    /// \param[in] timeout The new timeout period in milliseconds
+    void setTimeout(uint16_t timeout);
+
+    /// Sets the number of times the sender will resend missing fragments without hearing that
+    /// any more have been received before giving up.
+    /// \param[in] retries The new number of retries
+    void setRetries(uint8_t retries);
+
+    /// Sets how long the receiver keeps a partly reassembled message after the last fragment of it
+    /// was received. It is also how long the receiver remembers the last message it completed, 
+    /// so that it can repeat its final status if the sender did not get it.
+    /// \param[in] timeout The new timeout period in milliseconds
+    void setReassemblyTimeout(uint16_t timeout);
+
+    /// Returns the maximum number of octets of application data in each fragment with the current
+    /// Manager and Driver.
+    /// \return The fragment length
+    uint8_t maxFragmentLength();
+
+    /// Sends a message of any length up to RH_FRAGMENT_MAX_MESSAGE_LEN to the address, and
+    /// waits until the receiver has confirmed that it has all of it.
+    /// Any messages received while waiting that are not RHFragment status messages from the
+    /// destination are discarded.
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address of the node to send the message to. Must not be RH_BROADCAST_ADDRESS
+    /// \return RH_FRAGMENT_ERROR_NONE if the whole message was received, else one of the RH_FRAGMENT_ERROR_* codes
+    uint8_t sendtoWait(uint8_t* buf, uint16_t len, uint8_t address);
+
+    /// Processes any fragment available from the Manager, and returns true if a complete message
+    /// has been reassembled. Does not block: you must call it (with the same buffer) frequently in your main loop.
+    /// \param[in] buf Location to reassemble the message. See the section on Reassembly above.
+    /// \param[in,out] len Available space in buf. Set to the length of the message when it is complete
+    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the address of the
+    /// node that sent the message
+    /// \return true if a complete message was reassembled into buf
+    bool recvfrom(uint8_t* buf, uint16_t* len, uint8_t* from = NULL);
+
+    /// Returns the rate at which the application data of the last message sent or received
+    /// was delivered, from the first fragment until all were confirmed.
+    /// \return The goodput in octets per second, or 0 if no message has been completed
+    uint32_t goodput();
+
+    /// Returns the number of fragments that have been sent more than once since starting
+    /// or since the last call to resetRetransmissions().
+    /// \return The number of fragments retransmitted
+    uint32_t retransmissions();
+
+    /// Resets the count of retransmitted fragments to 0
+    void resetRetransmissions();
+
+    /// Returns the number of partly reassembled messages that have been abandoned
+    /// because no more fragments arrived within the reassembly timeout
+    /// \return The number of abandoned messages
+    uint32_t reassemblyTimeouts();
+
+    /// Header at the start of each fragment
+    typedef struct
+    {
+	uint8_t    type;       ///< RH_FRAGMENT_TYPE_DATA or RH_FRAGMENT_TYPE_POLL
+	uint8_t    transfer;   ///< Transfer ID of the message
+	uint8_t    index[2];   ///< Fragment number, LSB first
+	uint8_t    total[2];   ///< Length of the complete message, LSB first
+	uint8_t    size;       ///< Length of all but the last fragment
+	// Data follows, Length is implicit in the overall message length
+    } FragmentHeader;
+
+    /// The receiver's report of which fragments it has
+    typedef struct
+    {
+	uint8_t    type;       ///< RH_FRAGMENT_TYPE_STATUS or RH_FRAGMENT_TYPE_REJECT
+	uint8_t    transfer;   ///< Transfer ID of the message
+	uint8_t    base[2];    ///< Number of fragments received before the first missing one, LSB first
+	uint8_t    bitmap[4];  ///< Bit i set if fragment (base + i) has been received, LSB first
+    } FragmentStatus;
+
+    /// The length of the header at the start of each fragment
+    #define RH_FRAGMENT_HEADER_LEN sizeof(RHFragment::FragmentHeader)
+
+protected:
+    /// Sends a message with the Manager's sendtoWait()
+    /// \param[in] buf Pointer to the message
+    /// \param[in] len Length of the message
+    /// \param[in] address Destination address
+    /// \return true if the message was delivered to the next hop
+    bool sendMessage(uint8_t* buf, uint8_t len, uint8_t address);
+
+    /// Receives a message with the Manager's recvfromAck()
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \param[in] from The source address of the message
+    /// \return true if a message was received
+    bool recvMessage(uint8_t* buf, uint8_t* len, uint8_t* from);
+
+    /// Sends one fragment of a message
+    /// \param[in] buf The complete message
+    /// \param[in] len Length of the complete message
+    /// \param[in] address Destination address
+    /// \param[in] index Number of the fragment to send
+    /// \param[in] type RH_FRAGMENT_TYPE_DATA or RH_FRAGMENT_TYPE_POLL
+    /// \return true if the fragment was delivered to the next hop
+    bool sendFragment(uint8_t* buf, uint16_t len, uint8_t address, uint16_t index, uint8_t type);
+
+    /// Waits for a status message about the current transfer to address
+    /// \param[in] address The destination of the transfer
+    /// \param[in,out] base The number of fragments known to have been received before the first missing one
+    /// \param[in,out] received Bit i is set if fragment (base + i) is known to have been received
+    /// \return RH_FRAGMENT_TYPE_STATUS if a status was received, RH_FRAGMENT_TYPE_REJECT if the receiver
+    /// rejected the message, or 0 if there was no reply
+    uint8_t waitStatus(uint8_t address, uint16_t* base, uint32_t* received);
+
+    /// Sends a status message for the message being received
+    /// \param[in] type RH_FRAGMENT_TYPE_STATUS or RH_FRAGMENT_TYPE_REJECT
+    /// \param[in] address The sender of the message
+    /// \param[in] transfer The transfer ID of the message
+    /// \param[in] base Number of fragments received before the first missing one
+    /// \param[in] received Bit i is set if fragment (base + i) has been received
+    void sendStatus(uint8_t type, uint8_t address, uint8_t transfer, uint16_t base, uint32_t received);
+
+    /// The Manager, whichever type it is
+    RHReliableDatagram&  _manager;
+
+    /// The Manager if it is an RHRouter (or RHMesh), else NULL
+    RHRouter*            _router;
+
+    /// The Manager if it is an RHMesh, else NULL
+    RHMesh*              _mesh;
+
+private:
+    /// Initialises the member variables
+    void init();
+
+    /// Time to wait for a status message
+    uint16_t      _timeout;
+
+    /// Number of rounds without progress before giving up
+    uint8_t       _retries;
+
+    /// Time to keep a partly reassembled message
+    uint16_t      _reassemblyTimeout;
+
+    /// The transfer ID of the last message sent
+    uint8_t       _lastTransfer;
+
+    /// true once _lastTransfer has been given its random starting value
+    bool          _transferStarted;
+
+    /// Goodput of the last message sent or received, octets per second
+    uint32_t      _goodput;
+
+    /// Count of fragments sent more than once
+    uint32_t      _retransmissions;
+
+    /// Count of abandoned partly reassembled messages
+    uint32_t      _reassemblyTimeouts;
+
+    /// true if a message is being reassembled
+    bool          _rxActive;
+
+    /// Sender of the message being reassembled
+    uint8_t       _rxFrom;
+
+    /// Transfer ID of the message being reassembled
+    uint8_t       _rxTransfer;
+
+    /// Length of the message being reassembled
+    uint16_t      _rxTotal;
+
+    /// Fragment size of the message being reassembled
+    uint8_t       _rxSize;
+
+    /// Number of fragments received before the first missing one
+    uint16_t      _rxBase;
+
+    /// Bit i is set if fragment (_rxBase + i) has been received
+    uint32_t      _rxReceived;
+
+    /// millis() when the first fragment was received
+    unsigned long _rxStartTime;
+
+    /// millis() when the last fragment was received
+    unsigned long _rxLastTime;
+
+    /// Sender of the last message completed, so that lost status messages can be repeated
+    uint8_t       _rxDoneFrom;
+
+    /// Transfer ID of the last message completed
+    uint8_t       _rxDoneTransfer;
+
+    /// Length of the last message completed
+    uint16_t      _rxDoneTotal;
+
+    /// Fragment size of the last message completed
+    uint8_t       _rxDoneSize;
+
+    /// millis() when the last message was completed, or its status was last repeated. 
+    /// The record is forgotten after the reassembly timeout
+    unsigned long _rxDoneTime;
+};
+
+/// @example simulator_fragment_client.pde
+/// @example simulator_fragment_server.pde
+
+#endif
@@ -118,6 +118,16 @@ uint8_t RHGenericDriver::headerFlags()
     return _rxHeaderFlags;
 }
 
+uint8_t RHGenericDriver::txHeaderId()
+{
+    return _txHeaderId;
+}
+
+uint8_t RHGenericDriver::txHeaderFlags()
+{
+    return _txHeaderFlags;
+}
+
 int8_t RHGenericDriver::lastRssi()
 {
     return _lastRssi;
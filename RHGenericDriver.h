@@ -165,6 +165,14 @@ public:
     /// \return The FLAGS header
     virtual uint8_t        headerFlags();
 
+    /// Returns the ID header to be sent in subsequent messages, as set by setHeaderId()
+    /// \return The ID header
+    uint8_t                txHeaderId();
+
+    /// Returns the FLAGS header to be sent in subsequent messages, as set by setHeaderFlags()
+    /// \return The FLAGS header
+    uint8_t                txHeaderFlags();
+
     /// Returns the most recent RSSI (Receiver Signal Strength Indicator).
     /// Usually it is the RSSI of the last received message, which is measured when the preamble is received.
     /// If you called readRssi() more recently, it will return that more recent value.
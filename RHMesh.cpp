@@ -13,13 +13,44 @@
 
 #include <RHMesh.h>
 
-uint8_t RHMesh::_tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
 RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress) 
     : RHRouter(driver, thisAddress)
 {
+    _arpTimeout = RH_MESH_ARP_TIMEOUT;
+    _lastRouteRequest = 0;
+    _routeRequestSpacing = 0;
+    _ringStart = RH_MESH_RING_TTL_START;
+    _ringIncrement = RH_MESH_RING_TTL_INCREMENT;
+    _ringThreshold = RH_MESH_RING_TTL_THRESHOLD;
+    _ringHopTimeout = 0;
+    uint8_t k;
+    for (k = 0; k < RH_MESH_DISCOVERY_TABLE_SIZE; k++)
+	_discoveries[k].dest = RH_BROADCAST_ADDRESS;
+#if RH_MESH_PENDING_QUEUE_SIZE > 0
+    _pendingCount = 0;
+#endif
+    _pendingDropped = 0;
+    _arpWaiting = false;
+#if RH_MESH_RECEIVE_QUEUE_SIZE > 0
+    _receivedHead = 0;
+    _receivedCount = 0;
+#endif
+    _receiveQueueDropped = 0;
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    _sourceRouting = false;
+    _sourceRouteNext = 0;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE; i++)
+	_sourceRoutes[i].dest = RH_BROADCAST_ADDRESS;
+#endif
+#if RH_MESH_ROUTE_REQUEST_CACHE_SIZE > 0
+    _routeRequestNext = 0;
+    uint8_t j;
+    for (j = 0; j < RH_MESH_ROUTE_REQUEST_CACHE_SIZE; j++)
+	_routeRequests[j].source = RH_BROADCAST_ADDRESS;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -35,9 +66,26 @@ uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t f
 
     if (address != RH_BROADCAST_ADDRESS)
     {
+	uint8_t pathlen;
 	RoutingTableEntry* route = getRouteTo(address);
-	if (!route && !doArp(address))
+	if (!route && !sourceRoute(address, &pathlen) && !doArp(address))
 	    return RH_ROUTER_ERROR_NO_ROUTE;
+
+	// Only if the path fits in the message
+	uint8_t* path = sourceRoute(address, &pathlen);
+	if (   path 
+	    && (unsigned)(1 + pathlen + len) <= RH_MESH_MAX_MESSAGE_LEN
+	    &&    sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader) + 1 + pathlen + len 
+	       <= maxMessageLengthTo(pathlen ? path[0] : address))
+	{
+	    // Send it with the path, so the relays need not look it up
+	    MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)&_tmpMessage;
+	    s->header.msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED;
+	    s->pathlen = pathlen;
+	    memcpy(s->path, path, pathlen);
+	    memcpy(s->path + pathlen, buf, len);
+	    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + 1 + pathlen + len, address, flags);
+	}
     }
 
     // Now have a route. Contruct an application layer message and send it via that route
@@ -48,43 +96,272 @@ uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t f
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::doArp(uint8_t address)
+uint8_t RHMesh::sendtoNoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags)
 {
-    // Need to discover a route
+    if (dest == RH_BROADCAST_ADDRESS)
+	return sendtoWait(buf, len, dest, flags); // Broadcasts are not acknowledged, so there is no wait
+
+#if RH_MESH_PENDING_QUEUE_SIZE > 0
+    if (sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader) + len > RH_MESH_PENDING_MSG_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+    if (_pendingCount >= RH_MESH_PENDING_QUEUE_SIZE || !discoverRoute(dest))
+	return RH_ROUTER_ERROR_NO_ROUTE;
+
+    // Hold it until the route is known, which may be already
+    PendingMessage* pending = &_pending[_pendingCount++];
+    RoutedMessage* message = (RoutedMessage*)pending->data;
+    message->header.source = _thisAddress;
+    message->header.dest = dest;
+    message->header.hops = 0;
+    message->header.id = _lastE2ESequenceNumber++;
+    message->header.flags = flags & ~RH_ROUTER_FLAGS_RESERVED;
+    MeshApplicationMessage* a = (MeshApplicationMessage*)message->data;
+    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+    memcpy(a->data, buf, len);
+    pending->len = sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader) + len;
+    serviceRouteDiscovery();
+    return RH_ROUTER_ERROR_NONE;
+#else
+    return RH_ROUTER_ERROR_NO_ROUTE;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::serviceRouteDiscovery()
+{
+    timeoutDiscoveries();
+
+    uint8_t i;
+    // Send the requests that are waiting for the last one to get out of the way
+    for (i = 0; i < RH_MESH_DISCOVERY_TABLE_SIZE; i++)
+	if (   _discoveries[i].dest != RH_BROADCAST_ADDRESS
+	    && !_discoveries[i].sent 
+	    && !sendRouteRequest(&_discoveries[i]))
+	    _discoveries[i].dest = RH_BROADCAST_ADDRESS; // Failed
+
+#if RH_MESH_PENDING_QUEUE_SIZE > 0
+    i = 0;
+    while (i < _pendingCount)
+    {
+	RoutedMessage* message = (RoutedMessage*)_pending[i].data;
+	if (isDiscovering(message->header.dest))
+	{
+	    i++; // Still waiting for the route
+	    continue;
+	}
+	if (getRouteTo(message->header.dest))
+	{
+ #if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+	    if (forwardQueueLength() >= RH_ROUTER_FORWARD_QUEUE_SIZE)
+		break; // No room yet. Try again later, keeping the messages in order
+ #endif
+	    forward(message, _pending[i].len, _thisAddress, 0);
+	}
+	else
+	{
+	    // The discovery failed
+	    _pendingDropped++;
+	}
+	_pendingCount--;
+	memmove(&_pending[i], &_pending[i + 1], (_pendingCount - i) * sizeof(PendingMessage));
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::pendingQueueLength()
+{
+#if RH_MESH_PENDING_QUEUE_SIZE > 0
+    return _pendingCount;
+#else
+    return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::pendingQueueDropped()
+{
+    return _pendingDropped;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setArpTimeout(uint16_t timeout)
+{
+    _arpTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setExpandingRing(uint8_t start, uint8_t increment, uint8_t threshold, uint16_t hopTimeout)
+{
+    _ringStart = start;
+    _ringIncrement = increment;
+    _ringThreshold = threshold;
+    _ringHopTimeout = hopTimeout;
+}
+
+////////////////////////////////////////////////////////////////////
+// Finds the discovery for dest, or a free entry if dest is RH_BROADCAST_ADDRESS
+RHMesh::Discovery* RHMesh::findDiscovery(uint8_t dest)
+{
+    timeoutDiscoveries();
+
+    uint8_t i;
+    for (i = 0; i < RH_MESH_DISCOVERY_TABLE_SIZE; i++)
+	if (_discoveries[i].dest == dest)
+	    return &_discoveries[i];
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::timeoutDiscoveries()
+{
+    unsigned long now = millis();
+    uint8_t i;
+    for (i = 0; i < RH_MESH_DISCOVERY_TABLE_SIZE; i++)
+    {
+	Discovery* d = &_discoveries[i];
+	if (d->dest == RH_BROADCAST_ADDRESS)
+	    continue;
+	if (now - d->begun >= _arpTimeout)
+	{
+	    d->dest = RH_BROADCAST_ADDRESS; // The whole discovery has timed out
+	    continue;
+	}
+	if (   !d->sent
+	    || now - d->started < d->timeout)
+	    continue;
+	if (d->ttl == 0)
+	{
+	    d->dest = RH_BROADCAST_ADDRESS; // Timed out
+	}
+	else
+	{
+	    // No reply from within this ring. serviceRouteDiscovery() will send the request for the next
+	    if (   d->ttl >= _ringThreshold
+		|| _ringIncrement == 0
+		|| d->ttl + _ringIncrement >= _max_hops)
+		d->ttl = 0; // The whole network
+	    else
+		d->ttl += _ringIncrement;
+	    d->sent = false;
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// Called whenever routes are learned from route discovery messages
+void RHMesh::endDiscoveries()
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_DISCOVERY_TABLE_SIZE; i++)
+	if (   _discoveries[i].dest != RH_BROADCAST_ADDRESS
+	    && getRouteTo(_discoveries[i].dest))
+	    _discoveries[i].dest = RH_BROADCAST_ADDRESS; // No need to wait for the reply
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::requestWaiting()
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_DISCOVERY_TABLE_SIZE; i++)
+	if (   _discoveries[i].dest != RH_BROADCAST_ADDRESS 
+	    && (!_discoveries[i].sent || _discoveries[i].ttl))
+	    return true;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::isDiscovering(uint8_t dest)
+{
+    return dest != RH_BROADCAST_ADDRESS && findDiscovery(dest);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::discoverRoute(uint8_t dest)
+{
+    if (isDiscovering(dest) || getRouteTo(dest))
+	return true;
+    Discovery* d = findDiscovery(RH_BROADCAST_ADDRESS);
+    if (!d)
+	return false; // Too many at once
+    d->dest = dest;
+    d->sent = false;
+    d->ttl = _ringStart < _max_hops ? _ringStart : 0;
+    d->begun = millis();
+    if (sendRouteRequest(d))
+	return true;
+    d->dest = RH_BROADCAST_ADDRESS;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::sendRouteRequest(Discovery* d)
+{
+    if (millis() - _lastRouteRequest < _routeRequestSpacing)
+	return true; // Not yet. serviceRouteDiscovery() will send it
+
+    // The rings and the flood share the time set by setArpTimeout(). A ring that would take more than
+    // half of what is left is skipped, and the request flooded straight away
+    int32_t timeLeft = _arpTimeout - (millis() - d->begun);
+    if (timeLeft < 0)
+	timeLeft = 0;
+    uint32_t timeout = timeLeft;
+    if (d->ttl)
+    {
+	// Long enough for the request and the reply to cross every hop of the ring
+	uint32_t ringTimeout = (uint32_t)(_ringHopTimeout ? _ringHopTimeout : randomTimeout()) * 2 * d->ttl;
+	if (ringTimeout > timeout / 2)
+	    d->ttl = 0;
+	else
+	    timeout = ringTimeout;
+    }
+
     // Broadcast a route discovery message with nothing in it
     MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
     p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
     p->destlen = 1; 
-    p->dest = address; // Who we are looking for
-    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS);
+    p->dest = d->dest; // Who we are looking for
+    // Nodes stop rebroadcasting a request when its HOPS reaches max_hops. So a request limited to a ring 
+    // starts with HOPS higher than 0, so that it gets there at the nodes ttl hops away
+    uint8_t hops = d->ttl ? _max_hops + 1 - d->ttl : 0;
+    uint8_t error = RHRouter::sendtoFromSourceWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS, 
+						   _thisAddress, 0, _lastE2ESequenceNumber++, hops);
     if (error !=  RH_ROUTER_ERROR_NONE)
 	return false;
+    d->sent = true;
+    d->started = _lastRouteRequest = millis();
+    _routeRequestSpacing = randomTimeout();
+    d->timeout = timeout;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::doArp(uint8_t address)
+{
+    // Need to discover a route
+    if (!discoverRoute(address))
+	return false;
     
     // Wait for a reply, which will be unicast back to us
-    // It will contain the complete route to the destination
-    uint8_t messageLen = sizeof(_tmpMessage);
-    // FIXME: timeout should be configurable
-    unsigned long starttime = millis();
-    int32_t timeLeft;
-    while ((timeLeft = RH_MESH_ARP_TIMEOUT - (millis() - starttime)) > 0)
+    // It will contain the complete route to the destination. recvfromAck() adds the route
+    // and ends the discovery, and meanwhile handles the route discoveries of other nodes.
+    // Application layer messages that arrive meanwhile are kept in the receive queue
+    _arpWaiting = true;
+    Discovery* d;
+    while ((d = findDiscovery(address)))
     {
+	// If the request has not been sent yet, wake up often enough to send it.
+	// The request may have timed out already, and serviceRouteDiscovery() will deal with it
+	int32_t timeLeft = RH_ROUTER_FORWARD_POLL;
+	if (d->sent && (timeLeft = d->timeout - (millis() - d->started)) < 0)
+	    timeLeft = 0;
 	if (waitAvailableTimeout(timeLeft))
-	{
-	    if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
-	    {
-		if (   messageLen > 1
-		       && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
-		{
-		    // Got a reply, now add the next hop to the dest to the routing table
-		    // The first hop taken is the first octet
-		    addRouteTo(address, headerFrom());
-		    return true;
-		}
-	    }
-	}
+	    recvfromAck(NULL, NULL);
+	serviceRouteDiscovery();
 	YIELD;
     }
-    return false;
+    _arpWaiting = false;
+    return getRouteTo(address) != NULL;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -97,24 +374,113 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
     {
 	// This is a unicast RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE messages 
 	// being routed back to the originator here. Want to scrape some routing data out of the response
-	// We can find the routes to all the nodes between here and the responding node
+	// We can find the routes to all the nodes between here and the responding node.
+	// The number of hops the reply has taken gives the metric of the route to the responding node.
+	// If we are on an alternate path, this is how we learn it
 	MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
-	addRouteTo(d->dest, headerFrom());
+	addRouteTo(d->dest, _rxFrom, Valid, message->header.hops + 1, _rxInterface);
 	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 2;
 	uint8_t i;
-	// Find us in the list of nodes that were traversed to get to the responding node
+	// If it is the reply to our request, the list is a path we can send source routed messages by
+	if (message->header.dest == _thisAddress)
+	    addSourceRoute(d->dest, d->route, numRoutes);
+	// Find us in the list of nodes that were traversed to get to the responding node.
+	// The originator is not in the list
+	uint8_t first = 0;
 	for (i = 0; i < numRoutes; i++)
 	    if (d->route[i] == _thisAddress)
+	    {
+		first = i + 1;
 		break;
-	i++;
-	while (i++ < numRoutes)
-	    addRouteTo(d->route[i], headerFrom());
+	    }
+	// The nodes after us in the list are only on the way if the reply came back the way the request went
+	if (   _rxFrom == (first < numRoutes ? d->route[first] : d->dest)
+	    && message->header.hops == numRoutes - first)
+	{
+	    for (i = first; i < numRoutes; i++)
+		addRouteTo(d->route[i], _rxFrom, Valid, i - first + 1, _rxInterface);
+	}
+	endDiscoveries();
     }
     else if (   messageLen > 1 
 	     && m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE)
     {
 	MeshRouteFailureMessage* d = (MeshRouteFailureMessage*)message->data;
 	deleteRouteTo(d->dest);
+	deleteSourceRoute(d->dest);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// Route discovery and failure messages are for us, not the application
+bool RHMesh::isControlMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    MeshMessageHeader* m = (MeshMessageHeader*)message->data;
+    return    messageLen > sizeof(RoutedMessageHeader) + 1
+	   && (   m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
+	       || m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+	       || m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE);
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by RHRouter::recvfromAck, after peekAtMessage(), even while sendtoWait() is waiting for an 
+// end-to-end acknowledgement. peekAtMessage() has already handled responses and failures, and 
+// the next call to serviceRouteDiscovery() sends any messages waiting for the new routes.
+// Route discovery requests are answered or rebroadcast here, in place, without touching 
+// _tmpMessage, which sendtoWait() may still need
+void RHMesh::handleControlMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
+    uint8_t len = messageLen - sizeof(RoutedMessageHeader);
+    if (   message->header.dest != RH_BROADCAST_ADDRESS
+	|| d->header.msgType != RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
+	|| len < sizeof(MeshMessageHeader) + 2)
+	return;
+
+    // Handle Route discovery requests
+    // Message is an array of node addresses the route request has already passed through
+    // If it originally came from us, ignore it
+    uint8_t source = message->header.source;
+    uint8_t id = message->header.id;
+    uint8_t hops = message->header.hops;
+    if (source == _thisAddress)
+	return;
+    
+    uint8_t numRoutes = len - sizeof(MeshMessageHeader) - 2;
+    uint8_t i;
+    // Are we already mentioned?
+    for (i = 0; i < numRoutes; i++)
+	if (d->route[i] == _thisAddress)
+	    return; // Already been through us. Discard
+    
+    // Hasnt been past us yet, record routes back to the earlier nodes, and how many hops away they are. 
+    // Copies of the request that reach us by other paths give us alternate routes back
+    addRouteTo(source, _rxFrom, Valid, numRoutes + 1, _rxInterface); // The originator
+    for (i = 0; i < numRoutes; i++)
+	addRouteTo(d->route[i], _rxFrom, Valid, numRoutes - i, _rxInterface);
+    endDiscoveries();
+    if (isPhysicalAddress(&d->dest, d->destlen))
+    {
+	// This route discovery is for us. Unicast the whole route back to the originator
+	// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+	// We are certain to have a route there, because we just got it.
+	// Send it back the way this copy of the request came, so that if copies came by 
+	// several paths, the originator learns them all
+	d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
+	sendtoViaWait((uint8_t*)d, len, source, _rxFrom, _rxInterface);
+    }
+    else if (   i < _max_hops 
+	     && hops < _max_hops
+	     && len < RH_ROUTER_MAX_MESSAGE_LEN
+	     && !isRouteRequestDuplicate(source, id, numRoutes))
+    {
+	// Its for someone else, rebroadcast it, after adding ourselves to the list
+	d->route[numRoutes] = _thisAddress;
+	len++;
+	// Have to impersonate the source, and keep its ID so other nodes can recognise the request.
+	// Count the hop, so that the request goes no further than the originator wanted
+	// REVISIT: if this fails what can we do?
+	RHRouter::sendtoFromSourceWait((uint8_t*)d, len, RH_BROADCAST_ADDRESS, source, 0, id, hops + 1);
     }
 }
 
@@ -122,25 +488,185 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 // This is called when a message is to be delivered to the next hop
 uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 {
-    uint8_t from = headerFrom(); // Might get clobbered during call to superclass route()
+    uint8_t from = _rxFrom; // Might get clobbered during call to superclass route()
+    uint8_t iface = _rxInterface;
     uint8_t ret = RHRouter::route(message, messageLen);
     if (   ret == RH_ROUTER_ERROR_NO_ROUTE
 	|| ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
-    {
-	// Cant deliver to the next hop. Delete the route
+	routeFailed(message, messageLen, from, iface);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+// Called when a message cant be delivered to the next hop
+void RHMesh::routeFailed(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface)
+{
+    // Cant deliver to the next hop. Delete the route, unless the message did not use it
+    if (pathNextHop(message, messageLen) == RH_BROADCAST_ADDRESS)
 	deleteRouteTo(message->header.dest);
-	if (message->header.source != _thisAddress)
+    deleteSourceRoute(message->header.dest);
+    if (message->header.source != _thisAddress)
+    {
+	// This is being proxied, so tell the originator about it.
+	// Not built in _tmpMessage, which may hold a message RHRouter::sendtoWait() is still sending
+	MeshRouteFailureMessage p;
+	p.header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
+	p.dest = message->header.dest; // Who you were trying to deliver to
+	// Make sure there is a route back towards whoever sent the original message
+	addRouteTo(message->header.source, from, Valid, 0, iface);
+	RHRouter::sendtoWait((uint8_t*)&p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by RHRouter before it looks up the route for a message
+uint8_t RHMesh::pathNextHop(RoutedMessage* message, uint8_t messageLen)
+{
+    MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)message->data;
+    if (   messageLen >= sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader) + 1
+	&& s->header.msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	&& messageLen >= sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader) + 1 + s->pathlen)
+    {
+	// The relays are in the order they are visited, so the next hop is the one after 
+	// the number of hops taken so far, or the destination after the last relay
+	if (message->header.hops < s->pathlen)
+	    return s->path[message->header.hops];
+	return message->header.dest;
+    }
+    return RH_BROADCAST_ADDRESS;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setSourceRouting(bool enable)
+{
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    _sourceRouting = enable;
+    if (!enable)
+    {
+	uint8_t i;
+	for (i = 0; i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE; i++)
+	    _sourceRoutes[i].dest = RH_BROADCAST_ADDRESS;
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t* RHMesh::sourceRoute(uint8_t dest, uint8_t* pathlen)
+{
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    uint8_t i;
+    if (_sourceRouting)
+	for (i = 0; i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE; i++)
+	    if (_sourceRoutes[i].dest == dest)
+	    {
+		*pathlen = _sourceRoutes[i].pathlen;
+		return _sourceRoutes[i].path;
+	    }
+#endif
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::addSourceRoute(uint8_t dest, uint8_t* path, uint8_t pathlen)
+{
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    if (!_sourceRouting || pathlen > RH_MESH_SOURCE_ROUTE_MAX_HOPS)
+	return;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE; i++)
+	if (_sourceRoutes[i].dest == dest)
+	    break;
+    if (i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE)
+    {
+	// Replies that come later by other paths are only better if they are shorter
+	if (pathlen >= _sourceRoutes[i].pathlen)
+	    return;
+    }
+    else
+    {
+	i = _sourceRouteNext;
+	_sourceRouteNext = (_sourceRouteNext + 1) % RH_MESH_SOURCE_ROUTE_CACHE_SIZE;
+    }
+    _sourceRoutes[i].dest = dest;
+    _sourceRoutes[i].pathlen = pathlen;
+    memcpy(_sourceRoutes[i].path, path, pathlen);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::deleteSourceRoute(uint8_t dest)
+{
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE; i++)
+	if (_sourceRoutes[i].dest == dest)
+	    _sourceRoutes[i].dest = RH_BROADCAST_ADDRESS;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::receiveQueueLength()
+{
+#if RH_MESH_RECEIVE_QUEUE_SIZE > 0
+    return _receivedCount;
+#else
+    return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::receiveQueueDropped()
+{
+    return _receiveQueueDropped;
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by RHReliableDatagram before it acknowledges a message
+bool RHMesh::acceptMessage(uint8_t* buf, uint8_t len, uint8_t from, uint8_t to, uint8_t id)
+{
+    if (!RHRouter::acceptMessage(buf, len, from, to, id))
+	return false;
+
+    RoutedMessage* message = (RoutedMessage*)buf;
+    uint8_t dataLen;
+    if (   _arpWaiting
+	&& len >= sizeof(RoutedMessageHeader)
+	&& message->header.dest == _thisAddress
+	&& !(message->header.flags & RH_ROUTER_FLAGS_E2E_ACK)
+	&& applicationData((MeshMessageHeader*)message->data, len - sizeof(RoutedMessageHeader), &dataLen))
+    {
+	// doArp() is waiting for a route, and can only keep so many messages for us.
+	// If this one will not fit, do not acknowledge it, so the sender will try again later
+	if (   receiveQueueLength() >= RH_MESH_RECEIVE_QUEUE_SIZE
+	    || dataLen > RH_MESH_RECEIVE_QUEUE_MSG_LEN)
 	{
-	    // This is being proxied, so tell the originator about it
-	    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)&_tmpMessage;
-	    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
-	    p->dest = message->header.dest; // Who you were trying to deliver to
-	    // Make sure there is a route back towards whoever sent the original message
-	    addRouteTo(message->header.source, from);
-	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
+	    _receiveQueueDropped++;
+	    return false;
 	}
     }
-    return ret;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Finds the application layer data in a mesh message, if it has any
+uint8_t* RHMesh::applicationData(MeshMessageHeader* p, uint8_t messageLen, uint8_t* len)
+{
+    if (   messageLen >= 1 
+	&& p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
+    {
+	*len = messageLen - sizeof(MeshMessageHeader);
+	return ((MeshApplicationMessage*)p)->data;
+    }
+    else if (   messageLen >= 2
+	     && p->msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	     && messageLen >= 2 + ((MeshSourceRoutedMessage*)p)->pathlen)
+    {
+	// The application layer data follows the path
+	MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)p;
+	*len = messageLen - 2 - s->pathlen;
+	return s->path + s->pathlen;
+    }
+    return NULL;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -151,9 +677,62 @@ bool RHMesh::isPhysicalAddress(uint8_t* address, uint8_t addresslen)
     return addresslen == 1 && address[0] == _thisAddress;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHMesh::isRouteRequestDuplicate(uint8_t source, uint8_t id, uint8_t hops)
+{
+#if RH_MESH_ROUTE_REQUEST_CACHE_SIZE > 0
+    unsigned long now = millis();
+    uint8_t i;
+    for (i = 0; i < RH_MESH_ROUTE_REQUEST_CACHE_SIZE; i++)
+    {
+	RouteRequest* r = &_routeRequests[i];
+	// IDs are reused eventually, so only recent requests count
+	if (   r->source == source 
+	    && r->id == id
+	    && now - r->received < _arpTimeout)
+	{
+	    // A copy that came by a shorter path is worth passing on, if it is not too late
+	    if (hops < r->hops && now - r->received < RH_MESH_ROUTE_REQUEST_WINDOW)
+	    {
+		r->hops = hops;
+		return false;
+	    }
+	    return true;
+	}
+    }
+    // First copy: replace the oldest entry
+    _routeRequests[_routeRequestNext].source = source;
+    _routeRequests[_routeRequestNext].id = id;
+    _routeRequests[_routeRequestNext].hops = hops;
+    _routeRequests[_routeRequestNext].received = now;
+    _routeRequestNext = (_routeRequestNext + 1) % RH_MESH_ROUTE_REQUEST_CACHE_SIZE;
+#endif
+    return false;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
 {     
+    serviceRouteDiscovery();
+
+#if RH_MESH_RECEIVE_QUEUE_SIZE > 0
+    if (_receivedCount && !_arpWaiting)
+    {
+	// Deliver the oldest message that arrived while doArp() was waiting
+	ReceivedMessage* r = &_received[_receivedHead];
+	if (source) *source = r->source;
+	if (dest)   *dest   = r->dest;
+	if (id)     *id     = r->id;
+	if (flags)  *flags  = r->flags;
+	if (*len > r->len)
+	    *len = r->len;
+	memcpy(buf, r->data, *len);
+	_receivedHead = (_receivedHead + 1) % RH_MESH_RECEIVE_QUEUE_SIZE;
+	_receivedCount--;
+	return true;
+    }
+#endif
+
     uint8_t tmpMessageLen = sizeof(_tmpMessage);
     uint8_t _source;
     uint8_t _dest;
@@ -163,62 +742,42 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
     {
 	MeshMessageHeader* p = (MeshMessageHeader*)&_tmpMessage;
 
-	if (   tmpMessageLen >= 1 
-	    && p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
+	uint8_t msgLen;
+	uint8_t* data = applicationData(p, tmpMessageLen, &msgLen);
+	if (data && _arpWaiting)
+	{
+	    // doArp() is waiting for a route: keep it for a later call, if there is room.
+	    // acceptMessage() has refused unicasts that would not fit, but not broadcasts
+#if RH_MESH_RECEIVE_QUEUE_SIZE > 0
+	    if (   _receivedCount < RH_MESH_RECEIVE_QUEUE_SIZE
+		&& msgLen <= RH_MESH_RECEIVE_QUEUE_MSG_LEN)
+	    {
+		ReceivedMessage* r = &_received[(_receivedHead + _receivedCount) % RH_MESH_RECEIVE_QUEUE_SIZE];
+		r->source = _source;
+		r->dest = _dest;
+		r->id = _id;
+		r->flags = _flags;
+		r->len = msgLen;
+		memcpy(r->data, data, msgLen);
+		_receivedCount++;
+	    }
+	    else
+#endif
+		_receiveQueueDropped++;
+	}
+	else if (data)
 	{
-	    MeshApplicationMessage* a = (MeshApplicationMessage*)p;
 	    // Handle application layer messages, presumably for our caller
 	    if (source) *source = _source;
 	    if (dest)   *dest   = _dest;
 	    if (id)     *id     = _id;
 	    if (flags)  *flags  = _flags;
-	    uint8_t msgLen = tmpMessageLen - sizeof(MeshMessageHeader);
 	    if (*len > msgLen)
 		*len = msgLen;
-	    memcpy(buf, a->data, *len);
+	    memcpy(buf, data, *len);
 	    
 	    return true;
 	}
-	else if (   _dest == RH_BROADCAST_ADDRESS 
-		 && tmpMessageLen > 1 
-		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
-	{
-	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)p;
-	    // Handle Route discovery requests
-	    // Message is an array of node addresses the route request has already passed through
-	    // If it originally came from us, ignore it
-	    if (_source == _thisAddress)
-		return false;
-	    
-	    uint8_t numRoutes = tmpMessageLen - sizeof(MeshMessageHeader) - 2;
-	    uint8_t i;
-	    // Are we already mentioned?
-	    for (i = 0; i < numRoutes; i++)
-		if (d->route[i] == _thisAddress)
-		    return false; // Already been through us. Discard
-	    
-	    // Hasnt been past us yet, record routes back to the earlier nodes
-	    addRouteTo(_source, headerFrom()); // The originator
-	    for (i = 0; i < numRoutes; i++)
-		addRouteTo(d->route[i], headerFrom());
-	    if (isPhysicalAddress(&d->dest, d->destlen))
-	    {
-		// This route discovery is for us. Unicast the whole route back to the originator
-		// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
-		// We are certain to have a route there, because we just got it
-		d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
-		RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
-	    }
-	    else if (i < _max_hops)
-	    {
-		// Its for someone else, rebroadcast it, after adding ourselves to the list
-		d->route[numRoutes] = _thisAddress;
-		tmpMessageLen++;
-		// Have to impersonate the source
-		// REVISIT: if this fails what can we do?
-		RHRouter::sendtoFromSourceWait(_tmpMessage, tmpMessageLen, RH_BROADCAST_ADDRESS, _source);
-	    }
-	}
     }
     return false;
 }
@@ -230,7 +789,13 @@ bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, ui
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
-	if (waitAvailableTimeout(timeLeft))
+	serviceRouteDiscovery();
+	// Wake up often enough to send waiting requests, and move messages from the pending queue 
+	// when there is room for them
+	if ((pendingQueueLength() || requestWaiting()) && timeLeft > RH_ROUTER_FORWARD_POLL)
+	    timeLeft = RH_ROUTER_FORWARD_POLL;
+	// Messages kept while doArp() was waiting can be had at once
+	if (receiveQueueLength() || waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, from, to, id, flags))
 		return true;
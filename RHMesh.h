@@ -14,9 +14,104 @@
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST        1
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE       2
 #define RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE                  3
+#define RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED                  4
 
-// Timeout for address resolution in milliecs
+// Default timeout for address resolution in milliecs, see setArpTimeout()
+#ifndef RH_MESH_ARP_TIMEOUT
 #define RH_MESH_ARP_TIMEOUT 4000
+#endif
+
+// The number of destinations whose routes can be discovered at once
+#ifndef RH_MESH_DISCOVERY_TABLE_SIZE
+ #if defined(__AVR__)
+  #define RH_MESH_DISCOVERY_TABLE_SIZE 2
+ #else
+  #define RH_MESH_DISCOVERY_TABLE_SIZE 4
+ #endif
+#endif
+
+// The number of messages sent by sendtoNoWait() that can be held until their routes are known.
+// 0 disables sendtoNoWait()
+#ifndef RH_MESH_PENDING_QUEUE_SIZE
+ #if defined(__AVR__)
+  #define RH_MESH_PENDING_QUEUE_SIZE 1
+ #else
+  #define RH_MESH_PENDING_QUEUE_SIZE 2
+ #endif
+#endif
+
+// The number of application layer messages for this node that can be kept while sendtoWait() is 
+// discovering a route, to be delivered by the next call to recvfromAck()
+#ifndef RH_MESH_RECEIVE_QUEUE_SIZE
+ #if defined(__AVR__)
+  #define RH_MESH_RECEIVE_QUEUE_SIZE 1
+ #else
+  #define RH_MESH_RECEIVE_QUEUE_SIZE 2
+ #endif
+#endif
+
+// The maximum length of the application layer data of a message that can be kept in the receive queue. 
+// Longer ones are not acknowledged to the previous hop, which will retransmit them later
+#ifndef RH_MESH_RECEIVE_QUEUE_MSG_LEN
+ #if defined(__AVR__)
+  #define RH_MESH_RECEIVE_QUEUE_MSG_LEN 32
+ #else
+  #define RH_MESH_RECEIVE_QUEUE_MSG_LEN 64
+ #endif
+#endif
+
+// The maximum length of a message (including the RHRouter header) that can be held in the pending queue.
+// The same as the forwarding queue, which the messages go to when their routes are known
+#ifndef RH_MESH_PENDING_MSG_LEN
+#define RH_MESH_PENDING_MSG_LEN RH_ROUTER_FORWARD_QUEUE_MSG_LEN
+#endif
+
+// The number of destinations whose path from route discovery is kept for source routing. 
+// 0 disables sending source routed messages (but they are still forwarded)
+#ifndef RH_MESH_SOURCE_ROUTE_CACHE_SIZE
+ #if defined(__AVR__)
+  #define RH_MESH_SOURCE_ROUTE_CACHE_SIZE 2
+ #else
+  #define RH_MESH_SOURCE_ROUTE_CACHE_SIZE 8
+ #endif
+#endif
+
+// The maximum number of relays in a path kept for source routing. Longer paths are not kept
+#ifndef RH_MESH_SOURCE_ROUTE_MAX_HOPS
+#define RH_MESH_SOURCE_ROUTE_MAX_HOPS 6
+#endif
+
+// The number of route discovery requests remembered, so that later copies of them are not rebroadcast.
+// 0 rebroadcasts every copy that has not been through this node already
+#ifndef RH_MESH_ROUTE_REQUEST_CACHE_SIZE
+ #if defined(__AVR__)
+  #define RH_MESH_ROUTE_REQUEST_CACHE_SIZE 4
+ #else
+  #define RH_MESH_ROUTE_REQUEST_CACHE_SIZE 8
+ #endif
+#endif
+
+// Time in millisecs after the first copy of a route discovery request during which a copy
+// that came by a shorter path is still rebroadcast
+#ifndef RH_MESH_ROUTE_REQUEST_WINDOW
+#define RH_MESH_ROUTE_REQUEST_WINDOW 250
+#endif
+
+// Expanding ring search, see setExpandingRing(). The number of hops the first route discovery request 
+// may travel. 0 floods every request across the whole network
+#ifndef RH_MESH_RING_TTL_START
+#define RH_MESH_RING_TTL_START 1
+#endif
+
+// The number of hops each later ring adds
+#ifndef RH_MESH_RING_TTL_INCREMENT
+#define RH_MESH_RING_TTL_INCREMENT 2
+#endif
+
+// The largest ring. The request after it is flooded across the whole network
+#ifndef RH_MESH_RING_TTL_THRESHOLD
+#define RH_MESH_RING_TTL_THRESHOLD 5
+#endif
 
 /////////////////////////////////////////////////////////////////////
 /// \class RHMesh RHMesh.h <RHMesh.h>
@@ -49,6 +144,25 @@
 /// If a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST that already has itself 
 /// listed in the visited nodes, it knows it has already seen and rebroadcast this request, 
 /// and threfore ignores it. This prevents broadcast storms.
+/// In a dense mesh, copies of the same request also reach a node by many different paths. 
+/// Relays keep the ID the originator gave the request, and each node remembers the originator and ID 
+/// of the last RH_MESH_ROUTE_REQUEST_CACHE_SIZE requests it rebroadcast. It rebroadcasts only the
+/// first copy of a request, and any later copy that visited fewer nodes and arrives within 
+/// RH_MESH_ROUTE_REQUEST_WINDOW milliseconds of the first. The other copies still give the node 
+/// alternate routes back to the originator, but are not rebroadcast. 
+/// This reduces the number of broadcasts for one route discovery from growing with the square of the 
+/// number of nodes to about one per node.
+///
+/// Most destinations are usually only a hop or two away, so the request need not reach every node. 
+/// RHMesh searches in expanding rings (see setExpandingRing()): the first request may travel only 
+/// RH_MESH_RING_TTL_START hops. If no reply comes in time, the next request may travel 
+/// RH_MESH_RING_TTL_INCREMENT hops further, and so on up to RH_MESH_RING_TTL_THRESHOLD hops. 
+/// After that, the request is flooded across the whole network. The rings and the flood share the 
+/// timeout set by setArpTimeout(): a ring that would need more than half of the time left is skipped, 
+/// and the request flooded at once with the rest of it. The HOPS field of a request counts up to max_hops (see setMaxHops()) as it is 
+/// rebroadcast, like that of any routed message, and nodes do not rebroadcast it any further once 
+/// it gets there. So the originator limits how far its request travels by starting HOPS higher than 0.
+/// A request from a node without expanding ring search starts at 0, and still reaches the whole network.
 /// When a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST it can use the list of 
 /// nodes aready visited to deduce routes back towards the originating (requesting node). 
 /// This also means that when the destination node of the request is reached, it (and all 
@@ -65,9 +179,35 @@
 /// RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE together ensure the original requester and all 
 /// the intermediate nodes know how to route to the source and destination nodes and every node along the path.
 ///
-/// Note that there is a race condition here that can effect routing on multipath routes. For example, 
-/// if the route to the destination can traverse several paths, last reply from the destination 
-/// will be the one used.
+/// Routes learned from route discovery are added with the number of hops to the node as their metric. 
+/// If the route to the destination can traverse several paths, the requests and replies
+/// that arrive by the other paths give alternate next hops, and the route with the fewest hops is used
+/// (see RHRouter for details on metrics and alternate next hops).
+///
+/// \par Concurrent Route Discovery
+///
+/// Each route discovery is a small state machine, so routes to up to RH_MESH_DISCOVERY_TABLE_SIZE
+/// destinations can be discovered at once. discoverRoute() broadcasts the request and returns at once. 
+/// The requests of concurrent discoveries are sent a random time of between one and two acknowledgement 
+/// timeouts (see setTimeout()) apart, because the neighbours that are still rebroadcasting one request 
+/// cannot hear the next.
+/// The discovery ends when the first reply to it arrives (which adds the route), or a route to the destination 
+/// is learned from some other route discovery message (such as a request from the destination itself), 
+/// or when the timeout set by setArpTimeout() (RH_MESH_ARP_TIMEOUT by default) expires, 
+/// counting from when the discovery started. isDiscovering() tells whether it is still in progress.
+/// recvfromAck() and recvfromAckTimeout() handle the replies, so you must keep calling one of them.
+/// sendtoWait() still blocks while it discovers a route, but now only until the first reply arrives, and 
+/// it still rebroadcasts the requests of other nodes meanwhile. Application layer messages for this node 
+/// that arrive meanwhile are kept in a receive queue of RH_MESH_RECEIVE_QUEUE_SIZE messages, and delivered 
+/// by the next calls to recvfromAck(). While the queue is full, messages for this node are not acknowledged 
+/// (so the previous hop will retransmit them later), and broadcasts are dropped. 
+/// receiveQueueDropped() counts both.
+///
+/// If you do not want to block at all, send with sendtoNoWait() instead. It starts discovering the route 
+/// if necessary, and holds the message in a pending queue of RH_MESH_PENDING_QUEUE_SIZE messages. 
+/// When the route is known, the message moves to the RHRouter forwarding queue, and is sent
+/// to the next hop in the background like the messages being forwarded for other nodes. 
+/// If the discovery times out, the message is dropped and counted by pendingQueueDropped().
 ///
 /// \par Route Failure
 ///
@@ -83,6 +223,23 @@
 /// node of the original message. This means that if a route to a destination becomes unusable 
 /// (either because an intermediate node is off the air, or has moved out of range) a new route 
 /// will be established the next time a message is to be sent.
+/// Before giving up on the next hop, a node tries any alternate next hops it knows for the route, 
+/// so a single failed node often costs no route discovery at all.
+///
+/// \par Source Routing
+///
+/// Normally every relay looks up the next hop of a message in its own routing table, and if it has no 
+/// route (say because it was retired to make room for another), the message fails and the originator 
+/// has to discover a new route. If you call setSourceRouting(true), the originator keeps the path 
+/// (the list of relays) that each route discovery it makes finds to the destination, for up to 
+/// RH_MESH_SOURCE_ROUTE_CACHE_SIZE destinations and RH_MESH_SOURCE_ROUTE_MAX_HOPS relays, and sends 
+/// messages to those destinations as MeshSourceRoutedMessage, which carries the path. 
+/// Relays forward these to the next relay in the path (the one after the number of hops the message has
+/// already taken), without looking in their routing tables. If a relay cannot deliver to the next relay, 
+/// it sends a RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE to the originator, which forgets the path and the route. 
+/// Messages that are too long to carry the path, and messages to destinations with no path, are routed 
+/// with the routing table as usual.
+/// All nodes forward source routed messages, whether or not they use source routing themselves.
 ///
 /// \par Message Format
 ///
@@ -94,6 +251,8 @@
 ///   (broadcast) and replies (unicast).
 /// - MeshRouteFailureMessage (message type RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE) Informs nodes of 
 ///   route failures.
+/// - MeshSourceRoutedMessage (message type RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED). 
+///   Carries an application layer message for the caller of RHMesh, and the path to its destination.
 ///
 /// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers 
 /// (see http://www.hoperf.com)
@@ -106,10 +265,15 @@
 /// SRAM for your program, it may result in failure to run, or wierd crashes and other hard to trace behaviour.
 /// In this event you should consider a processor with more SRAM, such as the MotienoMEGA with 16k
 /// (https://lowpowerlab.com/shop/moteinomega) or others.
+/// Each RHMesh instance has its own message buffers of RH_ROUTER_MAX_MESSAGE_LEN octets, so you can 
+/// reduce their size by defining RH_ROUTER_MAX_MESSAGE_LEN, and several instances (for several radios,
+/// or for simulating several nodes in one process) do not interfere with each other.
 ///
 /// \par Performance
-/// This class (in the interests of simple implemtenation and low memory use) does not have
-/// message queueing. This means that only one message at a time can be handled. Message transmission 
+/// This class (in the interests of simple implemtenation and low memory use) has only a small queue
+/// for messages it sends itself, used by sendtoNoWait(). sendtoWait() handles one message at a time. 
+/// Messages being relayed for other nodes are held in the small RHRouter forwarding queue, so a relay 
+/// keeps receiving while it forwards them. Message transmission 
 /// failures can have a severe impact on network performance.
 /// If you need high performance mesh networking under all conditions consider XBee or similar.
 class RHMesh : public RHRouter
@@ -148,6 +312,15 @@ public:
 	uint8_t             dest; ///< The address of the destination towards which the route failed
     } MeshRouteFailureMessage;
 
+    /// Signals an application layer message that carries the path to its destination
+    typedef struct
+    {
+	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	uint8_t             pathlen; ///< Number of relays in path
+	uint8_t             path[RH_MESH_MAX_MESSAGE_LEN - 1]; ///< Addresses of the relays from the originator to the destination, 
+	                                                       ///< followed by the application layer payload data
+    } MeshSourceRoutedMessage;
+
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
@@ -156,22 +329,27 @@ public:
     /// Sends a message to the destination node. Initialises the RHRouter message header 
     /// (the SOURCE address is set to the address of this node, HOPS to 0) and calls 
     /// route() which looks up in the routing table the next hop to deliver to.
-    /// If no route is known, initiates route discovery and waits for a reply.
-    /// Then sends the message to the next hop
+    /// If no route is known, initiates route discovery and waits for a reply, for at most the timeout 
+    /// set by setArpTimeout(). Then sends the message to the next hop
     /// Then waits for an acknowledgement from the next hop 
-    /// (but not from the destination node (if that is different).
+    /// (but not from the destination node (if that is different), unless flags includes 
+    /// RH_ROUTER_FLAGS_E2E_ACK_REQUEST (see RHRouter::sendtoWait()).
     /// \param [in] buf The application message data
     /// \param [in] len Number of octets in the application message data. 0 is permitted
     /// \param [in] dest The destination node address. If the address is RH_BROADCAST_ADDRESS (255)
     /// the message will be broadcast to all the nearby nodes, but not routed or relayed.
     /// \param [in] flags Optional flags for use by subclasses or application layer, 
     ///             delivered end-to-end to the dest address. The receiver can recover the flags with recvFromAck().
+    ///             The bits in RH_ROUTER_FLAGS_RESERVED are not delivered. 
     /// \return The result code:
     ///         - RH_ROUTER_ERROR_NONE Message was routed and delivered to the next hop 
-    ///           (not necessarily to the final dest address)
+    ///           (not necessarily to the final dest address), or to the dest address if 
+    ///           RH_ROUTER_FLAGS_E2E_ACK_REQUEST was set
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
+    ///         - RH_ROUTER_ERROR_NO_REPLY RH_ROUTER_FLAGS_E2E_ACK_REQUEST was set, and the dest address did not 
+    ///           acknowledge the message end-to-end
     uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
 
     /// Starts the receiver if it is not running already, processes and possibly routes any received messages
@@ -213,6 +391,84 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Enables or disables source routing of the messages sent by sendtoWait(). Disabling it forgets the paths kept.
+    /// Has no effect if RH_MESH_SOURCE_ROUTE_CACHE_SIZE is 0
+    /// \param [in] enable true to send messages to destinations with a known path as MeshSourceRoutedMessage. 
+    /// Defaults to false
+    void setSourceRouting(bool enable);
+
+    /// Sets how long a route discovery may take before it fails, including any expanding ring search. 
+    /// This is the longest time sendtoWait() blocks discovering a route.
+    /// \param [in] timeout The time in milliseconds. Defaults to RH_MESH_ARP_TIMEOUT
+    void setArpTimeout(uint16_t timeout);
+
+    /// Sets up expanding ring search for route discoveries started from now on. 
+    /// The first route discovery request may travel start hops, and each later one increment hops more, 
+    /// until a reply arrives. The request after the one that may travel threshold hops is flooded across 
+    /// the whole network.
+    /// \param [in] start The number of hops the first request may travel. 0 disables expanding ring 
+    /// search, so that every request is flooded across the whole network. Defaults to RH_MESH_RING_TTL_START
+    /// \param [in] increment The number of hops each later request may travel further. 
+    /// Defaults to RH_MESH_RING_TTL_INCREMENT
+    /// \param [in] threshold The number of hops the largest ring may reach. Defaults to RH_MESH_RING_TTL_THRESHOLD
+    /// \param [in] hopTimeout How long to wait for a reply for each hop the request may travel, in milliseconds, 
+    /// counting the request and the reply. 0 (the default) uses a random time of between one and two 
+    /// acknowledgement timeouts (see setTimeout())
+    void setExpandingRing(uint8_t start, uint8_t increment, uint8_t threshold, uint16_t hopTimeout = 0);
+
+    /// Starts discovering a route to a destination, without waiting for the reply. 
+    /// Does nothing if there is a route already, or a discovery in progress. 
+    /// You must keep calling recvfromAck() or recvfromAckTimeout() to handle the reply.
+    /// \param [in] dest The destination node address
+    /// \return false if the discovery could not be started, because RH_MESH_DISCOVERY_TABLE_SIZE 
+    /// discoveries are in progress already, or the request could not be sent
+    bool discoverRoute(uint8_t dest);
+
+    /// Tells whether a route discovery for a destination is in progress
+    /// \param [in] dest The destination node address
+    /// \return true if the route to dest is still being discovered
+    bool isDiscovering(uint8_t dest);
+
+    /// Sends a message to the destination node without waiting, through the pending queue and the RHRouter 
+    /// forwarding queue. If no route is known, starts discovering one, and holds the message until the route is 
+    /// known. The message is never source routed, and never acknowledged end to end.
+    /// \param [in] buf The application message data
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest The destination node address. If the address is RH_BROADCAST_ADDRESS (255)
+    /// the message is broadcast to all the nearby nodes at once
+    /// \param [in] flags Optional flags for use by subclasses or application layer, 
+    ///             delivered end-to-end to the dest address. The bits in RH_ROUTER_FLAGS_RESERVED are not delivered. 
+    /// \return The result code:
+    ///         - RH_ROUTER_ERROR_NONE The message was queued (which does not mean that it will be delivered)
+    ///         - RH_ROUTER_ERROR_INVALID_LENGTH The message is too long for the pending queue
+    ///         - RH_ROUTER_ERROR_NO_ROUTE The route could not be discovered (see discoverRoute()), 
+    ///           or the pending queue is full
+    uint8_t sendtoNoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+
+    /// Moves messages in the pending queue whose routes are now known to the forwarding queue, 
+    /// and ends route discoveries that have timed out, dropping their messages. Never blocks.
+    /// Called by recvfromAck() and recvfromAckTimeout(), but you can call it yourself if you do not call those often enough.
+    void serviceRouteDiscovery();
+
+    /// Returns the number of messages in the pending queue
+    /// \return The number of messages. Always 0 if RH_MESH_PENDING_QUEUE_SIZE is 0
+    uint8_t pendingQueueLength();
+
+    /// Returns the number of messages dropped from the pending queue because the discovery of their route failed
+    /// \return The number of messages dropped
+    uint32_t pendingQueueDropped();
+
+    /// Returns the number of application layer messages for this node kept in the receive queue 
+    /// while sendtoWait() was discovering a route, and not yet delivered by recvfromAck()
+    /// \return The number of messages. Always 0 if RH_MESH_RECEIVE_QUEUE_SIZE is 0
+    uint8_t receiveQueueLength();
+
+    /// Returns the number of application layer messages for this node that were refused or dropped 
+    /// while sendtoWait() was discovering a route, because the receive queue was full, or because they 
+    /// were too long for it
+    /// \return The number of messages refused or dropped
+    uint32_t receiveQueueDropped();
+
 protected:
 
     /// Internal function that inspects messages being received and adjusts the routing table if necessary.
@@ -221,6 +477,18 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual void peekAtMessage(RoutedMessage* message, uint8_t messageLen);
 
+    /// Says that route discovery requests and responses, and route failures, are for RHMesh itself
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    /// \return true if the message is a RHMesh control message
+    virtual bool isControlMessage(RoutedMessage* message, uint8_t messageLen);
+
+    /// Answers or rebroadcasts route discovery requests, even while sendtoWait() is waiting for an 
+    /// end-to-end acknowledgement. Responses and failures have already been handled by peekAtMessage()
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    virtual void handleControlMessage(RoutedMessage* message, uint8_t messageLen);
+
     /// Internal function that inspects messages being received and adjusts the routing table if necessary.
     /// This is virtual, which lets subclasses override or intercept the route() function.
     /// Called by sendtoWait after the message header has been filled in.
@@ -228,8 +496,35 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
-    /// Try to resolve a route for the given address. Blocks while discovering the route
-    /// which may take up to 4000 msec.
+    /// Called when a message cannot be delivered to the next hop, either when sending it or when forwarding it.
+    /// Deletes the route, and if the message was being forwarded, sends a RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE 
+    /// message to its originator
+    /// \param [in] message Pointer to the RHRouter message that could not be delivered
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node the message was received from
+    /// \param [in] iface The interface the message was received through
+    virtual void routeFailed(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface);
+
+    /// Gives the next hop of a MeshSourceRoutedMessage from the path it carries
+    /// \param [in] message Pointer to the RHRouter message to be sent or forwarded
+    /// \param [in] messageLen Length of message in octets
+    /// \return The address of the next hop, or RH_BROADCAST_ADDRESS if it is not a MeshSourceRoutedMessage
+    virtual uint8_t pathNextHop(RoutedMessage* message, uint8_t messageLen);
+
+    /// Refuses application layer messages for this node while sendtoWait() is discovering a route, 
+    /// if the receive queue cannot keep them, so that the previous hop keeps them and tries again later
+    /// \param[in] buf The message
+    /// \param[in] len The length of the message
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID of the message
+    /// \return true if the message can be kept
+    virtual bool acceptMessage(uint8_t* buf, uint8_t len, uint8_t from, uint8_t to, uint8_t id);
+
+    /// Try to resolve a route for the given address. Blocks while discovering the route,
+    /// until the first reply arrives or the timeout set by setArpTimeout() expires. The expanding 
+    /// ring search is part of that time, so doArp() never blocks for longer.
+    /// Application layer messages that arrive meanwhile are kept in the receive queue if there is room.
     /// Virtual so subclasses can override.
     /// \param [in] address The physical address to resolve
     /// \return true if the address was resolved and added to the local routing table
@@ -239,7 +534,7 @@ protected:
     /// physical address of this node.
     /// RHMesh always implements physical addresses as the 1 octet address of the node
     /// given by _thisAddress
-    /// Called by recvfromAck() to test whether a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
+    /// Called by handleControlMessage() to test whether a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
     /// is for this node.
     /// Subclasses may want to override to implement more complicated or longer physical addresses
     /// \param [in] address Address of the pyysical addres being tested
@@ -248,8 +543,178 @@ protected:
     virtual bool isPhysicalAddress(uint8_t* address, uint8_t addresslen);
 
 private:
-    /// Temporary message buffer
-    static uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    /// A path kept for source routing
+    typedef struct
+    {
+	uint8_t             dest;    ///< The destination. RH_BROADCAST_ADDRESS if unused
+	uint8_t             pathlen; ///< Number of relays in path
+	uint8_t             path[RH_MESH_SOURCE_ROUTE_MAX_HOPS]; ///< Addresses of the relays from this node to dest
+    } SourceRoute;
+#endif
+
+    /// A route discovery in progress
+    typedef struct
+    {
+	uint8_t             dest;    ///< The destination. RH_BROADCAST_ADDRESS if unused
+	bool                sent;    ///< Whether the request for the current ring has been sent
+	uint8_t             ttl;     ///< The number of hops the request may travel. 0 for the whole network
+	unsigned long       begun;   ///< Time the discovery started in millis()
+	unsigned long       started; ///< Time the request was sent in millis()
+	uint16_t            timeout; ///< How long to wait for a reply to the request
+    } Discovery;
+
+#if RH_MESH_PENDING_QUEUE_SIZE > 0
+    /// A message sent by sendtoNoWait() waiting for its route
+    typedef struct
+    {
+	uint8_t             len;     ///< Length of the message
+	uint8_t             data[RH_MESH_PENDING_MSG_LEN]; ///< The RHRouter message
+    } PendingMessage;
+#endif
+
+#if RH_MESH_RECEIVE_QUEUE_SIZE > 0
+    /// An application layer message for this node kept while sendtoWait() is discovering a route
+    typedef struct
+    {
+	uint8_t             source;  ///< The originator
+	uint8_t             dest;    ///< This node or RH_BROADCAST_ADDRESS
+	uint8_t             id;      ///< The ID in the RHRouter header
+	uint8_t             flags;   ///< The flags in the RHRouter header
+	uint8_t             len;     ///< Length of the application layer data
+	uint8_t             data[RH_MESH_RECEIVE_QUEUE_MSG_LEN]; ///< The application layer data
+    } ReceivedMessage;
+#endif
+
+#if RH_MESH_ROUTE_REQUEST_CACHE_SIZE > 0
+    /// A route discovery request that was rebroadcast
+    typedef struct
+    {
+	uint8_t             source;   ///< The originator of the request. RH_BROADCAST_ADDRESS if unused
+	uint8_t             id;       ///< The ID of the request
+	uint8_t             hops;     ///< Fewest nodes visited by a copy that was rebroadcast
+	unsigned long       received; ///< Time the first copy was received in millis()
+    } RouteRequest;
+#endif
+
+    /// Finds the path kept for source routing to dest
+    /// \param [in] dest The destination node address
+    /// \param [out] pathlen Set to the number of relays in the path
+    /// \return The addresses of the relays, or NULL if there is no path or source routing is disabled
+    uint8_t* sourceRoute(uint8_t dest, uint8_t* pathlen);
+
+    /// Keeps a path from route discovery for source routing, unless a shorter one is kept already
+    void addSourceRoute(uint8_t dest, uint8_t* path, uint8_t pathlen);
+
+    /// Forgets the path kept for source routing to dest, if any
+    void deleteSourceRoute(uint8_t dest);
+
+    /// Finds the application layer data in a RHMesh message
+    /// \param [in] p The RHMesh message
+    /// \param [in] messageLen Length of the RHMesh message in octets
+    /// \param [out] len Set to the length of the application layer data
+    /// \return The application layer data, or NULL if the message is not an application layer message
+    uint8_t* applicationData(MeshMessageHeader* p, uint8_t messageLen, uint8_t* len);
+
+    /// Finds the route discovery in progress for dest
+    /// \param [in] dest The destination node address
+    /// \return The discovery, or NULL if there is none
+    Discovery* findDiscovery(uint8_t dest);
+
+    /// Moves the route discoveries whose requests have timed out to their next ring, 
+    /// or ends them if the request was flooded across the whole network
+    void timeoutDiscoveries();
+
+    /// Ends the route discoveries whose destinations now have routes, whether learned from the 
+    /// reply or some other route discovery message
+    void endDiscoveries();
+
+    /// Broadcasts the request of a route discovery, if it is long enough since the last one
+    /// \param [in] d The discovery
+    /// \return false if the request could not be sent
+    bool sendRouteRequest(Discovery* d);
+
+    /// Tells whether any route discovery requests are waiting to be sent, 
+    /// or will be when the request for a smaller ring times out
+    /// \return true if there are requests waiting
+    bool requestWaiting();
+
+    /// Checks whether a copy of a route discovery request need not be rebroadcast, because a copy that 
+    /// visited as few nodes was rebroadcast already, or the first copy was rebroadcast too long ago. 
+    /// Otherwise remembers the request.
+    /// \param [in] source The originator of the request
+    /// \param [in] id The ID of the request
+    /// \param [in] hops The number of nodes the copy has visited
+    /// \return true if the copy should not be rebroadcast
+    bool isRouteRequestDuplicate(uint8_t source, uint8_t id, uint8_t hops);
+
+    /// Temporary message buffer. Not static, so that several instances can be used at once.
+    /// Separate from the RHRouter one, which receives while sendtoWait() waits for an end-to-end 
+    /// acknowledgement, because each retransmission is built again from the message kept here
+    uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+
+    /// How long a route discovery waits for a reply in milliseconds
+    uint16_t            _arpTimeout;
+
+    /// Route discoveries in progress
+    Discovery           _discoveries[RH_MESH_DISCOVERY_TABLE_SIZE];
+
+    /// Time the last route discovery request was sent in millis(), and how long to wait before the next
+    unsigned long       _lastRouteRequest;
+    uint16_t            _routeRequestSpacing;
+
+    /// Expanding ring search, see setExpandingRing()
+    uint8_t             _ringStart;
+    uint8_t             _ringIncrement;
+    uint8_t             _ringThreshold;
+    uint16_t            _ringHopTimeout;
+
+#if RH_MESH_PENDING_QUEUE_SIZE > 0
+    /// Messages waiting for their routes, oldest first
+    PendingMessage      _pending[RH_MESH_PENDING_QUEUE_SIZE];
+
+    /// Number of messages in _pending
+    uint8_t             _pendingCount;
+#endif
+
+    /// Number of messages dropped from _pending
+    uint32_t            _pendingDropped;
+
+    /// Whether doArp() is waiting for a route, so that application layer messages have to be kept for later
+    bool                _arpWaiting;
+
+#if RH_MESH_RECEIVE_QUEUE_SIZE > 0
+    /// Messages kept while doArp() was waiting, oldest first from _receivedHead
+    ReceivedMessage     _received[RH_MESH_RECEIVE_QUEUE_SIZE];
+
+    /// Index in _received of the oldest message
+    uint8_t             _receivedHead;
+
+    /// Number of messages in _received
+    uint8_t             _receivedCount;
+#endif
+
+    /// Number of messages refused or dropped because they could not be kept in _received
+    uint32_t            _receiveQueueDropped;
+
+#if RH_MESH_ROUTE_REQUEST_CACHE_SIZE > 0
+    /// Route discovery requests rebroadcast recently
+    RouteRequest        _routeRequests[RH_MESH_ROUTE_REQUEST_CACHE_SIZE];
+
+    /// Index in _routeRequests of the next request to replace
+    uint8_t             _routeRequestNext;
+#endif
+
+#if RH_MESH_SOURCE_ROUTE_CACHE_SIZE > 0
+    /// Whether sendtoWait() sends source routed messages
+    bool                _sourceRouting;
+
+    /// Paths kept for source routing
+    SourceRoute         _sourceRoutes[RH_MESH_SOURCE_ROUTE_CACHE_SIZE];
+
+    /// Index in _sourceRoutes of the next path to replace
+    uint8_t             _sourceRouteNext;
+#endif
 
 };
 
@@ -22,6 +22,24 @@ RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddr
     _lastSequenceNumber = 0;
     _timeout = RH_DEFAULT_TIMEOUT;
     _retries = RH_DEFAULT_RETRIES;
+    _windowSize = 1;
+    _adaptiveTimeout = false;
+    _rxQueueDropped = 0;
+    _ackDelay = 0;
+    _groupAckSlot = RH_RELIABLE_GROUP_ACK_SLOT;
+    _acceptor = NULL;
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    _rxQueueHead = 0;
+    _rxQueueCount = 0;
+#endif
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_PEER_TABLE_SIZE; i++)
+	_peers[i].address = RH_BROADCAST_ADDRESS;
+    _lastPeer = NULL;
+    for (i = 0; i < RH_RELIABLE_ASYNC_SLOTS; i++)
+	_async[i].status = RH_ASYNC_STATUS_INVALID;
+    for (i = 0; i < RH_RELIABLE_PENDING_ACKS; i++)
+	_pendingAcks[i].address = RH_BROADCAST_ADDRESS;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -31,6 +49,12 @@ void RHReliableDatagram::setTimeout(uint16_t timeout)
     _timeout = timeout;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setAdaptiveTimeout(bool adaptive)
+{
+    _adaptiveTimeout = adaptive;
+}
+
 ////////////////////////////////////////////////////////////////////
 void RHReliableDatagram::setRetries(uint8_t retries)
 {
@@ -43,69 +67,334 @@ uint8_t RHReliableDatagram::retries()
     return _retries;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setWindowSize(uint8_t window)
+{
+    if (window < 1)
+	window = 1;
+    if (window > RH_RELIABLE_MAX_WINDOW)
+	window = RH_RELIABLE_MAX_WINDOW;
+    _windowSize = window;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::windowSize()
+{
+    return _windowSize;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 {
-    // Assemble the message
-    uint8_t thisSequenceNumber = ++_lastSequenceNumber;
-    uint8_t retries = 0;
-    while (retries++ <= _retries)
+    // Stop-and-wait is just a window of one message
+    return sendtoWaitWindowed(&buf, &len, 1, address) == 1;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::sendtoWaitWindowed(uint8_t** bufs, uint8_t* lens, uint8_t count, uint8_t address)
+{
+    // State of the frames in the window is kept in slots indexed by (message index % RH_RELIABLE_MAX_WINDOW)
+    uint8_t ids[RH_RELIABLE_MAX_WINDOW];     // Sequence number assigned to the message in each slot
+    uint8_t tries[RH_RELIABLE_MAX_WINDOW];   // Number of times the message in each slot has been sent
+    uint8_t acked = 0;                       // Bitmask of slots that have been acknowledged
+    uint8_t base = 0;                        // Index of the oldest unacknowledged message
+    uint8_t next = 0;                        // Index of the next message that has never been sent
+
+    while (base < count)
     {
-	setHeaderId(thisSequenceNumber);
-	setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_ACK); // Clear the ACK flag
-	sendto(buf, len, address);
-	waitPacketSent();
+	uint8_t end = (count - base > _windowSize) ? base + _windowSize : count;
+	uint8_t i, slot;
+
+	// The last unacknowledged frame in the window is sent without RH_FLAGS_WINDOW,
+	// which asks the recipient to acknowledge the whole burst
+	uint8_t last = end - 1;
+	while (last > base && last < next && (acked & (1 << (last % RH_RELIABLE_MAX_WINDOW))))
+	    last--;
+
+	// Send a burst of every unacknowledged frame in the window
+	unsigned long burstStartTime = millis();
+	uint8_t burstFrames = 0;
+	for (i = base; i <= last; i++)
+	{
+	    slot = i % RH_RELIABLE_MAX_WINDOW;
+	    if (i >= next)
+	    {
+		// First time this message has been sent
+		ids[slot] = ++_lastSequenceNumber;
+		tries[slot] = 0;
+		acked &= ~(1 << slot);
+		next = i + 1;
+	    }
+	    if (acked & (1 << slot))
+		continue;
+	    if (tries[slot]++ > _retries)
+	    {
+		statsDelivered(address, 0, 0);
+		return base; // Retries exhausted
+	    }
+	    setHeaderId(ids[slot]);
+	    setHeaderFlags(i == last ? RH_FLAGS_NONE : RH_FLAGS_WINDOW, RH_FLAGS_ACK | RH_FLAGS_WINDOW | RH_FLAGS_PIGGYBACK);
+	    sendtoPiggyback(bufs[i], lens[i], address);
+	    waitPacketSent();
+	    burstFrames++;
+	    if (tries[slot] > 1)
+		_retransmissions++;
+	    statsSent(address, tries[slot] > 1);
+	}
 
 	// Never wait for ACKS to broadcasts:
 	if (address == RH_BROADCAST_ADDRESS)
-	    return true;
+	{
+	    base = last + 1;
+	    continue;
+	}
 
-	if (retries > 1)
-	    _retransmissions++;
 	unsigned long thisSendTime = millis(); // Timeout does not include original transmit time
-
-	// Compute a new timeout, random between _timeout and _timeout*2
-	// This is to prevent collisions on every retransmit
-	// if 2 nodes try to transmit at the same time
-#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
-	uint16_t timeout = _timeout + (_timeout * (random() & 0xFF) / 256);
-#else
-	uint16_t timeout = _timeout + (_timeout * random(0, 256) / 256);
-#endif
+	uint16_t timeout = ackTimeout(address, (thisSendTime - burstStartTime) / burstFrames);
+	// Only measure the round trip time of frames that have not been retransmitted (Karn)
+	bool measureRtt = (tries[last % RH_RELIABLE_MAX_WINDOW] == 1);
 	int32_t timeLeft;
-        while ((timeLeft = timeout - (millis() - thisSendTime)) > 0)
+	bool lastAcked = false;
+	// Nothing from the transmit queue while the ACK may be arriving
+	holdQueue(true);
+        while (!lastAcked && (timeLeft = timeout - (millis() - thisSendTime)) > 0)
 	{
-	    if (waitAvailableTimeout(timeLeft))
+	    uint8_t from, ackId, sack;
+	    if (waitAck(timeLeft, &from, &ackId, &sack))
 	    {
-		uint8_t from, to, id, flags;
-		if (recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
+		// Now have an ACK: is it for one of our frames?
+		bool matched = false;
+		for (i = base; i <= last && from == address; i++)
 		{
-		    // Now have a message: is it our ACK?
-		    if (   from == address 
-			   && to == _thisAddress 
-			   && (flags & RH_FLAGS_ACK) 
-			   && (id == thisSequenceNumber))
+		    slot = i % RH_RELIABLE_MAX_WINDOW;
+		    uint8_t diff = ackId - ids[slot];
+		    if (diff == 0 || (diff <= 8 && (sack & (1 << (diff - 1)))))
 		    {
-			// Its the ACK we are waiting for
-			return true;
+			uint16_t rtt = 0;
+			matched = true;
+			if (i == last && diff == 0)
+			{
+			    lastAcked = true; // No more ACKs to come for this burst
+			    if (measureRtt)
+			    {
+				rtt = millis() - thisSendTime;
+				if (_adaptiveTimeout)
+				    updateRtt(address, rtt);
+			    }
+			}
+			if (!(acked & (1 << slot)))
+			    statsDelivered(address, tries[slot], rtt);
+			acked |= (1 << slot);
 		    }
-		    else if (   !(flags & RH_FLAGS_ACK)
-				&& (id == _seenIds[from]))
-		    {
-			// This is a request we have already received. ACK it again
-			acknowledge(id, from);
-		    }
-		    // Else discard it
 		}
+		// Else maybe its for a message sent with sendtoAsync()
+		if (!matched)
+		    asyncAcknowledged(from, ackId);
 	    }
 	    // Not the one we are waiting for, maybe keep waiting until timeout exhausted
 	    YIELD;
 	}
-	// Timeout exhausted, maybe retry
+	holdQueue(false);
+	// The ACK has come or is overdue, so let one queued message go before the next frame
+	if (serviceQueue())
+	    waitPacketSent();
+
+	if (!lastAcked && _adaptiveTimeout)
+	    backoffRtt(address);
+
+	// Move the window past all the frames at the start that have been acknowledged
+	while (base < next && (acked & (1 << (base % RH_RELIABLE_MAX_WINDOW))))
+	{
+	    acked &= ~(1 << (base % RH_RELIABLE_MAX_WINDOW));
+	    base++;
+	}
+	// Timeout exhausted or some frames missing, maybe retry
 	YIELD;
     }
-    // Retries exhausted
-    return false;
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::sendtoGroupWait(uint8_t* buf, uint8_t len, uint8_t* members, uint8_t count, uint8_t* status)
+{
+    uint8_t frame[RH_MAX_MESSAGE_LEN];
+    uint8_t id = ++_lastSequenceNumber;
+    uint8_t delivered = 0;
+    uint8_t tries, i;
+
+    for (i = 0; i < count; i++)
+	status[i] = RH_ASYNC_STATUS_PENDING;
+    if (count == 0 || RH_RELIABLE_GROUP_HEADER_LEN + count + len > maxMessageLength())
+    {
+	for (i = 0; i < count; i++)
+	    status[i] = RH_ASYNC_STATUS_FAILED;
+	return 0;
+    }
+
+    for (tries = 0; tries <= _retries && delivered < count; tries++)
+    {
+	// Only the members that have not acknowledged yet are listed, and each one
+	// acknowledges in the slot given by its position in the list
+	uint8_t listed = 0;
+	for (i = 0; i < count; i++)
+	{
+	    if (status[i] != RH_ASYNC_STATUS_PENDING)
+		continue;
+	    frame[RH_RELIABLE_GROUP_HEADER_LEN + listed++] = members[i];
+	    statsSent(members[i], tries > 0, false);
+	}
+	frame[0] = listed;
+	frame[1] = _groupAckSlot >> 8;
+	frame[2] = _groupAckSlot & 0xff;
+	memcpy(frame + RH_RELIABLE_GROUP_HEADER_LEN + listed, buf, len);
+
+	setHeaderId(id);
+	setHeaderFlags(RH_FLAGS_GROUP, RH_FLAGS_ACK | RH_FLAGS_WINDOW | RH_FLAGS_PIGGYBACK | RH_FLAGS_GROUP);
+	sendto(frame, RH_RELIABLE_GROUP_HEADER_LEN + listed + len, RH_BROADCAST_ADDRESS);
+	waitPacketSent();
+	setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_GROUP);
+	if (tries > 0)
+	    _retransmissions++;
+
+	// Wait for the last slot, then the usual timeout for its ACK to arrive
+	unsigned long thisSendTime = millis();
+	uint32_t timeout = (uint32_t)_groupAckSlot * listed + randomTimeout();
+	int32_t timeLeft;
+	uint8_t acked = 0;
+	holdQueue(true);
+	while (acked < listed && (timeLeft = timeout - (millis() - thisSendTime)) > 0)
+	{
+	    uint8_t from, ackId, sack;
+	    if (waitAck(timeLeft > 0xffff ? 0xffff : timeLeft, &from, &ackId, &sack))
+	    {
+		bool matched = false;
+		for (i = 0; i < count && ackId == id; i++)
+		{
+		    if (members[i] == from && status[i] == RH_ASYNC_STATUS_PENDING)
+		    {
+			status[i] = RH_ASYNC_STATUS_DELIVERED;
+			statsDelivered(from, tries + 1, 0);
+			delivered++;
+			acked++;
+			matched = true;
+		    }
+		}
+		if (!matched)
+		    asyncAcknowledged(from, ackId);
+	    }
+	    YIELD;
+	}
+	holdQueue(false);
+	if (serviceQueue())
+	    waitPacketSent();
+    }
+
+    for (i = 0; i < count; i++)
+    {
+	if (status[i] == RH_ASYNC_STATUS_PENDING)
+	{
+	    status[i] = RH_ASYNC_STATUS_FAILED;
+	    statsDelivered(members[i], 0, 0);
+	}
+    }
+    return delivered;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setGroupAckSlot(uint16_t slot)
+{
+    _groupAckSlot = slot;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::waitAck(uint16_t timeout, uint8_t* ackFrom, uint8_t* ackId, uint8_t* sack)
+{
+    if (!waitAvailableAckTimeout(timeout))
+	return false;
+
+    uint8_t from, to, id, flags;
+    uint8_t ack[2];
+    uint8_t* rxBuf = ack;
+    uint8_t rxLen = sizeof(ack);
+    bool isAck = false;
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    // If there is room, receive straight into the queue in case its a data message
+    QueuedMessage* queued = NULL;
+    if (_rxQueueCount < RH_RELIABLE_RX_QUEUE_SIZE)
+    {
+	queued = &_rxQueue[(_rxQueueHead + _rxQueueCount) % RH_RELIABLE_RX_QUEUE_SIZE];
+	rxBuf = queued->data;
+	rxLen = sizeof(queued->data);
+    }
+#endif
+    if (!recvfrom(rxBuf, &rxLen, &from, &to, &id, &flags))
+	return false;
+
+    statsHeard(from);
+    // Now have a message: is it or does it carry an ACK?
+    if (   (flags & RH_FLAGS_ACK)
+	&& to == _thisAddress
+	&& (!(flags & RH_FLAGS_PIGGYBACK) || rxLen > 0))
+    {
+	isAck = true;
+	*ackFrom = from;
+	*ackId = id;
+	*sack = 0;
+	if (flags & RH_FLAGS_PIGGYBACK)
+	    *ackId = rxBuf[0]; // Piggybacked ACK ID is the first octet
+	else if (rxLen > 1)
+	    *sack = rxBuf[1]; // Selective acknowledgement bitmap
+    }
+    // A piggybacked ACK also carries a data message after the ACK ID
+    if ((flags & RH_FLAGS_PIGGYBACK) && rxLen > 0)
+    {
+	flags &= ~(RH_FLAGS_ACK | RH_FLAGS_PIGGYBACK);
+	memmove(rxBuf, rxBuf + 1, --rxLen);
+    }
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0 && RH_RELIABLE_RX_QUEUE_MSG_LEN < RH_MAX_MESSAGE_LEN
+    // Too long for the queue, and maybe truncated. Do not keep it
+    if (queued && rxLen > RH_RELIABLE_RX_QUEUE_MSG_LEN)
+	queued = NULL;
+#endif
+
+    if (flags & RH_FLAGS_ACK)
+    {
+	// Nothing more to do for a plain ACK
+    }
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    else if (  (flags & RH_FLAGS_GROUP)
+	     ? receivedGroupMessage(rxBuf, &rxLen, from, id, queued != NULL)
+	     : receivedMessage(from, to, id, flags, queued != NULL && (isDuplicate(from, id) || acceptMessage(rxBuf, rxLen, from, to, id))))
+    {
+	// A new data message: keep it for the next call to recvfromAck()
+	queued->from = from;
+	queued->to = to;
+	queued->id = id;
+	queued->flags = flags;
+	queued->len = rxLen;
+	_rxQueueCount++;
+    }
+    else if (!queued && !isDuplicate(from, id))
+    {
+	// No room for it. Its not acknowledged, so the sender will try again later
+	_rxQueueDropped++;
+    }
+#else
+    else if (isDuplicate(from, id))
+    {
+	// This is a request we have already received. ACK it again
+	if (flags & RH_FLAGS_GROUP)
+	    receivedGroupMessage(rxBuf, &rxLen, from, id, false);
+	else
+	    receivedMessage(from, to, id, flags, false);
+    }
+    else
+    {
+	// No room for it. Its not acknowledged, so the sender will try again later
+	_rxQueueDropped++;
+    }
+#endif
+    return isAck;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -115,36 +404,231 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
     uint8_t _to;
     uint8_t _id;
     uint8_t _flags;
+    // Send any delayed ACKs that are due
+    sendPendingAcks(false);
+
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    // Messages received while we were waiting for an ACK have already been acknowledged
+    if (_rxQueueCount)
+    {
+	QueuedMessage* queued = &_rxQueue[_rxQueueHead];
+	if (*len > queued->len)
+	    *len = queued->len;
+	memcpy(buf, queued->data, *len);
+	if (from)  *from =  queued->from;
+	if (to)    *to =    queued->to;
+	if (id)    *id =    queued->id;
+	if (flags) *flags = queued->flags;
+	_rxQueueHead = (_rxQueueHead + 1) % RH_RELIABLE_RX_QUEUE_SIZE;
+	_rxQueueCount--;
+	return true;
+    }
+#endif
+
     // Get the message before its clobbered by the ACK (shared rx and tx buffer in some drivers
-    if (available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
+    if (RHDatagram::available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
     {
-	// Never ACK an ACK
-	if (!(_flags & RH_FLAGS_ACK))
+	statsHeard(_from);
+	if ((_flags & RH_FLAGS_PIGGYBACK) && *len > 0)
 	{
-	    // Its a normal message for this node, not an ACK
-	    if (_to != RH_BROADCAST_ADDRESS)
+	    // A data message carrying an ACK ID in its first octet
+	    if (_to == _thisAddress)
+		asyncAcknowledged(_from, buf[0]);
+	    memmove(buf, buf + 1, --(*len));
+	    _flags &= ~(RH_FLAGS_ACK | RH_FLAGS_PIGGYBACK);
+	}
+	if ((_flags & RH_FLAGS_GROUP) && !(_flags & RH_FLAGS_ACK))
+	{
+	    // A message for a group of nodes, which may or may not include this one
+	    if (receivedGroupMessage(buf, len, _from, _id, true))
 	    {
-		// Its not a broadcast, so ACK it
-		// Acknowledge message with ACK set in flags and ID set to received ID
-		acknowledge(_id, _from);
+		if (from)  *from =  _from;
+		if (to)    *to =    _to;
+		if (id)    *id =    _id;
+		if (flags) *flags = _flags;
+		return true;
 	    }
+	}
+	// Never ACK an ACK
+	else if (!(_flags & RH_FLAGS_ACK))
+	{
+	    // Its a normal message for this node, not an ACK
 	    // If we have not seen this message before, then we are interested in it
-	    if (_id != _seenIds[_from])
+	    if (receivedMessage(_from, _to, _id, _flags, isDuplicate(_from, _id) || acceptMessage(buf, *len, _from, _to, _id)))
 	    {
 		if (from)  *from =  _from;
 		if (to)    *to =    _to;
 		if (id)    *id =    _id;
 		if (flags) *flags = _flags;
-		_seenIds[_from] = _id;
 		return true;
 	    }
 	    // Else just re-ack it and wait for a new one
 	}
+	else if (_to == _thisAddress)
+	{
+	    // An ACK, maybe for a message sent with sendtoAsync()
+	    asyncAcknowledged(_from, _id);
+	}
     }
     // No message for us available
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setAcceptor(RHReliableDatagram* acceptor)
+{
+    _acceptor = acceptor;
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override this to refuse messages they cannot keep
+bool RHReliableDatagram::acceptMessage(uint8_t* buf, uint8_t len, uint8_t from, uint8_t to, uint8_t id)
+{
+    return _acceptor ? _acceptor->acceptMessage(buf, len, from, to, id) : true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::receivedMessage(uint8_t from, uint8_t to, uint8_t id, uint8_t flags, bool accept)
+{
+    bool isNew = !isDuplicate(from, id);
+    if (isNew && !accept)
+	return false; // Pretend we never got it
+    LinkStats* stats = getLinkStats(from);
+    if (stats && !isNew)
+	stats->duplicates++;
+    if (isNew)
+    {
+	markSeen(from, id);
+	PeerState* peer = findPeer(from);
+	if (peer)
+	{
+	    // Only the last frame of a burst comes without RH_FLAGS_WINDOW, so the peer is back 
+	    // to stop-and-wait when two such frames come in a row
+	    bool window = flags & RH_FLAGS_WINDOW;
+	    if (window)
+		peer->windowed = true;
+	    else if (!peer->lastWindow)
+		peer->windowed = false;
+	    peer->lastWindow = window;
+	}
+    }
+    // Frames in a windowed burst are acknowledged by the last one in the burst
+    if (to != RH_BROADCAST_ADDRESS && !(flags & RH_FLAGS_WINDOW))
+    {
+	// Its not a broadcast, so ACK it
+	// Maybe hold the ACK for a while in case we send something back that it can ride on.
+	// Duplicates and ACKs that need a selective acknowledgement bitmap are sent at once
+	if (isNew && _ackDelay && !sackBitmap(from, id))
+	    delayAcknowledge(id, from, _ackDelay);
+	else
+	    // Acknowledge message with ACK set in flags and ID set to received ID
+	    acknowledge(id, from);
+    }
+    return isNew;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::receivedGroupMessage(uint8_t* buf, uint8_t* len, uint8_t from, uint8_t id, bool accept)
+{
+    if (*len < RH_RELIABLE_GROUP_HEADER_LEN || *len < RH_RELIABLE_GROUP_HEADER_LEN + buf[0])
+	return false; // Too short, or truncated
+    uint8_t listed = buf[0];
+    uint16_t slot = ((uint16_t)buf[1] << 8) | buf[2];
+    uint8_t position;
+    for (position = 0; position < listed; position++)
+	if (buf[RH_RELIABLE_GROUP_HEADER_LEN + position] == _thisAddress)
+	    break;
+    // Remove the group header, leaving just the message
+    *len -= RH_RELIABLE_GROUP_HEADER_LEN + listed;
+    memmove(buf, buf + RH_RELIABLE_GROUP_HEADER_LEN + listed, *len);
+    if (position == listed)
+	return false; // Not for us, or we have already acknowledged it
+
+    bool isNew = !isDuplicate(from, id);
+    if (isNew && !accept)
+	return false; // Pretend we never got it
+    LinkStats* stats = getLinkStats(from);
+    if (stats && !isNew)
+	stats->duplicates++;
+    if (isNew)
+	markSeen(from, id);
+    // ACK in our own slot, so the members of the group dont collide with each other
+    uint32_t wait = (uint32_t)slot * position;
+    if (wait)
+	delayAcknowledge(id, from, wait > 0xffff ? 0xffff : wait);
+    else
+	acknowledge(id, from);
+    return isNew;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::available()
+{
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    if (_rxQueueCount)
+	return true;
+#endif
+    return RHDatagram::available();
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::waitAvailableTimeout(uint16_t timeout)
+{
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    if (_rxQueueCount)
+	return true;
+#endif
+    return waitAvailableAckTimeout(timeout);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::waitAvailableAckTimeout(uint16_t timeout)
+{
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	// Dont wait past the time when the next delayed ACK is due
+	uint8_t i;
+	for (i = 0; i < RH_RELIABLE_PENDING_ACKS; i++)
+	{
+	    if (_pendingAcks[i].address == RH_BROADCAST_ADDRESS)
+		continue;
+	    int32_t ackTimeLeft = _pendingAcks[i].delay - (millis() - _pendingAcks[i].time);
+	    if (ackTimeLeft < timeLeft)
+		timeLeft = ackTimeLeft > 0 ? ackTimeLeft : 0;
+	}
+	// Send anything waiting in the transmit queue first, unless it is held for an ACK
+	if (serviceQueue())
+	{
+	    waitPacketSent();
+	    if (RHDatagram::available())
+		return true;
+	    continue;
+	}
+	if (timeLeft > 0 && RHDatagram::waitAvailableTimeout(timeLeft))
+	    return true;
+	sendPendingAcks(false);
+	YIELD;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setAckDelay(uint16_t delay)
+{
+    _ackDelay = delay;
+    if (!_ackDelay)
+	sendPendingAcks(true);
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHReliableDatagram::rxQueueDropped()
+{
+    return _rxQueueDropped;
+}
+
+////////////////////////////////////////////////////////////////////
 bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
@@ -161,6 +645,275 @@ bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::sendtoAsync(uint8_t* buf, uint8_t len, uint8_t address, uint8_t priority)
+{
+    uint8_t i;
+    uint8_t handle = RH_ASYNC_INVALID_HANDLE;
+    for (i = 0; i < RH_RELIABLE_ASYNC_SLOTS; i++)
+    {
+	if (_async[i].status == RH_ASYNC_STATUS_INVALID)
+	{
+	    if (handle == RH_ASYNC_INVALID_HANDLE)
+		handle = i;
+	}
+	else if (   _async[i].status == RH_ASYNC_STATUS_PENDING
+		 && _async[i].address == address)
+	    return RH_ASYNC_INVALID_HANDLE; // Only one message in flight to each destination
+    }
+    if (handle == RH_ASYNC_INVALID_HANDLE)
+	return RH_ASYNC_INVALID_HANDLE;
+
+    AsyncSend* async = &_async[handle];
+    async->buf = buf;
+    async->len = len;
+    async->address = address;
+    async->id = ++_lastSequenceNumber;
+    async->tries = 0;
+    async->status = RH_ASYNC_STATUS_PENDING;
+    async->priority = priority;
+    async->sendTime = millis();
+    asyncTransmit(async);
+    return handle;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::asyncTransmit(AsyncSend* async)
+{
+    async->tries++;
+    if (async->tries > 1)
+	_retransmissions++;
+    statsSent(async->address, async->tries > 1);
+    // service() starts the timer when the transmission is complete
+    async->sent = false;
+#if RH_DATAGRAM_QUEUE_CLASSES > 0
+    // Let the transmit queue decide when it goes. It may go at once, calling queuedSent()
+    async->queued = true;
+    if (sendtoQueued(async->buf, async->len, async->address, async->priority, async->id, RH_FLAGS_NONE))
+	return;
+#endif
+    async->queued = false;
+    setHeaderId(async->id);
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_ACK | RH_FLAGS_WINDOW | RH_FLAGS_PIGGYBACK);
+    if (!sendtoPiggyback(async->buf, async->len, async->address))
+	async->status = RH_ASYNC_STATUS_FAILED; // Too long for the driver
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::queuedSent(uint8_t to, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_ASYNC_SLOTS; i++)
+    {
+	AsyncSend* async = &_async[i];
+	if (   async->status == RH_ASYNC_STATUS_PENDING
+	    && async->queued
+	    && async->address == to
+	    && async->id == id)
+	{
+	    async->queued = false;
+	    async->sendTime = millis();
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::service()
+{
+    // Send any delayed ACKs that are due
+    sendPendingAcks(false);
+
+    // Collect any plain ACK waiting in the driver. Anything else is left for recvfromAck()
+    if (   RHDatagram::available() 
+	&& (headerFlags() & (RH_FLAGS_ACK | RH_FLAGS_PIGGYBACK)) == RH_FLAGS_ACK)
+    {
+	uint8_t from, to, id;
+	if (recvfrom(0, 0, &from, &to, &id) && to == _thisAddress)
+	{
+	    statsHeard(from);
+	    asyncAcknowledged(from, id);
+	}
+    }
+
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_ASYNC_SLOTS; i++)
+    {
+	AsyncSend* async = &_async[i];
+	if (async->status != RH_ASYNC_STATUS_PENDING || async->queued)
+	    continue; // Timers start when it leaves the transmit queue
+	if (_driver.mode() == RHGenericDriver::RHModeTx)
+	    break; // Radio is busy. Timers start when it is done
+	if (!async->sent)
+	{
+	    // Never wait for ACKS to broadcasts:
+	    if (async->address == RH_BROADCAST_ADDRESS)
+	    {
+		async->status = RH_ASYNC_STATUS_DELIVERED;
+		continue;
+	    }
+	    // Transmission is complete. Timeout does not include transmit time
+	    async->sent = true;
+	    async->timeout = ackTimeout(async->address, millis() - async->sendTime);
+	    async->sendTime = millis();
+	}
+	else if ((millis() - async->sendTime) > async->timeout)
+	{
+	    // Timed out, maybe retry
+	    if (_adaptiveTimeout)
+		backoffRtt(async->address);
+	    if (async->tries > _retries)
+	    {
+		async->status = RH_ASYNC_STATUS_FAILED;
+		statsDelivered(async->address, 0, 0);
+	    }
+	    else
+	    {
+		async->sendTime = millis();
+		asyncTransmit(async);
+	    }
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::asyncStatus(uint8_t handle)
+{
+    if (handle >= RH_RELIABLE_ASYNC_SLOTS)
+	return RH_ASYNC_STATUS_INVALID;
+    uint8_t status = _async[handle].status;
+    if (status != RH_ASYNC_STATUS_PENDING)
+	_async[handle].status = RH_ASYNC_STATUS_INVALID; // Release the handle
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::asyncAcknowledged(uint8_t from, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_ASYNC_SLOTS; i++)
+    {
+	if (   _async[i].status == RH_ASYNC_STATUS_PENDING
+	    && _async[i].address == from
+	    && _async[i].id == id)
+	{
+	    _async[i].status = RH_ASYNC_STATUS_DELIVERED;
+	    // Only measure the round trip time of messages that have not been retransmitted (Karn)
+	    uint16_t rtt = 0;
+	    if (_async[i].sent && _async[i].tries == 1)
+	    {
+		rtt = millis() - _async[i].sendTime;
+		if (_adaptiveTimeout)
+		    updateRtt(from, rtt);
+	    }
+	    statsDelivered(from, _async[i].tries, rtt);
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::randomTimeout()
+{
+    // Compute a new timeout, random between _timeout and _timeout*2
+    // This is to prevent collisions on every retransmit
+    // if 2 nodes try to transmit at the same time
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    return _timeout + (_timeout * (random() & 0xFF) / 256);
+#else
+    return _timeout + (_timeout * random(0, 256) / 256);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::ackTimeout(uint8_t address, uint16_t txTime)
+{
+    if (!_adaptiveTimeout || address == RH_BROADCAST_ADDRESS)
+	return randomTimeout();
+
+    PeerState* peer = allocatePeer(address);
+    if (!peer->srtt)
+    {
+	// No measurements yet. The ACK is no longer than the message, so assume a round trip time 
+	// of twice the transmission time, with a variation of half that
+	// Limited like the measurements in updateRtt(), or a very slow radio would wrap the scaled values
+	uint32_t rtt = (uint32_t)txTime * 2;
+	if (rtt < RH_RELIABLE_MIN_RTO)
+	    rtt = RH_RELIABLE_MIN_RTO;
+	if (rtt > RH_RELIABLE_MAX_RTT)
+	    rtt = RH_RELIABLE_MAX_RTT;
+	peer->srtt = rtt << 3;
+	peer->rttvar = rtt << 1;
+	peer->backoff = 0;
+    }
+    uint16_t rto;
+    getRttEstimate(address, NULL, NULL, &rto);
+    // Add up to 25% random jitter to prevent collisions on every retransmit
+    // if 2 nodes try to transmit at the same time
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    return rto + ((uint32_t)rto * (random() & 0x3F) / 256);
+#else
+    return rto + ((uint32_t)rto * random(0, 64) / 256);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::getRttEstimate(uint8_t address, uint16_t* srtt, uint16_t* rttvar, uint16_t* rto)
+{
+    PeerState* peer = findPeer(address);
+    if (!peer || !peer->srtt)
+	return false;
+    if (srtt)   *srtt =   peer->srtt >> 3;
+    if (rttvar) *rttvar = peer->rttvar >> 2;
+    if (rto)
+    {
+	// Jacobson/Karels: SRTT + 4 * RTTVAR, doubled for each timeout
+	uint32_t timeout = (peer->srtt >> 3) + peer->rttvar;
+	if (timeout < RH_RELIABLE_MIN_RTO)
+	    timeout = RH_RELIABLE_MIN_RTO;
+	timeout <<= peer->backoff;
+	if (timeout > RH_RELIABLE_MAX_RTO)
+	    timeout = RH_RELIABLE_MAX_RTO;
+	*rto = timeout;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::updateRtt(uint8_t address, uint16_t rtt)
+{
+    PeerState* peer = allocatePeer(address);
+    // Keep the scaled values within 16 bits
+    if (rtt > RH_RELIABLE_MAX_RTT)
+	rtt = RH_RELIABLE_MAX_RTT;
+    if (!peer->srtt)
+    {
+	// First measurement
+	peer->srtt = rtt << 3;
+	peer->rttvar = rtt << 1;
+    }
+    else
+    {
+	// SRTT += (rtt - SRTT) / 8, RTTVAR += (|rtt - SRTT| - RTTVAR) / 4
+	int16_t delta = rtt - (peer->srtt >> 3);
+	peer->srtt += delta;
+	if (peer->srtt == 0)
+	    peer->srtt = 1;
+	if (delta < 0)
+	    delta = -delta;
+	peer->rttvar += delta - (peer->rttvar >> 2);
+    }
+    peer->backoff = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::backoffRtt(uint8_t address)
+{
+    PeerState* peer = findPeer(address);
+    // Stop doubling once we have reached the maximum
+    if (peer && peer->backoff < 10)
+	peer->backoff++;
+}
+
+////////////////////////////////////////////////////////////////////
 uint32_t RHReliableDatagram::retransmissions()
 {
     return _retransmissions;
@@ -174,14 +927,392 @@ void RHReliableDatagram::resetRetransmissions()
 void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
 {
     setHeaderId(id);
-    setHeaderFlags(RH_FLAGS_ACK);
+    setHeaderFlags(RH_FLAGS_ACK, RH_FLAGS_WINDOW | RH_FLAGS_PIGGYBACK);
     // We would prefer to send a zero length ACK,
     // but if an RH_RF22 receives a 0 length message with a CRC error, it will never receive
     // a 0 length message again, until its reset, which makes everything hang :-(
     // So we send an ACK of 1 octet
     // REVISIT: should we send the RSSI for the information of the sender?
-    uint8_t ack = '!';
-    sendto(&ack, sizeof(ack), from); 
+    uint8_t ack[2];
+    uint8_t len = 1;
+    ack[0] = '!';
+    // Tell a windowed sender which of the preceding frames we have also received
+    ack[1] = sackBitmap(from, id);
+    if (ack[1])
+	len++;
+    sendto(ack, len, from); 
     waitPacketSent();
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::sackBitmap(uint8_t from, uint8_t id)
+{
+    uint8_t bitmap = 0;
+    PeerState* peer = findPeer(from);
+    if (peer && peer->windowed)
+    {
+	uint8_t i;
+	for (i = 0; i < 8; i++)
+	    if (isDuplicate(from, id - 1 - i))
+		bitmap |= (1 << i);
+    }
+    return bitmap;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::delayAcknowledge(uint8_t id, uint8_t from, uint16_t delay)
+{
+    // Use the entry for this peer, else an unused one, else the oldest
+    uint8_t i;
+    PendingAck* pending = NULL;
+    for (i = 0; i < RH_RELIABLE_PENDING_ACKS && !pending; i++)
+	if (_pendingAcks[i].address == from)
+	    pending = &_pendingAcks[i];
+    for (i = 0; i < RH_RELIABLE_PENDING_ACKS && !pending; i++)
+	if (_pendingAcks[i].address == RH_BROADCAST_ADDRESS)
+	    pending = &_pendingAcks[i];
+    if (!pending)
+    {
+	pending = &_pendingAcks[0];
+	for (i = 1; i < RH_RELIABLE_PENDING_ACKS; i++)
+	    if ((long)(_pendingAcks[i].time - pending->time) < 0)
+		pending = &_pendingAcks[i];
+    }
+    // Only one ACK can ride on each message, so send any earlier one for this entry now
+    if (pending->address != RH_BROADCAST_ADDRESS)
+	acknowledge(pending->id, pending->address);
+    pending->address = from;
+    pending->id = id;
+    pending->delay = delay;
+    pending->time = millis();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::sendPendingAcks(bool all)
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_PENDING_ACKS; i++)
+    {
+	if (   _pendingAcks[i].address != RH_BROADCAST_ADDRESS
+	    && (all || (millis() - _pendingAcks[i].time) >= _pendingAcks[i].delay))
+	{
+	    // Nothing came along for the ACK to ride on. Send it on its own
+	    uint8_t address = _pendingAcks[i].address;
+	    _pendingAcks[i].address = RH_BROADCAST_ADDRESS;
+	    acknowledge(_pendingAcks[i].id, address);
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::sendtoPiggyback(uint8_t* buf, uint8_t len, uint8_t address)
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_PENDING_ACKS; i++)
+    {
+	if (   _pendingAcks[i].address == address
+	    && address != RH_BROADCAST_ADDRESS
+	    && len <= RH_RELIABLE_PIGGYBACK_MSG_LEN
+	    && len < _driver.maxMessageLength())
+	{
+	    // Prefix a copy of the message with the ID being acknowledged. 
+	    // The copy is only as big as it needs to be on small processors
+	    uint8_t tmp[RH_RELIABLE_PIGGYBACK_MSG_LEN + 1];
+	    tmp[0] = _pendingAcks[i].id;
+	    memcpy(tmp + 1, buf, len);
+	    _pendingAcks[i].address = RH_BROADCAST_ADDRESS;
+	    setHeaderFlags(RH_FLAGS_ACK | RH_FLAGS_PIGGYBACK);
+	    bool ret = sendto(tmp, len + 1, address);
+	    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_ACK | RH_FLAGS_PIGGYBACK);
+	    return ret;
+	}
+    }
+    return sendto(buf, len, address);
+}
+
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::PeerState* RHReliableDatagram::findPeer(uint8_t address)
+{
+    // Usually the same peer as last time
+    PeerState* peer = _lastPeer;
+    if (!peer || peer->address != address)
+    {
+	uint8_t i;
+	peer = NULL;
+	for (i = 0; i < RH_RELIABLE_PEER_TABLE_SIZE && !peer; i++)
+	    if (_peers[i].address == address)
+		peer = &_peers[i];
+	if (!peer)
+	    return NULL;
+    }
+    // Forget peers we have not heard from or sent to for a long time
+    if ((millis() - peer->lastUsed) > RH_RELIABLE_PEER_IDLE_TIMEOUT)
+    {
+	peer->address = RH_BROADCAST_ADDRESS;
+	return NULL;
+    }
+    _lastPeer = peer;
+    return peer;
+}
+
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::PeerState* RHReliableDatagram::allocatePeer(uint8_t address)
+{
+    PeerState* peer = findPeer(address);
+    if (!peer)
+    {
+	// Reuse an unused entry, else the least recently used one
+	uint8_t i;
+	peer = &_peers[0];
+	for (i = 0; i < RH_RELIABLE_PEER_TABLE_SIZE; i++)
+	{
+	    if (_peers[i].address == RH_BROADCAST_ADDRESS)
+	    {
+		peer = &_peers[i];
+		break;
+	    }
+	    if ((long)(_peers[i].lastUsed - peer->lastUsed) < 0)
+		peer = &_peers[i];
+	}
+	peer->address = address;
+	peer->heard = false;
+	peer->windowed = false;
+	peer->lastWindow = false;
+	peer->srtt = 0;
+	peer->backoff = 0;
+#if RH_RELIABLE_LINK_STATS
+	memset(&peer->stats, 0, sizeof(peer->stats));
+#endif
+	_lastPeer = peer;
+    }
+    peer->lastUsed = millis();
+    return peer;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::isDuplicate(uint8_t from, uint8_t id)
+{
+    PeerState* peer = findPeer(from);
+    if (!peer || !peer->heard)
+	return false; // Nothing heard from this peer recently
+    if ((millis() - peer->lastSeen) > (uint32_t)(_retries + 1) * 2 * _timeout)
+    {
+	// Too long ago for any retransmission of what we have seen. The peer may have restarted its sequence
+	peer->heard = false;
+	return false;
+    }
+
+    int8_t diff = id - peer->highId;
+    if (diff == 0)
+	return true;
+    if (diff < 0 && diff >= -RH_RELIABLE_DUP_WINDOW)
+	return peer->seenMask & ((SeenMask)1 << (-diff - 1));
+    // Newer than anything we have seen, or so old it must be a new sequence
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::markSeen(uint8_t from, uint8_t id)
+{
+    PeerState* peer = allocatePeer(from);
+    peer->lastSeen = millis();
+    if (!peer->heard)
+    {
+	// First message from this peer
+	peer->heard = true;
+	peer->highId = id;
+	peer->seenMask = 0;
+	return;
+    }
+    int8_t diff = id - peer->highId;
+    if (diff > 0)
+    {
+	// Slide the record of seen IDs up to the new highest ID
+	peer->seenMask = (diff > RH_RELIABLE_DUP_WINDOW) ? 0 : (((peer->seenMask << 1) | 1) << (diff - 1));
+	peer->highId = id;
+    }
+    else if (diff < 0 && diff >= -RH_RELIABLE_DUP_WINDOW)
+    {
+	// An earlier frame arriving out of order
+	peer->seenMask |= ((SeenMask)1 << (-diff - 1));
+    }
+    else if (diff < 0)
+    {
+	// Too old to be in the window: the sender has probably restarted its sequence
+	peer->highId = id;
+	peer->seenMask = 0;
+    }
+}
+
+#if RH_RELIABLE_LINK_STATS
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::LinkStats* RHReliableDatagram::getLinkStats(uint8_t address)
+{
+    PeerState* peer = findPeer(address);
+    if (peer)
+	return &peer->stats;
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::LinkStats* RHReliableDatagram::getLinkStatsAt(uint8_t index, uint8_t* address)
+{
+    if (index < RH_RELIABLE_PEER_TABLE_SIZE && _peers[index].address != RH_BROADCAST_ADDRESS)
+    {
+	if (address)
+	    *address = _peers[index].address;
+	return &_peers[index].stats;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::clearLinkStats()
+{
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_PEER_TABLE_SIZE; i++)
+	memset(&_peers[i].stats, 0, sizeof(_peers[i].stats));
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::printLinkStats()
+{
+#ifdef RH_HAVE_SERIAL
+    uint8_t i, j;
+    for (i = 0; i < RH_RELIABLE_PEER_TABLE_SIZE; i++)
+    {
+	LinkStats* stats = &_peers[i].stats;
+	if (_peers[i].address == RH_BROADCAST_ADDRESS)
+	    continue;
+	Serial.print("Peer: ");
+	Serial.print(_peers[i].address, DEC);
+	Serial.print(" Sent: ");
+	Serial.print((unsigned int)stats->sent, DEC);
+	Serial.print(" Retries: ");
+	Serial.print((unsigned int)stats->retries, DEC);
+	Serial.print(" Received: ");
+	Serial.print((unsigned int)stats->received, DEC);
+	Serial.print(" Dups: ");
+	Serial.print((unsigned int)stats->duplicates, DEC);
+	Serial.print(" RTT: ");
+	Serial.print((unsigned int)(stats->rtt >> 3), DEC);
+	Serial.print(" RSSI: ");
+	if (stats->rssi < 0)
+	    Serial.print("-");
+	Serial.print((unsigned int)(abs(stats->rssi) / 8), DEC);
+	Serial.print(" Last heard: ");
+	Serial.print((unsigned int)((millis() - stats->lastHeard) / 1000), DEC);
+	Serial.print("s");
+	Serial.print(" RTT histogram:");
+	for (j = 0; j < RH_RELIABLE_RTT_BUCKETS; j++)
+	{
+	    Serial.print(" ");
+	    Serial.print(stats->rttHistogram[j], DEC);
+	}
+	Serial.print(" Tries histogram:");
+	for (j = 0; j < RH_RELIABLE_TRIES_BUCKETS; j++)
+	{
+	    Serial.print(" ");
+	    Serial.print(stats->triesHistogram[j], DEC);
+	}
+	Serial.println("");
+    }
+#endif
+}
+
+// Adds one to a histogram bucket, halving all the buckets when it is full
+static void histogramAdd(uint8_t* histogram, uint8_t buckets, uint8_t bucket)
+{
+    if (histogram[bucket] == 0xff)
+    {
+	uint8_t i;
+	for (i = 0; i < buckets; i++)
+	    histogram[i] >>= 1;
+    }
+    histogram[bucket]++;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::statsSent(uint8_t address, bool retry, bool allocate)
+{
+    if (address == RH_BROADCAST_ADDRESS)
+	return;
+    PeerState* peer = allocate ? allocatePeer(address) : findPeer(address);
+    if (!peer)
+	return;
+    LinkStats* stats = &peer->stats;
+    stats->sent++;
+    if (retry)
+	stats->retries++;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::statsDelivered(uint8_t address, uint8_t tries, uint16_t rtt)
+{
+    LinkStats* stats = getLinkStats(address);
+    if (!stats)
+	return;
+    // Never acknowledged goes in the last bucket
+    if (tries == 0 || tries > RH_RELIABLE_TRIES_BUCKETS)
+	tries = RH_RELIABLE_TRIES_BUCKETS;
+    histogramAdd(stats->triesHistogram, RH_RELIABLE_TRIES_BUCKETS, tries - 1);
+    if (rtt)
+    {
+	// Moving average with a gain of 1/8, scaled by 8
+	if (rtt > 8000)
+	    rtt = 8000;
+	if (stats->rtt)
+	    stats->rtt += rtt - (stats->rtt >> 3);
+	else
+	    stats->rtt = rtt << 3;
+	// Bucket 0 is under 16ms, and each bucket after it is twice as wide
+	uint8_t bucket = 0;
+	rtt >>= 4;
+	while (rtt && bucket < RH_RELIABLE_RTT_BUCKETS - 1)
+	{
+	    rtt >>= 1;
+	    bucket++;
+	}
+	histogramAdd(stats->rttHistogram, RH_RELIABLE_RTT_BUCKETS, bucket);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::statsHeard(uint8_t from)
+{
+    if (from == RH_BROADCAST_ADDRESS)
+	return;
+    // Only peers already in the table, so overheard traffic does not evict the nodes we talk to
+    PeerState* peer = findPeer(from);
+    if (!peer)
+	return;
+    LinkStats* stats = &peer->stats;
+    int16_t rssi = _driver.lastRssi() * 8;
+    // Moving average with a gain of 1/8, scaled by 8
+    if (stats->received)
+	stats->rssi += (rssi - stats->rssi) / 8;
+    else
+	stats->rssi = rssi;
+    stats->received++;
+    stats->lastHeard = millis();
+}
+
+#else
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::LinkStats* RHReliableDatagram::getLinkStats(uint8_t)
+{
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::LinkStats* RHReliableDatagram::getLinkStatsAt(uint8_t, uint8_t*)
+{
+    return NULL;
+}
+
+void RHReliableDatagram::clearLinkStats() {}
+void RHReliableDatagram::printLinkStats() {}
+void RHReliableDatagram::statsSent(uint8_t, bool, bool) {}
+void RHReliableDatagram::statsDelivered(uint8_t, uint8_t, uint16_t) {}
+void RHReliableDatagram::statsHeard(uint8_t) {}
+#endif
@@ -14,12 +14,131 @@
 // for application layer use.
 #define RH_FLAGS_ACK 0x80
 
+// Set on all but the last frame of a windowed burst sent by sendtoWaitWindowed().
+// Frames with this bit set are not acknowledged individually: the last frame of the burst 
+// is acknowledged on behalf of the whole burst.
+#define RH_FLAGS_WINDOW 0x40
+
+// Set (together with RH_FLAGS_ACK) on a data message that also carries a delayed acknowledgement. 
+// The first octet of the payload is the ID of the message being acknowledged, and the 
+// data message follows it. See setAckDelay().
+#define RH_FLAGS_PIGGYBACK 0x20
+
+// Set on a broadcast message sent by sendtoGroupWait() to a list of group members. 
+// The payload starts with the group header (see sendtoGroupWait()), and the message follows it.
+#define RH_FLAGS_GROUP 0x10
+
+// Length of the group header before the list of members: the number of members and the ACK slot time
+#define RH_RELIABLE_GROUP_HEADER_LEN 3
+
 /// the default retry timeout in milliseconds
 #define RH_DEFAULT_TIMEOUT 200
 
 /// The default number of retries
 #define RH_DEFAULT_RETRIES 3
 
+/// The maximum number of unacknowledged frames that can be outstanding in a windowed transmission.
+/// Limited to 8 by the width of the selective acknowledgement bitmap.
+#define RH_RELIABLE_MAX_WINDOW 8
+
+/// Lower and upper limits in milliseconds for the adaptive retransmit timeout (see setAdaptiveTimeout())
+#define RH_RELIABLE_MIN_RTO 10
+#define RH_RELIABLE_MAX_RTO 10000
+
+/// The longest round trip time in milliseconds used in the estimates, which keeps their scaled values within 16 bits
+#define RH_RELIABLE_MAX_RTT 8000
+
+// The maximum number of messages that can be in flight at once with sendtoAsync()
+#ifndef RH_RELIABLE_ASYNC_SLOTS
+#define RH_RELIABLE_ASYNC_SLOTS 2
+#endif
+
+/// Returned by sendtoAsync() if the message could not be accepted
+#define RH_ASYNC_INVALID_HANDLE 0xff
+
+// Status of messages sent with sendtoAsync(), as returned by asyncStatus()
+#define RH_ASYNC_STATUS_INVALID   0
+#define RH_ASYNC_STATUS_PENDING   1
+#define RH_ASYNC_STATUS_DELIVERED 2
+#define RH_ASYNC_STATUS_FAILED    3
+
+// The number of messages that can be kept if they are received while sendtoWait() is waiting for an ACK.
+// Set to 0 to save memory, in which case such messages are not acknowledged, and the sender will have to retry.
+#ifndef RH_RELIABLE_RX_QUEUE_SIZE
+#define RH_RELIABLE_RX_QUEUE_SIZE 1
+#endif
+
+// The maximum length of messages that can be kept in the receive queue. Longer messages that arrive 
+// while sendtoWait() is waiting are not acknowledged, and the sender will have to retry
+#ifndef RH_RELIABLE_RX_QUEUE_MSG_LEN
+ #if defined(__AVR__)
+  #define RH_RELIABLE_RX_QUEUE_MSG_LEN 32
+ #else
+  #define RH_RELIABLE_RX_QUEUE_MSG_LEN RH_MAX_MESSAGE_LEN
+ #endif
+#endif
+// Each entry also has room for a piggybacked ACK ID, and one more octet to tell a message that is too long
+#if RH_RELIABLE_RX_QUEUE_MSG_LEN < RH_MAX_MESSAGE_LEN - 1
+ #define RH_RELIABLE_RX_QUEUE_BUF_LEN (RH_RELIABLE_RX_QUEUE_MSG_LEN + 2)
+#else
+ #define RH_RELIABLE_RX_QUEUE_BUF_LEN RH_MAX_MESSAGE_LEN
+#endif
+
+// The maximum number of delayed ACKs that can be waiting for a message to ride on (see setAckDelay())
+#ifndef RH_RELIABLE_PENDING_ACKS
+#define RH_RELIABLE_PENDING_ACKS 2
+#endif
+
+// The longest message an acknowledgement can ride on. It is copied to a buffer of this size on the stack
+// behind the ID being acknowledged. Acknowledgements are not piggybacked on longer messages
+#ifndef RH_RELIABLE_PIGGYBACK_MSG_LEN
+ #if defined(__AVR__)
+  #define RH_RELIABLE_PIGGYBACK_MSG_LEN 32
+ #else
+  #define RH_RELIABLE_PIGGYBACK_MSG_LEN (RH_MAX_MESSAGE_LEN - 1)
+ #endif
+#endif
+
+// The default time in milliseconds allowed for each member of a group to send its ACK (see setGroupAckSlot())
+#ifndef RH_RELIABLE_GROUP_ACK_SLOT
+#define RH_RELIABLE_GROUP_ACK_SLOT 50
+#endif
+
+// The number of peers for which we keep per-peer state (such as the 
+// record of which recent sequence numbers have been seen, for duplicate detection). 
+// Each entry costs 19 octets of RAM on 8 bit processors with the default RH_RELIABLE_DUP_WINDOW, 
+// and another 28 octets if RH_RELIABLE_LINK_STATS is 1.
+#ifndef RH_RELIABLE_PEER_TABLE_SIZE
+#define RH_RELIABLE_PEER_TABLE_SIZE 8
+#endif
+
+// The number of sequence numbers before the highest seen from a peer that are remembered
+// for duplicate detection. May be 8, 16 or 32. 
+#ifndef RH_RELIABLE_DUP_WINDOW
+#define RH_RELIABLE_DUP_WINDOW 8
+#endif
+
+// Per-peer state that has not been used for this many milliseconds is discarded
+#ifndef RH_RELIABLE_PEER_IDLE_TIMEOUT
+#define RH_RELIABLE_PEER_IDLE_TIMEOUT 30000
+#endif
+
+// Set to 0 to save memory by not keeping per-peer link statistics (see getLinkStats()). 
+// Off by default on AVR, where they would more than double the size of the peer table
+#ifndef RH_RELIABLE_LINK_STATS
+ #if defined(__AVR__)
+  #define RH_RELIABLE_LINK_STATS 0
+ #else
+  #define RH_RELIABLE_LINK_STATS 1
+ #endif
+#endif
+
+/// Number of buckets in the histogram of acknowledgement round trip times in RHReliableDatagram::LinkStats
+#define RH_RELIABLE_RTT_BUCKETS 8
+
+/// Number of buckets in the histogram of transmissions per message in RHReliableDatagram::LinkStats
+#define RH_RELIABLE_TRIES_BUCKETS 4
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHReliableDatagram RHReliableDatagram.h <RHReliableDatagram.h>
 /// \brief RHDatagram subclass for sending addressed, acknowledged, retransmitted datagrams.
@@ -41,12 +160,120 @@
 ///
 /// Each new message sent by sendtoWait() has its ID incremented.
 ///
+/// \par Adaptive Retransmit Timeout
+///
+/// A single fixed timeout is a poor fit for networks with a mixture of fast and slow links: too short
+/// for a slow LoRa link (causing needless retransmissions), and far too long for a fast FSK link 
+/// (wasting time after every lost message). If you call setAdaptiveTimeout(true), RHReliableDatagram
+/// measures the round trip time from the end of each transmission to the arrival of its acknowledgement, 
+/// and keeps a smoothed estimate of the round trip time (SRTT) and its variation (RTTVAR) for 
+/// each destination in the peer table. The retransmit timeout for each destination is then computed 
+/// with the Jacobson/Karels algorithm as SRTT + 4 * RTTVAR, limited to the range RH_RELIABLE_MIN_RTO 
+/// to RH_RELIABLE_MAX_RTO, and doubled after each timeout until a new measurement is made. 
+/// Round trip times are not measured for retransmitted messages (Karn's algorithm). 
+/// Before the first measurement for a destination, the estimates are seeded from the measured 
+/// transmission time of the first message, which reflects the length of the message and the 
+/// bit rate of the radio. You can read the current estimates with getRttEstimate().
+///
 /// An ack consists of a message with:
 /// - TO set to the from address of the original message
 /// - FROM set to this node address
 /// - ID set to the ID of the original message
 /// - FLAGS with the RH_FLAGS_ACK bit set
 /// - 1 octet of payload containing ASCII '!' (since some drivers cannot handle 0 length payloads)
+/// - optionally, 1 more octet containing the selective acknowledgement bitmap (see below)
+///
+/// \par Delayed Acknowledgements
+///
+/// Each acknowledgement is a complete radio frame, with its own preamble and headers, which on slow 
+/// radios such as LoRa can take as much airtime as the message it acknowledges. In request/response 
+/// traffic, the recipient of a message will often send a message back to the sender shortly afterwards. 
+/// If you call setAckDelay() with a non-zero delay, recvfromAck() holds the acknowledgement for up to that 
+/// long, and if a message is sent to the same node in the meantime, the acknowledgement rides on it: 
+/// its FLAGS have RH_FLAGS_ACK and RH_FLAGS_PIGGYBACK set, and the ID being acknowledged is sent as an 
+/// extra octet before the message payload. If no such message is sent before the delay expires, 
+/// or the message is longer than RH_RELIABLE_PIGGYBACK_MSG_LEN octets (32 on AVR), 
+/// the acknowledgement is sent on its own as usual. Delayed acknowledgements are sent by 
+/// recvfromAck(), recvfromAckTimeout(), service() and while sendtoWait() is waiting, so one of these
+/// must be called often enough. 
+/// The delay must be much shorter than the retransmit timeout of the senders, and all the nodes 
+/// in the network must be using a version of RadioHead that understands RH_FLAGS_PIGGYBACK. 
+/// Receiving a piggybacked acknowledgement while sendtoWait() is waiting needs room in the receive queue.
+///
+/// \par Windowed Transmission
+///
+/// sendtoWait() is strictly stop-and-wait: only one message is outstanding at a time, and 
+/// throughput is limited by the round trip time of the message and its acknowledgement, rather 
+/// than by the bit rate of the radio. sendtoWaitWindowed() sends a number of messages to the same 
+/// destination as a burst of up to windowSize() frames (see setWindowSize()) without waiting for 
+/// acknowledgements in between. All frames in the burst except the last have the RH_FLAGS_WINDOW 
+/// bit set in FLAGS, and are not acknowledged individually by the recipient. The last frame 
+/// is acknowledged as usual, except that the acknowledgement carries an extra octet: a bitmap 
+/// where bit i is set if the message with ID equal to (ID of the acknowledged message - 1 - i) 
+/// has also been received. The sender then retransmits only the frames that are missing from 
+/// the bitmap, and moves the window on past the frames that have been acknowledged.
+/// The bitmap is only sent to a peer that is sending windowed bursts (from its first RH_FLAGS_WINDOW frame 
+/// until two frames in a row come without it), and only when it is not zero, so the acknowledgements of 
+/// ordinary stop-and-wait traffic are unchanged, and can still be delayed (see above).
+/// sendtoWait() behaves exactly as sendtoWaitWindowed() with a single message.
+///
+/// Since a receiving node may see frames out of order during windowed transmissions, 
+/// it keeps a record of the recently received IDs from each peer, so it can reliably detect duplicates
+/// (see Duplicate Detection below).
+/// Windowed transmissions work best when the receiver calls recvfromAck() often enough to 
+/// collect each message before the next one arrives: any frames it misses will be retransmitted.
+///
+/// \par Group Transmission
+///
+/// Broadcasts are not acknowledged, so the only way to deliver the same message reliably to a number of 
+/// nodes used to be to send it to each of them in turn with sendtoWait(), which takes a lot of airtime 
+/// for a large group. sendtoGroupWait() broadcasts the message once with RH_FLAGS_GROUP set in FLAGS 
+/// and a list of the group members before the payload. Each member acknowledges it with an ordinary ACK,
+/// but holds it first for a slot time (see setGroupAckSlot()) times its position in the list, 
+/// so the ACKs do not collide. The ACK is held like a delayed acknowledgement, so the member does not 
+/// block, but it must keep calling recvfromAck() or service() for the ACK to go out in its slot. If some members do not acknowledge, the message is broadcast again 
+/// listing only those members, up to retries() times. Nodes that are not listed ignore the message, 
+/// and members recognise retransmissions with the usual duplicate detection, so each one receives 
+/// the message only once. sendtoGroupWait() reports which members acknowledged the message.
+/// Group members do not get entries in the peer table just for being listed, so link statistics 
+/// are only kept for the members this node also exchanges other messages with.
+/// All the members must be using a version of RadioHead that understands RH_FLAGS_GROUP, and 
+/// must receive the message into a buffer big enough for the group header as well as the message.
+/// Group transmissions are sent directly between neighbours: they are not routed by RHRouter or RHMesh.
+///
+/// \par Duplicate Detection
+///
+/// When an acknowledgement is lost, the sender retransmits a message that has already been received.
+/// The retransmission is acknowledged again, but is not returned by recvfromAck() a second time.
+/// To recognise these, RHReliableDatagram keeps a small table of up to RH_RELIABLE_PEER_TABLE_SIZE 
+/// recently heard peers. Each entry holds the highest message ID received from the peer, and a 
+/// bitmap of which of the RH_RELIABLE_DUP_WINDOW IDs before it have also been received, so 
+/// duplicates are detected correctly even if messages arrive out of order, or by more than one path. 
+/// Entries that have not been used for RH_RELIABLE_PEER_IDLE_TIMEOUT milliseconds are discarded, and 
+/// if the table is full, the least recently used entry is reused. So if more than RH_RELIABLE_PEER_TABLE_SIZE
+/// nodes are sending to this node at the same time, a retransmitted message may occasionally be received 
+/// twice. Earlier versions of RadioHead kept only the last ID received from every possible node address,
+/// which cost 256 octets of RAM.
+/// A retransmission arrives within the retries of its sender, so the IDs seen from a peer are only 
+/// remembered for (retries() + 1) * 2 * the timeout (see setRetries() and setTimeout()) after the last new one. 
+/// After that, an ID that was seen before is taken as a new message, so that a sender that restarts its 
+/// sequence (or wraps it) does not have its first messages discarded. This assumes that the sender 
+/// uses no more retries and no longer timeouts than the receiver.
+///
+/// \par Link Statistics
+///
+/// To help find out which neighbours are causing retransmissions, RHReliableDatagram keeps 
+/// a LinkStats structure in the entry for each peer in the table described above. 
+/// It counts the frames sent to the peer, how many of those were retransmissions, the frames 
+/// heard from it and the duplicates among them, and keeps moving averages of the 
+/// acknowledgement round trip time and the RSSI, a histogram of the round trip times, and a histogram 
+/// of how many transmissions each message needed. They are updated as messages and acknowledgements 
+/// are sent and received. Frames overheard from nodes that have no entry do not make one. You can read the statistics for a peer with getLinkStats(), 
+/// or step through all the peers with getLinkStatsAt(), or print them all with printLinkStats().
+/// Subclasses such as RHRouter can use them to choose between routes.
+/// The statistics are lost when the peer's entry is reused, so if you need them for more 
+/// than RH_RELIABLE_PEER_TABLE_SIZE peers, make the table bigger. You can save memory by 
+/// defining RH_RELIABLE_LINK_STATS to 0, which is the default on AVR.
 ///
 /// \par Media Access Strategy
 ///
@@ -59,16 +286,32 @@
 /// This will be recognised as "pure ALOHA". 
 /// The addition of Clear Channel Assessment (CCA) is desirable and planned.
 ///
-/// There is no message queuing or threading in RHReliableDatagram. 
+/// There is no threading in RHReliableDatagram. 
 /// sendtoWait() waits until an acknowledgement is received, retransmitting
 /// up to (by default) 3 retries time with a default 200ms timeout. 
-/// During this transmit-acknowledge phase, any received message (other than the expected
-/// acknowledgement) will be ignored. Your sketch will be unresponsive to new messages 
+/// During this transmit-acknowledge phase, new messages received from other nodes (or the destination) 
+/// are acknowledged and kept in a small receive queue of RH_RELIABLE_RX_QUEUE_SIZE messages, 
+/// and are returned by the following calls to recvfromAck(). If the queue is full, or a message is longer 
+/// than RH_RELIABLE_RX_QUEUE_MSG_LEN octets (32 on AVR), any such messages
+/// are not acknowledged (so the sender will retransmit them later), and are counted by rxQueueDropped().
+/// Your sketch will not be able to process new messages 
 /// until an acknowledgement is received or the retries are exhausted. 
 /// Central server-type sketches should be very cautious about their
 /// retransmit strategy and configuration lest they hang for a long time
 /// trying to reply to clients that are unreachable.
 ///
+/// \par Asynchronous Transmission
+///
+/// If your sketch cannot afford to block in sendtoWait() (for example because it has to 
+/// service other radios, sensors or a host link), you can use sendtoAsync() instead. 
+/// It transmits the message and returns a handle immediately. You must then call service() 
+/// frequently (typically in your main loop, along with recvfromAck()) to process 
+/// acknowledgements and to retransmit on timeout, and poll asyncStatus() with the handle 
+/// to find out when the message has been delivered or has failed. 
+/// Up to RH_RELIABLE_ASYNC_SLOTS messages can be in flight at once, but only one to each destination.
+/// Asynchronous transmission uses exactly the same message formats, acknowledgements and 
+/// timeouts as sendtoWait(), so it interoperates with nodes using the blocking functions.
+///
 /// Caution: if you have a radio network with a mixture of slow and fast
 /// processors and ReliableDatagrams, you may be affected by race conditions
 /// where the fast processor acknowledges a message before the sender is ready
@@ -78,6 +321,27 @@
 class RHReliableDatagram : public RHDatagram
 {
 public:
+    /// Statistics about the link to a peer. See the section on Link Statistics above.
+    typedef struct
+    {
+	uint16_t      sent;        ///< Frames sent to the peer, including retransmissions
+	uint16_t      retries;     ///< Frames retransmitted to the peer
+	uint16_t      received;    ///< Frames (including acknowledgements) heard from the peer
+	uint16_t      duplicates;  ///< Duplicate messages received from the peer
+	uint16_t      rtt;         ///< Moving average of the acknowledgement round trip time in milliseconds * 8. 0 if not measured yet
+	int16_t       rssi;        ///< Moving average of the RSSI of frames heard from the peer * 8. Units depend on the driver
+	unsigned long lastHeard;   ///< millis() when a frame was last heard from the peer
+	/// Count of acknowledgement round trip times. Bucket 0 counts times under 16 milliseconds, 
+	/// and each later bucket counts times up to twice as long as the one before. 
+	/// The last bucket counts times of 1024 milliseconds or more.
+	/// When a bucket is full, all the buckets are halved.
+	uint8_t       rttHistogram[RH_RELIABLE_RTT_BUCKETS];
+	/// Count of messages by the number of times they were sent before they were acknowledged. 
+	/// Bucket i counts messages sent (i + 1) times. The last bucket also counts messages that were never
+	/// acknowledged. When a bucket is full, all the buckets are halved.
+	uint8_t       triesHistogram[RH_RELIABLE_TRIES_BUCKETS];
+    } LinkStats;
+
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
@@ -93,6 +357,21 @@ public:
     /// \param[in] timeout The new timeout period in milliseconds
     void setTimeout(uint16_t timeout);
 
+    /// Enables or disables the adaptive per-destination retransmit timeout. Disabled by default, 
+    /// in which case the timeout set by setTimeout() is used for all destinations.
+    /// See the section on Adaptive Retransmit Timeout above.
+    /// \param[in] adaptive true to enable adaptive retransmit timeouts.
+    void setAdaptiveTimeout(bool adaptive);
+
+    /// Returns the current round trip time estimates for a destination.
+    /// \param[in] address The destination node address
+    /// \param[out] srtt If not NULL, set to the smoothed round trip time in milliseconds
+    /// \param[out] rttvar If not NULL, set to the round trip time variation in milliseconds
+    /// \param[out] rto If not NULL, set to the retransmit timeout that will be used for the next 
+    /// transmission in milliseconds (including any backoff, but not random jitter)
+    /// \return true if there is an estimate for the destination
+    bool getRttEstimate(uint8_t address, uint16_t* srtt = NULL, uint16_t* rttvar = NULL, uint16_t* rto = NULL);
+
     /// Sets the maximum number of retries. Defaults to 3 at construction time. 
     /// If set to 0, each message will only ever be sent once.
     /// sendtoWait will give up and return false if there is no ack received after all transmissions time out
@@ -105,8 +384,20 @@ public:
     /// \return The currently configured maximum number of retries.
     uint8_t retries();
 
+    /// Sets the maximum number of frames that sendtoWaitWindowed() will have outstanding 
+    /// (ie sent but not yet acknowledged) at any one time. Defaults to 1 at construction time, 
+    /// which gives stop-and-wait behaviour.
+    /// \param[in] window The new window size. Values outside the range 1 to RH_RELIABLE_MAX_WINDOW are clamped.
+    void setWindowSize(uint8_t window);
+
+    /// Returns the currently configured window size.
+    /// Can be changed with setWindowSize().
+    /// \return The currently configured window size.
+    uint8_t windowSize();
+
     /// Send the message (with retries) and waits for an ack. Returns true if an acknowledgement is received.
-    /// Synchronous: any message other than the desired ACK received while waiting is discarded.
+    /// Synchronous: new messages received while waiting are acknowledged and kept for recvfromAck() if 
+    /// there is room in the receive queue, else discarded.
     /// Blocks until an ACK is received or all retries are exhausted (ie up to retries*timeout milliseconds).
     /// If the destination address is the broadcast address RH_BROADCAST_ADDRESS (255), the message will 
     /// be sent as a broadcast, but receiving nodes do not acknowledge, and sendtoWait() returns true immediately
@@ -117,6 +408,71 @@ public:
     /// \return true if the message was transmitted and an acknowledgement was received.
     bool sendtoWait(uint8_t* buf, uint8_t len, uint8_t address);
 
+    /// Sends a sequence of messages to the same address, with up to windowSize() messages outstanding at a
+    /// time, and waits for them to be acknowledged. Only messages that are not acknowledged are 
+    /// retransmitted, each one up to retries() times. The messages are sent in order, but if some frames are 
+    /// lost they may be received out of order.
+    /// Blocks until all the messages have been acknowledged, or the retries for one of them are exhausted.
+    /// If the destination address is the broadcast address RH_BROADCAST_ADDRESS (255), each message is 
+    /// broadcast once, and no acknowledgements are waited for.
+    /// \param[in] bufs Array of count pointers to the binary messages to send
+    /// \param[in] lens Array of count lengths of the messages in bufs
+    /// \param[in] count Number of messages to send
+    /// \param[in] address The address to send the messages to.
+    /// \return The number of messages, starting from the first, that were acknowledged. If this is less than 
+    /// count, some of the following messages may have been received, but were not acknowledged. 
+    uint8_t sendtoWaitWindowed(uint8_t** bufs, uint8_t* lens, uint8_t count, uint8_t address);
+
+    /// Sends a message to a group of nodes with a single broadcast, and waits for each of them to 
+    /// acknowledge it, retransmitting to those that do not, up to retries() times.
+    /// See the section on Group Transmission above.
+    /// The message is sent with a group header before it: 1 octet with the number of members listed, 2 octets
+    /// with the ACK slot time in milliseconds (most significant octet first), and the address of each member listed.
+    /// Synchronous: new messages received while waiting are handled as for sendtoWait().
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send. Must be no more than maxMessageLength() less 
+    /// RH_RELIABLE_GROUP_HEADER_LEN and the number of members.
+    /// \param[in] members Array of count addresses of the members of the group
+    /// \param[in] count Number of members in the group
+    /// \param[out] status Array of count octets. Each one is set to RH_ASYNC_STATUS_DELIVERED if the 
+    /// corresponding member acknowledged the message, else RH_ASYNC_STATUS_FAILED
+    /// \return The number of members that acknowledged the message
+    uint8_t sendtoGroupWait(uint8_t* buf, uint8_t len, uint8_t* members, uint8_t count, uint8_t* status);
+
+    /// Sets the time allowed for each member of a group to acknowledge a message sent by sendtoGroupWait().
+    /// The member listed in position i waits for i times this long before acknowledging. 
+    /// The time is sent in the message, so the members do not need to be configured. It must be longer 
+    /// than the time the radio takes to transmit an ACK, plus the time each member may take to 
+    /// notice the message. Defaults to RH_RELIABLE_GROUP_ACK_SLOT.
+    /// \param[in] slot The slot time in milliseconds
+    void setGroupAckSlot(uint16_t slot);
+
+    /// Starts sending a message without waiting for it to be acknowledged. The message is transmitted 
+    /// immediately, and service() will retransmit it as necessary, in the same way as sendtoWait().
+    /// The contents of buf are not copied, and must remain valid and unchanged until asyncStatus() 
+    /// reports that the message has been delivered or has failed.
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address to send the message to.
+    /// \param[in] priority If the transmit queue is enabled (see RHDatagram::sendtoQueued()), the priority 
+    /// class that the message and its retransmissions are queued in. Messages too long for the queue,
+    /// or that find their class full, are sent at once.
+    /// \return A handle to pass to asyncStatus(), or RH_ASYNC_INVALID_HANDLE if there are already 
+    /// RH_RELIABLE_ASYNC_SLOTS messages in flight, or there is already a message in flight to address.
+    uint8_t sendtoAsync(uint8_t* buf, uint8_t len, uint8_t address, uint8_t priority = 0);
+
+    /// Processes any received acknowledgements for messages sent with sendtoAsync(), and retransmits 
+    /// them when their timeouts expire. Received messages that are not acknowledgements are left 
+    /// to be collected by recvfromAck(). Never blocks waiting for the radio.
+    /// You should call this frequently while there are messages in flight.
+    void service();
+
+    /// Returns the status of a message sent with sendtoAsync(). Once the message has been delivered
+    /// or has failed, the handle is released and must not be used again.
+    /// \param[in] handle The handle returned by sendtoAsync()
+    /// \return The status of the message, one of RH_ASYNC_STATUS_*
+    uint8_t asyncStatus(uint8_t handle);
+
     /// If there is a valid message available for this node, send an acknowledgement to the SRC
     /// address (blocking until this is complete), then copy the message to buf and return true
     /// else return false. 
@@ -152,6 +508,34 @@ public:
     /// \return true if a valid message was copied to buf
     bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Tests whether a new message is available, either in the receive queue (see sendtoWait()), 
+    /// or from the Driver.
+    /// \return true if a message is available to be retrieved by recvfromAck()
+    bool available();
+
+    /// Blocks until a message is available, either in the receive queue (see sendtoWait()), 
+    /// or from the Driver, or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if a message is available
+    bool waitAvailableTimeout(uint16_t timeout);
+
+    /// Sets how long recvfromAck() may hold an acknowledgement, in the hope that it can be sent 
+    /// on a message going back to the same node. Defaults to 0, which means acknowledgements are always 
+    /// sent at once. See the section on Delayed Acknowledgements above.
+    /// \param[in] delay The maximum time to hold acknowledgements in milliseconds
+    void setAckDelay(uint16_t delay);
+
+    /// Makes acceptMessage() ask another manager whether new messages can be kept. 
+    /// RHRouter::addInterface() uses this so that the router decides for the messages received through 
+    /// each of its interfaces, which are plain RHReliableDatagram instances
+    /// \param[in] acceptor The manager to ask, or NULL to accept every message
+    void setAcceptor(RHReliableDatagram* acceptor);
+
+    /// Returns the number of new messages that were received while sendtoWait() was waiting for an ACK, 
+    /// but could not be kept because the receive queue was full.
+    /// \return The number of messages dropped.
+    uint32_t rxQueueDropped();
+
     /// Returns the number of retransmissions 
     /// we have had to send since starting or since the last call to resetRetransmissions().
     /// \return The number of retransmissions since initialisation.
@@ -161,11 +545,249 @@ public:
     /// to 0. 
     void resetRetransmissions(); 
 
+    /// Returns the link statistics for a peer. See the section on Link Statistics above.
+    /// \param[in] address The node address of the peer
+    /// \return Pointer to the LinkStats for the peer, or NULL if there are none 
+    /// (or RH_RELIABLE_LINK_STATS is 0)
+    LinkStats* getLinkStats(uint8_t address);
+
+    /// Returns the link statistics in an entry of the peer table, so you can step through all of them
+    /// with index from 0 to RH_RELIABLE_PEER_TABLE_SIZE - 1.
+    /// \param[in] index The index of the entry in the peer table
+    /// \param[out] address Set to the node address of the peer
+    /// \return Pointer to the LinkStats for the peer, or NULL if the entry is not in use
+    /// (or RH_RELIABLE_LINK_STATS is 0)
+    LinkStats* getLinkStatsAt(uint8_t index, uint8_t* address);
+
+    /// Clears the link statistics of all peers
+    void clearLinkStats();
+
+    /// If RH_HAVE_SERIAL is defined, this will print out the link statistics 
+    /// of all peers using Serial
+    void printLinkStats();
+
 protected:
+#if RH_RELIABLE_DUP_WINDOW > 16
+    typedef uint32_t SeenMask;
+#elif RH_RELIABLE_DUP_WINDOW > 8
+    typedef uint16_t SeenMask;
+#else
+    typedef uint8_t SeenMask;
+#endif
+
+    /// State kept for peers that send us messages, or whose round trip time we are measuring
+    typedef struct
+    {
+	uint8_t       address;   ///< Address of the peer. RH_BROADCAST_ADDRESS if this entry is not in use
+	bool          heard;     ///< true if a message has been received from the peer, and highId is valid
+	uint8_t       highId;    ///< The highest message ID received from the peer
+	unsigned long lastSeen;  ///< millis() when a new message was last received from the peer
+	SeenMask      seenMask;  ///< Bit i is set if ID (highId - 1 - i) has been received from the peer
+	bool          windowed;  ///< true while the peer is sending windowed bursts
+	bool          lastWindow; ///< true if the last new message from the peer had RH_FLAGS_WINDOW
+	uint8_t       backoff;   ///< Number of timeouts since the last round trip time measurement
+	uint16_t      srtt;      ///< Smoothed round trip time in milliseconds * 8. 0 if there is no estimate yet
+	uint16_t      rttvar;    ///< Round trip time variation in milliseconds * 4
+	unsigned long lastUsed;  ///< millis() when this entry was last used
+#if RH_RELIABLE_LINK_STATS
+	LinkStats     stats;     ///< Statistics about the link to the peer
+#endif
+    } PeerState;
+
+    /// An acknowledgement being held by delayAcknowledge()
+    typedef struct
+    {
+	uint8_t       address;   ///< Address to acknowledge to. RH_BROADCAST_ADDRESS if this entry is not in use
+	uint8_t       id;        ///< ID of the message being acknowledged
+	uint16_t      delay;     ///< How long to hold the acknowledgement, in milliseconds
+	unsigned long time;      ///< millis() when the message was received
+    } PendingAck;
+
+    /// A message kept in the receive queue
+    typedef struct
+    {
+	uint8_t       from;      ///< FROM header of the message
+	uint8_t       to;        ///< TO header of the message
+	uint8_t       id;        ///< ID header of the message
+	uint8_t       flags;     ///< FLAGS header of the message
+	uint8_t       len;       ///< Length of the message
+	uint8_t       data[RH_RELIABLE_RX_QUEUE_BUF_LEN]; ///< The message
+    } QueuedMessage;
+
+    /// State of a message sent by sendtoAsync()
+    typedef struct
+    {
+	uint8_t*      buf;       ///< The message being sent
+	uint8_t       len;       ///< Length of the message
+	uint8_t       address;   ///< Destination of the message
+	uint8_t       id;        ///< Sequence number of the message
+	uint8_t       tries;     ///< Number of times the message has been transmitted
+	uint8_t       status;    ///< One of RH_ASYNC_STATUS_*
+	uint8_t       priority;  ///< Transmit queue priority class
+	bool          queued;    ///< True while the message is waiting in the transmit queue
+	bool          sent;      ///< True when the last transmission has finished and the timer is running
+	uint16_t      timeout;   ///< Time to wait for the ACK after the last transmission
+	unsigned long sendTime;  ///< millis() at the start, then at the end of the last transmission
+    } AsyncSend;
+
+    /// Transmits (or retransmits) a message sent by sendtoAsync() and restarts its timer
+    /// \param[in] async The message to transmit
+    void asyncTransmit(AsyncSend* async);
+
+    /// Starts the timer of a message sent by sendtoAsync() when it leaves the transmit queue
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID of the message
+    virtual void queuedSent(uint8_t to, uint8_t id);
+
+    /// Called when an ACK is received that might be for a message sent by sendtoAsync()
+    /// \param[in] from The address the ACK came from
+    /// \param[in] id The ID of the message being acknowledged
+    void asyncAcknowledged(uint8_t from, uint8_t id);
+
+    /// Computes a new retransmission timeout, random between the configured timeout and twice that
+    /// \return The new timeout in milliseconds
+    uint16_t randomTimeout();
+
+    /// Computes the time to wait for an acknowledgement from a destination.
+    /// If adaptive timeouts are enabled, this is the destination's current retransmit timeout 
+    /// plus some random jitter, else it is randomTimeout().
+    /// \param[in] address The destination node address
+    /// \param[in] txTime How long the transmission of the message took in milliseconds. Used to seed the 
+    /// estimates for a destination that has no round trip time measurements yet.
+    /// \return The timeout in milliseconds
+    uint16_t ackTimeout(uint8_t address, uint16_t txTime);
+
+    /// Updates the round trip time estimates for a destination with a new measurement
+    /// \param[in] address The destination node address
+    /// \param[in] rtt The measured round trip time in milliseconds
+    void updateRtt(uint8_t address, uint16_t rtt);
+
+    /// Doubles the retransmit timeout for a destination after a timeout
+    /// \param[in] address The destination node address
+    void backoffRtt(uint8_t address);
+
     /// Send an ACK for the message id to the given from address
+    /// If the address is sending windowed bursts, and we have a record of other recently received 
+    /// message IDs from it, the selective acknowledgement bitmap is appended.
     /// Blocks until the ACK has been sent
     void acknowledge(uint8_t id, uint8_t from);
 
+    /// Called before a new data message is acknowledged, to ask whether it can be kept. 
+    /// It is not called for duplicates, which are always acknowledged again.
+    /// Subclasses may override to refuse messages they have no room for, which are then not acknowledged,
+    /// so the sender will retransmit them later. The default asks the manager set by setAcceptor(), 
+    /// if any, and otherwise accepts every message.
+    /// \param[in] buf The message
+    /// \param[in] len The length of the message
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID of the message
+    /// \return true if the message can be kept
+    virtual bool acceptMessage(uint8_t* buf, uint8_t len, uint8_t from, uint8_t to, uint8_t id);
+
+    /// Handles duplicate detection and acknowledgement for a newly received message (not an ACK)
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID of the message
+    /// \param[in] flags The FLAGS of the message
+    /// \param[in] accept false if a new message cannot be kept, in which case it is not acknowledged or recorded as 
+    /// seen, so the sender will retransmit it later
+    /// \return true if this is a new message that has been accepted
+    bool receivedMessage(uint8_t from, uint8_t to, uint8_t id, uint8_t flags, bool accept);
+
+    /// Handles duplicate detection and acknowledgement for a newly received message sent by sendtoGroupWait(),
+    /// and removes the group header from it. The acknowledgement is held until this node's slot.
+    /// \param[in,out] buf The message, starting with the group header. On return, the message without the header
+    /// \param[in,out] len The length of the message. On return, the length without the header
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] id The ID of the message
+    /// \param[in] accept false if a new message cannot be kept, as for receivedMessage()
+    /// \return true if this is a new message for this node that has been accepted
+    bool receivedGroupMessage(uint8_t* buf, uint8_t* len, uint8_t from, uint8_t id, bool accept);
+
+    /// Waits for an ACK addressed to this node, while sendtoWait() or sendtoGroupWait() is waiting. 
+    /// Any data message received instead is acknowledged and kept in the receive queue if there is room.
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \param[out] from Set to the address the ACK came from
+    /// \param[out] id Set to the ID of the message being acknowledged
+    /// \param[out] sack Set to the selective acknowledgement bitmap in the ACK, if any, else 0
+    /// \return true if an ACK was received
+    bool waitAck(uint16_t timeout, uint8_t* from, uint8_t* id, uint8_t* sack);
+
+    /// Holds the acknowledgement for message id from the given address, to be sent on the next 
+    /// message to that address, or by sendPendingAcks() when the delay expires.
+    /// \param[in] id The ID of the message to acknowledge
+    /// \param[in] from The address to send the acknowledgement to
+    /// \param[in] delay How long to hold the acknowledgement in milliseconds
+    void delayAcknowledge(uint8_t id, uint8_t from, uint16_t delay);
+
+    /// Sends any held acknowledgements that have reached their delay (see setAckDelay() and setGroupAckSlot())
+    /// \param[in] all If true, sends all held acknowledgements regardless of delay
+    void sendPendingAcks(bool all);
+
+    /// Sends a message like RHDatagram::sendto(), with any held acknowledgement for the address 
+    /// piggybacked on it
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address to send the message to.
+    /// \return true if the message was transmitted
+    bool sendtoPiggyback(uint8_t* buf, uint8_t len, uint8_t address);
+
+    /// Like RHDatagram::waitAvailableTimeout(), but sends held acknowledgements as they become due while waiting
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if a message is available from the Driver
+    bool waitAvailableAckTimeout(uint16_t timeout);
+
+    /// Returns the selective acknowledgement bitmap to send in the acknowledgement of the given message
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] id The ID of the message
+    /// \return Bit i is set if ID (id - 1 - i) has been received from the sender. 
+    /// Always 0 if the sender is not sending windowed bursts
+    uint8_t sackBitmap(uint8_t from, uint8_t id);
+
+    /// Tests whether a message with the given id from the given address has already been received
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] id The ID of the message
+    /// \return true if the message is a duplicate of one previously received
+    bool isDuplicate(uint8_t from, uint8_t id);
+
+    /// Records that a message with the given id from the given address has been received, 
+    /// for the purposes of future duplicate detection by isDuplicate()
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] id The ID of the message
+    void markSeen(uint8_t from, uint8_t id);
+
+    /// Finds the PeerState for the given address. Entries that have been idle for longer 
+    /// than RH_RELIABLE_PEER_IDLE_TIMEOUT are discarded
+    /// \param[in] address The node address of the peer
+    /// \return Pointer to the PeerState, or NULL if there is none
+    PeerState* findPeer(uint8_t address);
+
+    /// Finds the PeerState for the given address, creating it if necessary. If the peer table is full, 
+    /// the least recently used entry is reused.
+    /// \param[in] address The node address of the peer
+    /// \return Pointer to the PeerState
+    PeerState* allocatePeer(uint8_t address);
+
+    /// Updates the link statistics when a frame has been sent
+    /// \param[in] address The address the frame was sent to
+    /// \param[in] retry true if the frame was a retransmission
+    /// \param[in] allocate If false, only a peer already in the table is updated
+    void statsSent(uint8_t address, bool retry, bool allocate = true);
+
+    /// Updates the link statistics when a message has been acknowledged, or has failed
+    /// \param[in] address The address the message was sent to
+    /// \param[in] tries The number of times the message was sent, or 0 if it was never acknowledged
+    /// \param[in] rtt The round trip time of the acknowledgement in milliseconds, 
+    /// or 0 if it was not measured (because the message was retransmitted, so the time is ambiguous)
+    void statsDelivered(uint8_t address, uint8_t tries, uint16_t rtt);
+
+    /// Updates the link statistics when a frame (of any kind) has been heard from a peer.
+    /// Does nothing if the sender has no entry in the peer table: entries are only made for 
+    /// nodes this node sends to or receives new messages from
+    /// \param[in] from The address of the sender of the frame
+    void statsHeard(uint8_t from);
+
     /// Checks whether the message currently in the Rx buffer is a new message, not previously received
     /// based on the from address and the sequence.  If it is new, it is acknowledged and returns true
     /// \return true if there is a message received and it is a new message
@@ -187,15 +809,55 @@ private:
     /// Defaults to 3
     uint8_t _retries;
 
-    /// Array of the last seen sequence number indexed by node address that sent it
-    /// It is used for duplicate detection. Duplicated messages are re-acknowledged when received 
+    /// Whether to use adaptive per-destination retransmit timeouts
+    bool _adaptiveTimeout;
+
+    /// Maximum number of unacknowledged frames in sendtoWaitWindowed()
+    /// Defaults to 1
+    uint8_t _windowSize;
+
+    /// Per-peer state, including the record of recently seen sequence numbers used for 
+    /// duplicate detection. Duplicated messages are re-acknowledged when received 
     /// (this is generally due to lost ACKs, causing the sender to retransmit, even though we have already
     /// received that message)
-    uint8_t _seenIds[256];
+    PeerState _peers[RH_RELIABLE_PEER_TABLE_SIZE];
+
+    /// The entry last returned by findPeer(), checked first to save searching the table
+    PeerState* _lastPeer;
+
+    /// Messages in flight from sendtoAsync()
+    AsyncSend _async[RH_RELIABLE_ASYNC_SLOTS];
+
+    /// Maximum time to hold acknowledgements, in milliseconds. 0 means never hold them
+    uint16_t _ackDelay;
+
+    /// Time allowed for each member of a group to send its ACK, in milliseconds
+    uint16_t _groupAckSlot;
+
+    /// Acknowledgements being held
+    PendingAck _pendingAcks[RH_RELIABLE_PENDING_ACKS];
+
+    /// The manager acceptMessage() asks, or NULL
+    RHReliableDatagram* _acceptor;
+
+    /// Count of messages that could not be kept because the receive queue was full
+    uint32_t _rxQueueDropped;
+
+#if RH_RELIABLE_RX_QUEUE_SIZE > 0
+    /// Messages received while waiting for an ACK
+    QueuedMessage _rxQueue[RH_RELIABLE_RX_QUEUE_SIZE];
+
+    /// Index of the oldest message in _rxQueue
+    uint8_t _rxQueueHead;
+
+    /// Number of messages in _rxQueue
+    uint8_t _rxQueueCount;
+#endif
 };
 
 /// @example rf22_reliable_datagram_client.pde
 /// @example rf22_reliable_datagram_server.pde
+/// @example simulator_reliable_datagram_benchmark.pde
 
 #endif
 
@@ -12,8 +12,13 @@
 // $Id: RHRouter.cpp,v 1.7 2015/08/13 02:45:47 mikem Exp $
 
 #include <RHRouter.h>
-
-RHRouter::RoutedMessage RHRouter::_tmpMessage;
+#include <RHCRC.h>
+#if defined(__AVR__)
+ #include <avr/eeprom.h>
+#endif
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+ #include <stdio.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
@@ -21,7 +26,29 @@ RHRouter::RHRouter(RHGenericDriver& driver, uint8_t thisAddress)
     : RHReliableDatagram(driver, thisAddress)
 {
     _max_hops = RH_DEFAULT_MAX_HOPS;
+    _routeTimeout = RH_ROUTER_ROUTE_TIMEOUT;
     clearRoutingTable();
+    resetRouteStats();
+    _interfaces[0] = this;
+    _interfaceCount = 1;
+    _rxFrom = RH_BROADCAST_ADDRESS;
+    _rxInterface = 0;
+    uint8_t i;
+#if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+    for (i = 0; i < RH_ROUTER_MAX_INTERFACES; i++)
+    {
+	_forwardQueues[i].head = 0;
+	_forwardQueues[i].count = 0;
+	_forwardQueues[i].handle = RH_ASYNC_INVALID_HANDLE;
+    }
+#endif
+    _forwardQueueDropped = 0;
+    _e2eWaitDest = RH_BROADCAST_ADDRESS;
+    _e2eAcked = false;
+    _e2eHeldLen = 0;
+    for (i = 0; i < RH_ROUTER_E2E_DUP_TABLE_SIZE; i++)
+	_e2eSeenSource[i] = RH_BROADCAST_ADDRESS;
+    _e2eSeenNext = 0;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -41,65 +68,256 @@ void RHRouter::setMaxHops(uint8_t max_hops)
 }
 
 ////////////////////////////////////////////////////////////////////
-void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state)
+bool RHRouter::addInterface(RHReliableDatagram& manager)
+{
+    if (_interfaceCount >= RH_ROUTER_MAX_INTERFACES)
+	return false;
+    manager.setThisAddress(_thisAddress);
+    // So that messages we would have to refuse are not acknowledged on the other interfaces either
+    manager.setAcceptor(this);
+    _interfaces[_interfaceCount++] = &manager;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::interfaceCount()
+{
+    return _interfaceCount;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::findRoute(uint8_t dest)
+{
+#if RH_ROUTING_TABLE_DENSE
+    // Indexed directly by address
+    return dest < RH_ROUTING_TABLE_SLOTS ? dest : RH_ROUTING_TABLE_SLOTS;
+#else
+    // Search from the home entry of dest until dest or a free entry is found.
+    // There are always free entries, so this ends.
+    uint8_t i = dest % RH_ROUTING_TABLE_SLOTS;
+    while (_routes[i].state != Invalid && _routes[i].dest != dest)
+	i = (i + 1) % RH_ROUTING_TABLE_SLOTS;
+    return i;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::unlinkRoute(uint8_t index)
+{
+    uint8_t older = _routes[index].older;
+    uint8_t newer = _routes[index].newer;
+    if (older < RH_ROUTING_TABLE_SLOTS)
+	_routes[older].newer = newer;
+    else
+	_oldestRoute = newer;
+    if (newer < RH_ROUTING_TABLE_SLOTS)
+	_routes[newer].older = older;
+    else
+	_newestRoute = older;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::linkRoute(uint8_t index)
 {
+    _routes[index].older = _newestRoute;
+    _routes[index].newer = RH_ROUTING_TABLE_SLOTS;
+    if (_newestRoute < RH_ROUTING_TABLE_SLOTS)
+	_routes[_newestRoute].newer = index;
+    else
+	_oldestRoute = index;
+    _newestRoute = index;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::addAlternate(uint8_t index, uint8_t next_hop, uint8_t metric)
+{
+#if RH_ROUTER_ALTERNATE_HOPS
+    RoutingTableEntry* route = &_routes[index];
+    removeAlternate(index, next_hop);
+    // Find where it goes, after any as good
     uint8_t i;
+    for (i = 0; i < RH_ROUTER_ALTERNATE_HOPS; i++)
+	if (route->alternate[i] == RH_BROADCAST_ADDRESS || route->alternateMetric[i] > metric)
+	    break;
+    if (i >= RH_ROUTER_ALTERNATE_HOPS)
+	return; // Worse than all the others
+    // Make room, losing the worst if full
+    uint8_t j;
+    for (j = RH_ROUTER_ALTERNATE_HOPS - 1; j > i; j--)
+    {
+	route->alternate[j] = route->alternate[j - 1];
+	route->alternateMetric[j] = route->alternateMetric[j - 1];
+    }
+    route->alternate[i] = next_hop;
+    route->alternateMetric[i] = metric;
+#endif
+}
 
-    // First look for an existing entry we can update
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+////////////////////////////////////////////////////////////////////
+void RHRouter::removeAlternate(uint8_t index, uint8_t next_hop)
+{
+#if RH_ROUTER_ALTERNATE_HOPS
+    RoutingTableEntry* route = &_routes[index];
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_ALTERNATE_HOPS; i++)
+	if (route->alternate[i] == next_hop)
+	    break;
+    for (; i < RH_ROUTER_ALTERNATE_HOPS; i++)
     {
-	if (_routes[i].dest == dest)
+	if (i + 1 < RH_ROUTER_ALTERNATE_HOPS)
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
+	    route->alternate[i] = route->alternate[i + 1];
+	    route->alternateMetric[i] = route->alternateMetric[i + 1];
 	}
+	else
+	    route->alternate[i] = RH_BROADCAST_ADDRESS;
     }
+#endif
+}
 
-    // Look for an invalid entry we can use
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+////////////////////////////////////////////////////////////////////
+bool RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state, uint8_t metric, uint8_t iface)
+{
+    if (state == Invalid)
     {
-	if (_routes[i].state == Invalid)
+	deleteRouteTo(dest);
+	return true;
+    }
+
+    uint8_t i = findRoute(dest);
+    if (i >= RH_ROUTING_TABLE_SLOTS)
+	return false; // No entry for this address in a directly indexed table
+    if (_routes[i].state == Invalid)
+    {
+	// A new route. Maybe need to make room for it
+	expireRoutes();
+	if (_routeCount >= RH_ROUTING_TABLE_SIZE)
+	    retireOldestRoute();
+	i = findRoute(dest); // Entries may have moved
+	_routes[i].added = millis();
+	_routes[i].next_hop = next_hop;
+#if RH_ROUTER_ALTERNATE_HOPS
+	memset(_routes[i].alternate, RH_BROADCAST_ADDRESS, sizeof(_routes[i].alternate));
+#endif
+	_routeCount++;
+    }
+    else if (_routes[i].state == Stale && state != Stale)
+    {
+	// A restored route. Whatever has been learned since replaces it
+	unlinkRoute(i);
+#if RH_ROUTER_ALTERNATE_HOPS
+	memset(_routes[i].alternate, RH_BROADCAST_ADDRESS, sizeof(_routes[i].alternate));
+#endif
+    }
+    else if (iface != _routes[i].iface)
+    {
+	unlinkRoute(i);
+	if (metric && _routes[i].metric && metric >= _routes[i].metric)
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
+	    // No better than the current next hop, and alternates must be on the same interface
+	    metric = _routes[i].metric;
+	    next_hop = _routes[i].next_hop;
+	    iface = _routes[i].iface;
 	}
+#if RH_ROUTER_ALTERNATE_HOPS
+	else
+	    memset(_routes[i].alternate, RH_BROADCAST_ADDRESS, sizeof(_routes[i].alternate));
+#endif
     }
-
-    // Need to make room for a new one
-    retireOldestRoute();
-    // Should be an invalid slot now
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    else
     {
-	if (_routes[i].state == Invalid)
+	unlinkRoute(i);
+	if (next_hop == _routes[i].next_hop && !metric)
+	    metric = _routes[i].metric; // Still the same route
+	else if (   next_hop != _routes[i].next_hop
+	    && metric && _routes[i].metric)
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
+	    if (metric >= _routes[i].metric)
+	    {
+		// No better than the current next hop: keep it as an alternate
+		addAlternate(i, next_hop, metric);
+		metric = _routes[i].metric;
+		next_hop = _routes[i].next_hop;
+	    }
+	    else
+		addAlternate(i, _routes[i].next_hop, _routes[i].metric); // Better: keep the old one as an alternate
 	}
+	removeAlternate(i, next_hop);
     }
+    _routes[i].dest = dest;
+    _routes[i].next_hop = next_hop;
+    _routes[i].state = state;
+    _routes[i].metric = metric;
+    _routes[i].iface = iface;
+    _routes[i].lastUsed = millis();
+    linkRoute(i);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////
 RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-	if (_routes[i].dest == dest && _routes[i].state != Invalid)
+    uint8_t i = findRoute(dest);
+    if (i < RH_ROUTING_TABLE_SLOTS && _routes[i].state != Invalid)
+    {
+	unsigned long now = millis();
+	if (_routeTimeout && now - _routes[i].lastUsed > _routeTimeout)
+	{
+	    deleteRoute(i);
+	    _routeExpiries++;
+	}
+	else
+	{
+	    _routeHits++;
+	    _routes[i].lastUsed = now;
+	    if (i != _newestRoute)
+	    {
+		unlinkRoute(i);
+		linkRoute(i);
+	    }
 	    return &_routes[i];
+	}
+    }
+    _routeMisses++;
     return NULL;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::deleteRoute(uint8_t index)
 {
-    // Delete a route by copying following routes on top of it
-    memcpy(&_routes[index], &_routes[index+1], 
-	   sizeof(RoutingTableEntry) * (RH_ROUTING_TABLE_SIZE - index - 1));
-    _routes[RH_ROUTING_TABLE_SIZE - 1].state = Invalid;
+    if (_routes[index].state == Invalid)
+	return;
+    unlinkRoute(index);
+    _routeCount--;
+#if !RH_ROUTING_TABLE_DENSE
+    // Move back any following entries that would no longer be found past the hole
+    uint8_t i = index;
+    uint8_t j = index;
+    while (true)
+    {
+	j = (j + 1) % RH_ROUTING_TABLE_SLOTS;
+	if (_routes[j].state == Invalid)
+	    break;
+	uint8_t home = _routes[j].dest % RH_ROUTING_TABLE_SLOTS;
+	// Can the entry at j move to the hole at i? Only if its home is not cyclically in (i, j]
+	if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+	{
+	    _routes[i] = _routes[j];
+	    // Point its neighbours in the list at its new index
+	    if (_routes[i].older < RH_ROUTING_TABLE_SLOTS)
+		_routes[_routes[i].older].newer = i;
+	    else
+		_oldestRoute = i;
+	    if (_routes[i].newer < RH_ROUTING_TABLE_SLOTS)
+		_routes[_routes[i].newer].older = i;
+	    else
+		_newestRoute = i;
+	    i = j;
+	}
+    }
+    index = i;
+#endif
+    _routes[index].state = Invalid;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -107,15 +325,34 @@ void RHRouter::printRoutingTable()
 {
 #ifdef RH_HAVE_SERIAL
     uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    for (i = 0; i < RH_ROUTING_TABLE_SLOTS; i++)
     {
+	if (_routes[i].state == Invalid)
+	    continue;
 	Serial.print(i, DEC);
 	Serial.print(" Dest: ");
 	Serial.print(_routes[i].dest, DEC);
 	Serial.print(" Next Hop: ");
 	Serial.print(_routes[i].next_hop, DEC);
 	Serial.print(" State: ");
-	Serial.println(_routes[i].state, DEC);
+	Serial.print(_routes[i].state, DEC);
+	Serial.print(" Metric: ");
+	Serial.print(_routes[i].metric, DEC);
+#if RH_ROUTER_MAX_INTERFACES > 1
+	Serial.print(" Interface: ");
+	Serial.print(_routes[i].iface, DEC);
+#endif
+#if RH_ROUTER_ALTERNATE_HOPS
+	uint8_t j;
+	for (j = 0; j < RH_ROUTER_ALTERNATE_HOPS && _routes[i].alternate[j] != RH_BROADCAST_ADDRESS; j++)
+	{
+	    Serial.print(" Alternate: ");
+	    Serial.print(_routes[i].alternate[j], DEC);
+	    Serial.print("/");
+	    Serial.print(_routes[i].alternateMetric[j], DEC);
+	}
+#endif
+	Serial.println("");
     }
 #endif
 }
@@ -123,74 +360,681 @@ void RHRouter::printRoutingTable()
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::deleteRouteTo(uint8_t dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    uint8_t i = findRoute(dest);
+    if (i < RH_ROUTING_TABLE_SLOTS && _routes[i].state != Invalid)
     {
-	if (_routes[i].dest == dest)
-	{
-	    deleteRoute(i);
-	    return true;
-	}
+	deleteRoute(i);
+	return true;
     }
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::routeInterface(uint8_t dest)
+{
+    uint8_t i = findRoute(dest);
+    if (i < RH_ROUTING_TABLE_SLOTS && _routes[i].state != Invalid)
+	return _routes[i].iface;
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////
 void RHRouter::retireOldestRoute()
 {
-    // We just obliterate the first in the table and clear the last
-    deleteRoute(0);
+    if (_oldestRoute < RH_ROUTING_TABLE_SLOTS)
+    {
+	deleteRoute(_oldestRoute);
+	_routeEvictions++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::forwardInterface(RoutedMessage* message, uint8_t messageLen)
+{
+    uint8_t next_hop = pathNextHop(message, messageLen);
+    return routeInterface(next_hop != RH_BROADCAST_ADDRESS ? next_hop : message->header.dest);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::maxMessageLengthTo(uint8_t next_hop)
+{
+    return _interfaces[routeInterface(next_hop)]->maxMessageLength();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::confirmRoute(uint8_t dest)
+{
+    uint8_t i = findRoute(dest);
+    if (i < RH_ROUTING_TABLE_SLOTS && _routes[i].state == Stale)
+	_routes[i].state = Valid;
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHRouter::failoverRoute(uint8_t dest)
+{
+#if RH_ROUTER_ALTERNATE_HOPS
+    uint8_t i = findRoute(dest);
+    if (   i < RH_ROUTING_TABLE_SLOTS 
+	&& _routes[i].state != Invalid
+	&& _routes[i].alternate[0] != RH_BROADCAST_ADDRESS)
+    {
+	_routes[i].next_hop = _routes[i].alternate[0];
+	_routes[i].metric = _routes[i].alternateMetric[0];
+	removeAlternate(i, _routes[i].next_hop);
+	_routeFailovers++;
+	return &_routes[i];
+    }
+#endif
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::expireRoutes()
+{
+    if (!_routeTimeout)
+	return;
+    unsigned long now = millis();
+    while (_oldestRoute < RH_ROUTING_TABLE_SLOTS && now - _routes[_oldestRoute].lastUsed > _routeTimeout)
+    {
+	deleteRoute(_oldestRoute);
+	_routeExpiries++;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::clearRoutingTable()
 {
     uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    for (i = 0; i < RH_ROUTING_TABLE_SLOTS; i++)
+    {
+	_routes[i].dest = 0;
 	_routes[i].state = Invalid;
+    }
+    _routeCount = 0;
+    _oldestRoute = RH_ROUTING_TABLE_SLOTS;
+    _newestRoute = RH_ROUTING_TABLE_SLOTS;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::saveRoutingTable(uint8_t* buf, uint16_t len)
+{
+    // VERSION, ADDRESS, COUNT, then DEST, NEXT_HOP, METRIC, INTERFACE of each route, 
+    // least recently used first, then the CRC of all that, low octet first
+    if (len < 3 + 4 * (uint16_t)_routeCount + 2)
+	return 0;
+    uint16_t n = 3;
+    uint8_t count = 0;
+    uint8_t i;
+    for (i = _oldestRoute; i < RH_ROUTING_TABLE_SLOTS; i = _routes[i].newer)
+    {
+	if (_routes[i].state != Valid && _routes[i].state != Stale)
+	    continue;
+	buf[n++] = _routes[i].dest;
+	buf[n++] = _routes[i].next_hop;
+	buf[n++] = _routes[i].metric;
+	buf[n++] = _routes[i].iface;
+	count++;
+    }
+    buf[0] = RH_ROUTER_SNAPSHOT_VERSION;
+    buf[1] = _thisAddress;
+    buf[2] = count;
+    uint16_t crc = 0xffff;
+    uint16_t j;
+    for (j = 0; j < n; j++)
+	crc = RHcrc_ccitt_update(crc, buf[j]);
+    buf[n++] = crc & 0xff;
+    buf[n++] = crc >> 8;
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::restoreRoutingTable(uint8_t* buf, uint16_t len)
+{
+    if (   len < 5
+	|| buf[0] != RH_ROUTER_SNAPSHOT_VERSION
+	|| buf[1] != _thisAddress
+	|| len < 3 + 4 * (uint16_t)buf[2] + 2)
+	return false;
+    uint16_t n = 3 + 4 * (uint16_t)buf[2];
+    uint16_t crc = 0xffff;
+    uint16_t i;
+    for (i = 0; i < n; i++)
+	crc = RHcrc_ccitt_update(crc, buf[i]);
+    if (buf[n] != (crc & 0xff) || buf[n + 1] != (crc >> 8))
+	return false;
+    // If there is not room for them all, leave out the least recently used ones, 
+    // rather than retiring routes learned since the reset
+    uint8_t room = RH_ROUTING_TABLE_SIZE - _routeCount;
+    i = 3;
+    if (buf[2] > room)
+	i += 4 * (uint16_t)(buf[2] - room);
+    for (; i < n; i += 4)
+    {
+	uint8_t index = findRoute(buf[i]);
+	if (index < RH_ROUTING_TABLE_SLOTS && _routes[index].state == Invalid)
+	    addRouteTo(buf[i], buf[i + 1], Stale, buf[i + 2], buf[i + 3]);
+    }
+    return true;
+}
+
+#if defined(__AVR__)
+////////////////////////////////////////////////////////////////////
+void RHRouter::saveRoutingTableToEEPROM(uint16_t address)
+{
+    uint8_t buf[RH_ROUTER_SNAPSHOT_LEN];
+    uint16_t len = saveRoutingTable(buf, sizeof(buf));
+    eeprom_update_block(buf, (void*)address, len);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::restoreRoutingTableFromEEPROM(uint16_t address)
+{
+    uint8_t buf[RH_ROUTER_SNAPSHOT_LEN];
+    eeprom_read_block(buf, (const void*)address, sizeof(buf));
+    return restoreRoutingTable(buf, sizeof(buf));
+}
+#endif
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+////////////////////////////////////////////////////////////////////
+bool RHRouter::saveRoutingTableToFile(const char* filename)
+{
+    uint8_t buf[RH_ROUTER_SNAPSHOT_LEN];
+    uint16_t len = saveRoutingTable(buf, sizeof(buf));
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+	return false;
+    bool ret = fwrite(buf, 1, len, f) == len;
+    if (fclose(f) != 0)
+	ret = false;
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::restoreRoutingTableFromFile(const char* filename)
+{
+    uint8_t buf[RH_ROUTER_SNAPSHOT_LEN];
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+	return false;
+    uint16_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return restoreRoutingTable(buf, len);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setRouteTimeout(unsigned long timeout)
+{
+    _routeTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeHits()
+{
+    return _routeHits;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeMisses()
+{
+    return _routeMisses;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeEvictions()
+{
+    return _routeEvictions;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeExpiries()
+{
+    return _routeExpiries;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::routeFailovers()
+{
+    return _routeFailovers;
 }
 
+////////////////////////////////////////////////////////////////////
+void RHRouter::resetRouteStats()
+{
+    _routeHits = 0;
+    _routeMisses = 0;
+    _routeEvictions = 0;
+    _routeExpiries = 0;
+    _routeFailovers = 0;
+    _e2eRetransmissions = 0;
+    _e2eDuplicates = 0;
+}
 
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::e2eRetransmissions()
+{
+    return _e2eRetransmissions;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::e2eDuplicates()
+{
+    return _e2eDuplicates;
+}
+
+////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags)
 {
-    return sendtoFromSourceWait(buf, len, dest, _thisAddress, flags);
+    if (   !(flags & RH_ROUTER_FLAGS_E2E_ACK_REQUEST)
+	|| dest == RH_BROADCAST_ADDRESS)
+	return sendtoFromSourceWait(buf, len, dest, _thisAddress, flags & ~RH_ROUTER_FLAGS_RESERVED);
+
+    if (len > RH_ROUTER_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    // Every retransmission has the same ID, so the destination can recognise it
+    uint8_t id = _lastE2ESequenceNumber++;
+    uint16_t timeout = 0;
+    uint8_t count = 0;
+    while (count++ <= retries())
+    {
+	// _tmpMessage is used for receiving while waiting, so build the message again each time
+	_tmpMessage.header.source = _thisAddress;
+	_tmpMessage.header.dest = dest;
+	_tmpMessage.header.hops = 0;
+	_tmpMessage.header.id = id;
+	_tmpMessage.header.flags = (flags & ~RH_ROUTER_FLAGS_RESERVED) | RH_ROUTER_FLAGS_E2E_ACK_REQUEST;
+	memcpy(_tmpMessage.data, buf, len);
+	uint8_t error = route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+	if (error != RH_ROUTER_ERROR_NONE)
+	    return error;
+
+	if (timeout == 0)
+	{
+	    // The message and its acknowledgement each have to cross every hop
+	    RoutingTableEntry* route = getRouteTo(dest);
+	    uint8_t hops = (route && route->metric) ? route->metric : RH_ROUTER_E2E_DEFAULT_HOPS;
+	    // Only interface 0 has our estimates of the round trip times to its next hops
+	    uint16_t hopTimeout = (route && route->iface == 0) ? ackTimeout(route->next_hop, 0) : randomTimeout();
+	    uint32_t rto = (uint32_t)hopTimeout * 2 * hops;
+	    timeout = rto > 0xffff ? 0xffff : rto;
+	}
+	else
+	{
+	    _e2eRetransmissions++;
+	    timeout = timeout > 0x7fff ? 0xffff : timeout * 2;
+	}
+	if (waitE2EAck(dest, id, timeout))
+	    return RH_ROUTER_ERROR_NONE;
+    }
+    return RH_ROUTER_ERROR_NO_REPLY;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::waitE2EAck(uint8_t dest, uint8_t id, uint16_t timeout)
+{
+    _e2eWaitDest = dest;
+    _e2eWaitId = id;
+    _e2eAcked = false;
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while (!_e2eAcked && (timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	// recvfromAck() notices the acknowledgement, forwards messages for other nodes 
+	// and keeps any for this node
+	if (waitAvailableTimeout(timeLeft))
+	    recvfromAck(NULL, NULL);
+	YIELD;
+    }
+    _e2eWaitDest = RH_BROADCAST_ADDRESS;
+    return _e2eAcked;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::sendE2EAck(uint8_t source, uint8_t id)
+{
+    RoutedMessageHeader ack;
+    ack.dest = source;
+    ack.source = _thisAddress;
+    ack.hops = 0;
+    ack.id = id;
+    ack.flags = RH_ROUTER_FLAGS_E2E_ACK;
+    forward((RoutedMessage*)&ack, sizeof(ack), _thisAddress, 0);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::isE2EDuplicate(uint8_t source, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_E2E_DUP_TABLE_SIZE; i++)
+    {
+	if (_e2eSeenSource[i] == source)
+	{
+	    if (_e2eSeenId[i] == id)
+	    {
+		_e2eDuplicates++;
+		return true;
+	    }
+	    _e2eSeenId[i] = id;
+	    return false;
+	}
+    }
+    // New source: replace the oldest entry
+    _e2eSeenSource[_e2eSeenNext] = source;
+    _e2eSeenId[_e2eSeenNext] = id;
+    _e2eSeenNext = (_e2eSeenNext + 1) % RH_ROUTER_E2E_DUP_TABLE_SIZE;
+    return false;
 }
 
 ////////////////////////////////////////////////////////////////////
 // Waits for delivery to the next hop (but not for delivery to the final destination)
 uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags)
 {
-    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
+    return sendtoFromSourceWait(buf, len, dest, source, flags, _lastE2ESequenceNumber++);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags, uint8_t id, uint8_t hops)
+{
+    if (len > RH_ROUTER_MAX_MESSAGE_LEN)
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
     // Construct a RH RouterMessage message
     _tmpMessage.header.source = source;
     _tmpMessage.header.dest = dest;
+    _tmpMessage.header.hops = hops;
+    _tmpMessage.header.id = id;
+    _tmpMessage.header.flags = flags;
+    if (buf != _tmpMessage.data)
+	memcpy(_tmpMessage.data, buf, len); // Else handleControlMessage() has built it in place
+
+    return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendtoViaWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t next_hop, uint8_t iface)
+{
+    if (len > RH_ROUTER_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    _tmpMessage.header.source = _thisAddress;
+    _tmpMessage.header.dest = dest;
     _tmpMessage.header.hops = 0;
     _tmpMessage.header.id = _lastE2ESequenceNumber++;
-    _tmpMessage.header.flags = flags;
-    memcpy(_tmpMessage.data, buf, len);
+    _tmpMessage.header.flags = 0;
+    if (buf != _tmpMessage.data)
+	memcpy(_tmpMessage.data, buf, len);
 
+    if (   iface < _interfaceCount
+	&& sizeof(RoutedMessageHeader)+len <= _interfaces[iface]->maxMessageLength()
+	&& _interfaces[iface]->sendtoWait((uint8_t*)&_tmpMessage, sizeof(RoutedMessageHeader)+len, next_hop))
+	return RH_ROUTER_ERROR_NONE;
     return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
 }
 
 ////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::route(RoutedMessage* message, uint8_t messageLen)
 {
+    uint8_t i;
+    if (message->header.dest == RH_BROADCAST_ADDRESS)
+    {
+	// Broadcast it once through every interface it fits
+	uint8_t ret = RH_ROUTER_ERROR_INVALID_LENGTH;
+	for (i = 0; i < _interfaceCount; i++)
+	{
+	    if (messageLen > _interfaces[i]->maxMessageLength())
+		continue;
+	    if (_interfaces[i]->sendtoWait((uint8_t*)message, messageLen, RH_BROADCAST_ADDRESS))
+		ret = RH_ROUTER_ERROR_NONE;
+	    else if (ret != RH_ROUTER_ERROR_NONE)
+		ret = RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+	}
+	return ret;
+    }
+
+    uint8_t next_hop = pathNextHop(message, messageLen);
+    if (next_hop != RH_BROADCAST_ADDRESS)
+    {
+	// The message carries its own route
+	i = routeInterface(next_hop);
+	if (messageLen > _interfaces[i]->maxMessageLength())
+	    return RH_ROUTER_ERROR_INVALID_LENGTH;
+	if (_interfaces[i]->sendtoWait((uint8_t*)message, messageLen, next_hop))
+	    return RH_ROUTER_ERROR_NONE;
+	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+    }
+
     // Reliably deliver it if possible. See if we have a route:
-    uint8_t next_hop = RH_BROADCAST_ADDRESS;
-    if (message->header.dest != RH_BROADCAST_ADDRESS)
+    RoutingTableEntry* route = getRouteTo(message->header.dest);
+    if (!route)
+	return RH_ROUTER_ERROR_NO_ROUTE;
+    do
     {
-	RoutingTableEntry* route = getRouteTo(message->header.dest);
-	if (!route)
+	i = route->iface;
+	if (i >= _interfaceCount)
 	    return RH_ROUTER_ERROR_NO_ROUTE;
-	next_hop = route->next_hop;
+	if (messageLen > _interfaces[i]->maxMessageLength())
+	    return RH_ROUTER_ERROR_INVALID_LENGTH;
+	if (_interfaces[i]->sendtoWait((uint8_t*)message, messageLen, route->next_hop))
+	{
+	    confirmRoute(message->header.dest);
+	    return RH_ROUTER_ERROR_NONE;
+	}
+	// Try the next best next hop, if there is one
+    } while ((route = failoverRoute(message->header.dest)));
+    return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override this to route messages that carry their own route
+uint8_t RHRouter::pathNextHop(RoutedMessage* message, uint8_t messageLen)
+{
+    // Default uses the routing table
+    return RH_BROADCAST_ADDRESS;
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override this to repair routes
+void RHRouter::routeFailed(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface)
+{
+    // Default does nothing
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::acceptMessage(uint8_t* buf, uint8_t len, uint8_t from, uint8_t to, uint8_t id)
+{
+#if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+    RoutedMessageHeader* header = (RoutedMessageHeader*)buf;
+    if (   len >= sizeof(RoutedMessageHeader)
+	&& header->dest != _thisAddress
+	&& header->dest != RH_BROADCAST_ADDRESS)
+    {
+	// HOPS will have been counted by the time it is forwarded
+	header->hops++;
+	uint8_t iface = forwardInterface((RoutedMessage*)buf, len);
+	header->hops--;
+	if (_forwardQueues[iface].count >= RH_ROUTER_FORWARD_QUEUE_SIZE)
+	{
+	    // It would have to be forwarded, but there is no room for it
+	    _forwardQueueDropped++;
+	    return false;
+	}
     }
+#endif
+    if (   _e2eWaitDest != RH_BROADCAST_ADDRESS
+	&& len >= sizeof(RoutedMessageHeader)
+	&& ((RoutedMessageHeader*)buf)->dest == _thisAddress
+	&& !(((RoutedMessageHeader*)buf)->flags & RH_ROUTER_FLAGS_E2E_ACK)
+	&& !isControlMessage((RoutedMessage*)buf, len))
+    {
+	// sendtoWait() is waiting for an end-to-end acknowledgement, and can only keep one message for us
+	if (_e2eHeldLen)
+	    return false;
+#if RH_ROUTER_E2E_HOLD_LEN < RH_MAX_MESSAGE_LEN
+	if (len > RH_ROUTER_E2E_HOLD_LEN)
+	    return false;
+#endif
+    }
+    return true;
+}
 
-    if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop))
-	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+////////////////////////////////////////////////////////////////////
+void RHRouter::forward(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface)
+{
+#if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+ #if RH_ROUTER_FORWARD_QUEUE_MSG_LEN < RH_MAX_MESSAGE_LEN
+    if (messageLen > RH_ROUTER_FORWARD_QUEUE_MSG_LEN)
+    {
+	// Too long for the queue
+	route(message, messageLen);
+	return;
+    }
+ #endif
+    // Queue it for the interface it will go out through
+    ForwardQueue* queue = &_forwardQueues[forwardInterface(message, messageLen)];
+    if (queue->count >= RH_ROUTER_FORWARD_QUEUE_SIZE)
+    {
+	_forwardQueueDropped++;
+	return;
+    }
+    ForwardedMessage* queued = &queue->messages[(queue->head + queue->count) % RH_ROUTER_FORWARD_QUEUE_SIZE];
+    queued->len = messageLen;
+    queued->from = from;
+    queued->iface = iface;
+    memcpy(queued->data, message, messageLen);
+    queue->count++;
+    serviceForwardQueue();
+#else
+    route(message, messageLen);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::serviceForwardQueue()
+{
+#if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+    uint8_t i;
+    for (i = 0; i < _interfaceCount; i++)
+    {
+	ForwardQueue* queue = &_forwardQueues[i];
+	while (queue->count)
+	{
+	    ForwardedMessage* queued = &queue->messages[queue->head];
+	    RoutedMessage* message = (RoutedMessage*)queued->data;
+	    RoutingTableEntry* route;
+	    if (queue->handle == RH_ASYNC_INVALID_HANDLE)
+	    {
+		// Start sending the oldest message to the next hop. 
+		// Normally through this interface, but the route may have changed since it was queued
+		uint8_t next_hop = pathNextHop(message, queued->len);
+		if (next_hop != RH_BROADCAST_ADDRESS)
+		{
+		    // The message carries its own route
+		    queue->sentVia = routeInterface(next_hop);
+		    if (queued->len > _interfaces[queue->sentVia]->maxMessageLength())
+		    {
+			_forwardQueueDropped++;
+		    }
+		    else
+		    {
+			queue->handle = _interfaces[queue->sentVia]->sendtoAsync(queued->data, queued->len, next_hop);
+			if (queue->handle == RH_ASYNC_INVALID_HANDLE)
+			    break; // No room to send it yet. Try again later
+		    }
+		}
+		else if (!(route = getRouteTo(message->header.dest)) || route->iface >= _interfaceCount)
+		{
+		    routeFailed(message, queued->len, queued->from, queued->iface);
+		}
+		else if (queued->len > _interfaces[route->iface]->maxMessageLength())
+		{
+		    // Too long for the interface. Not the fault of the route
+		    _forwardQueueDropped++;
+		}
+		else
+		{
+		    queue->sentVia = route->iface;
+		    queue->handle = _interfaces[queue->sentVia]->sendtoAsync(queued->data, queued->len, route->next_hop);
+		    if (queue->handle == RH_ASYNC_INVALID_HANDLE)
+			break; // No room to send it yet. Try again later
+		}
+	    }
+	    else
+	    {
+		_interfaces[queue->sentVia]->service();
+		uint8_t status = _interfaces[queue->sentVia]->asyncStatus(queue->handle);
+		if (status == RH_ASYNC_STATUS_PENDING)
+		    break;
+		queue->handle = RH_ASYNC_INVALID_HANDLE;
+		bool tableRouted = pathNextHop(message, queued->len) == RH_BROADCAST_ADDRESS;
+		if (status == RH_ASYNC_STATUS_DELIVERED)
+		{
+		    if (tableRouted)
+			confirmRoute(message->header.dest);
+		}
+		else
+		{
+		    // Try the next best next hop, if there is one
+		    if (tableRouted && failoverRoute(message->header.dest))
+			continue;
+		    routeFailed(message, queued->len, queued->from, queued->iface);
+		}
+	    }
+	    if (queue->handle == RH_ASYNC_INVALID_HANDLE)
+	    {
+		// Finished with this one
+		queue->head = (queue->head + 1) % RH_ROUTER_FORWARD_QUEUE_SIZE;
+		queue->count--;
+	    }
+	    else
+		break; // In flight
+	}
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::forwardQueueLength()
+{
+#if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+    uint8_t count = 0;
+    uint8_t i;
+    for (i = 0; i < _interfaceCount; i++)
+	count += _forwardQueues[i].count;
+    return count;
+#else
+    return 0;
+#endif
+}
 
-    return RH_ROUTER_ERROR_NONE;
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::forwardQueueDropped()
+{
+    return _forwardQueueDropped;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::waitAvailableTimeout(uint16_t timeout)
+{
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	serviceForwardQueue();
+	uint8_t i;
+	for (i = 1; i < _interfaceCount; i++)
+	    if (_interfaces[i]->available())
+		return true;
+	if (!forwardQueueLength() && _interfaceCount == 1)
+	    return RHReliableDatagram::waitAvailableTimeout(timeLeft);
+	// Wake up often enough to notice the end of transmissions and retransmission timeouts, 
+	// and messages on the other interfaces
+	if (RHReliableDatagram::waitAvailableTimeout(timeLeft < RH_ROUTER_FORWARD_POLL ? timeLeft : RH_ROUTER_FORWARD_POLL))
+	    return true;
+	YIELD;
+    }
+    return false;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -200,16 +1044,48 @@ void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
     // Default does nothing
 }
 
+////////////////////////////////////////////////////////////////////
+// Subclasses with their own routing protocol messages override this
+bool RHRouter::isControlMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::handleControlMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    // Default does nothing
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
 {  
+    serviceForwardQueue();
+
     uint8_t tmpMessageLen = sizeof(_tmpMessage);
     uint8_t _from;
     uint8_t _to;
     uint8_t _id;
     uint8_t _flags;
-    if (RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
+    if (_e2eHeldLen && _e2eWaitDest == RH_BROADCAST_ADDRESS)
     {
+	// Deliver the message that arrived while sendtoWait() was waiting for an end-to-end acknowledgement
+	tmpMessageLen = _e2eHeldLen;
+	_e2eHeldLen = 0;
+	memcpy(&_tmpMessage, _e2eHeld, tmpMessageLen);
+	return deliverMessage(tmpMessageLen, buf, len, source, dest, id, flags);
+    }
+    uint8_t rxInterface;
+    for (rxInterface = 0; rxInterface < _interfaceCount; rxInterface++)
+    {
+	tmpMessageLen = sizeof(_tmpMessage);
+	if (_interfaces[rxInterface]->recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
+	    break;
+    }
+    if (rxInterface < _interfaceCount)
+    {
+	_rxFrom = _from;
+	_rxInterface = rxInterface;
 	// Here we simulate networks with limited visibility between nodes
 	// so we can test routing
 #ifdef RH_TEST_NETWORK
@@ -259,34 +1135,100 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 	}
 #endif
 
+	if (   tmpMessageLen >= sizeof(RoutedMessageHeader)
+	    && (_tmpMessage.header.flags & RH_ROUTER_FLAGS_E2E_ACK))
+	{
+	    // End-to-end acknowledgements are not shown to peekAtMessage(), and not delivered
+	    if (_tmpMessage.header.dest == _thisAddress)
+	    {
+		if (   _tmpMessage.header.source == _e2eWaitDest
+		    && _tmpMessage.header.id == _e2eWaitId)
+		    _e2eAcked = true;
+	    }
+	    else if (_tmpMessage.header.hops++ < _max_hops)
+		forward(&_tmpMessage, tmpMessageLen, _from, rxInterface);
+	    return false;
+	}
+
+	if (   (_tmpMessage.header.flags & RH_ROUTER_FLAGS_E2E_ACK_REQUEST)
+	    && _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
+	    && !getRouteTo(_tmpMessage.header.source))
+	{
+	    // The end-to-end acknowledgement will need a route back. Use the way the message came
+	    addRouteTo(_tmpMessage.header.source, _from, Valid, 0, rxInterface);
+	}
+
 	peekAtMessage(&_tmpMessage, tmpMessageLen);
 	// See if its for us or has to be routed
 	if (_tmpMessage.header.dest == _thisAddress || _tmpMessage.header.dest == RH_BROADCAST_ADDRESS)
 	{
-	    // Deliver it here
-	    if (source) *source  = _tmpMessage.header.source;
-	    if (dest)   *dest    = _tmpMessage.header.dest;
-	    if (id)     *id      = _tmpMessage.header.id;
-	    if (flags)  *flags   = _tmpMessage.header.flags;
-	    uint8_t msgLen = tmpMessageLen - sizeof(RoutedMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, _tmpMessage.data, *len);
-	    return true; // Its for you!
+	    if (isControlMessage(&_tmpMessage, tmpMessageLen))
+	    {
+		// For the routing protocol, not the application. Handle it now, even if sendtoWait() is waiting
+		handleControlMessage(&_tmpMessage, tmpMessageLen);
+		return false;
+	    }
+	    bool waiting = _e2eWaitDest != RH_BROADCAST_ADDRESS;
+	    if (waiting)
+	    {
+		// sendtoWait() is waiting for an end-to-end acknowledgement, and can keep only one message 
+		// for later. acceptMessage() refuses unicasts that would not fit
+		if (_e2eHeldLen)
+		    return false;
+#if RH_ROUTER_E2E_HOLD_LEN < RH_MAX_MESSAGE_LEN
+		if (tmpMessageLen > RH_ROUTER_E2E_HOLD_LEN)
+		    return false;
+#endif
+	    }
+	    uint8_t e2eSource = _tmpMessage.header.source;
+	    uint8_t e2eId = _tmpMessage.header.id;
+	    bool e2eAck =    _tmpMessage.header.dest == _thisAddress
+		          && (_tmpMessage.header.flags & RH_ROUTER_FLAGS_E2E_ACK_REQUEST);
+	    if (e2eAck && isE2EDuplicate(e2eSource, e2eId))
+	    {
+		// Acknowledge it again, in case the last acknowledgement was lost
+		sendE2EAck(e2eSource, e2eId);
+		return false;
+	    }
+	    bool delivered = false;
+	    if (waiting)
+	    {
+		memcpy(_e2eHeld, &_tmpMessage, tmpMessageLen);
+		_e2eHeldLen = tmpMessageLen;
+	    }
+	    else
+		delivered = deliverMessage(tmpMessageLen, buf, len, source, dest, id, flags); // Its for you!
+	    // Only now, because sending the acknowledgement may use _tmpMessage
+	    if (e2eAck)
+		sendE2EAck(e2eSource, e2eId);
+	    return delivered;
 	}
 	else if (   _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
 		 && _tmpMessage.header.hops++ < _max_hops)
 	{
-	    // Maybe it has to be routed to the next hop
-	    // REVISIT: if it fails due to no route or unable to deliver to the next hop, 
-	    // tell the originator. BUT HOW?
-	    route(&_tmpMessage, tmpMessageLen);
+	    // Maybe it has to be routed to the next hop.
+	    // If it cannot be delivered, routeFailed() is called
+	    forward(&_tmpMessage, tmpMessageLen, _from, rxInterface);
 	}
 	// Discard it and maybe wait for another
     }
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHRouter::deliverMessage(uint8_t messageLen, uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+{
+    if (source) *source  = _tmpMessage.header.source;
+    if (dest)   *dest    = _tmpMessage.header.dest;
+    if (id)     *id      = _tmpMessage.header.id;
+    if (flags)  *flags   = _tmpMessage.header.flags & ~RH_ROUTER_FLAGS_RESERVED;
+    uint8_t msgLen = messageLen - sizeof(RoutedMessageHeader);
+    if (*len > msgLen)
+	*len = msgLen;
+    memcpy(buf, _tmpMessage.data, *len);
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////
 bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
 {  
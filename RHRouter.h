@@ -13,7 +13,103 @@
 #define RH_DEFAULT_MAX_HOPS 30
 
 // The default size of the routing table we keep
+#ifndef RH_ROUTING_TABLE_SIZE
 #define RH_ROUTING_TABLE_SIZE 10
+#endif
+
+// If 1, the routing table is indexed directly by the destination address, and can only hold 
+// routes to destinations with addresses less than RH_ROUTING_TABLE_SIZE.
+// If 0 (the default), it is a hash table that can hold up to RH_ROUTING_TABLE_SIZE routes to any destinations.
+#ifndef RH_ROUTING_TABLE_DENSE
+#define RH_ROUTING_TABLE_DENSE 0
+#endif
+
+// The number of entries in the routing table array. In a hash table, some are always kept free 
+// so that searches stay short
+#if RH_ROUTING_TABLE_DENSE
+#define RH_ROUTING_TABLE_SLOTS RH_ROUTING_TABLE_SIZE
+#else
+#define RH_ROUTING_TABLE_SLOTS (RH_ROUTING_TABLE_SIZE + RH_ROUTING_TABLE_SIZE / 4 + 1)
+#endif
+#if RH_ROUTING_TABLE_SLOTS > 255
+#error RH_ROUTING_TABLE_SIZE is too big
+#endif
+
+// The default time in milliseconds after which a route that has not been used expires.
+// 0 means routes never expire
+#ifndef RH_ROUTER_ROUTE_TIMEOUT
+#define RH_ROUTER_ROUTE_TIMEOUT 0
+#endif
+
+// The number of messages a relay can hold in its forwarding queue while it sends them on to their next hops. 
+// 0 forwards messages synchronously inside recvfromAck(), as earlier versions did
+#ifndef RH_ROUTER_FORWARD_QUEUE_SIZE
+ #if defined(__AVR__)
+  #define RH_ROUTER_FORWARD_QUEUE_SIZE 2
+ #else
+  #define RH_ROUTER_FORWARD_QUEUE_SIZE 8
+ #endif
+#endif
+
+// The maximum length of a message (including the RHRouter header) that can be kept in the forwarding queue. 
+// Longer messages are forwarded synchronously
+#ifndef RH_ROUTER_FORWARD_QUEUE_MSG_LEN
+ #if defined(__AVR__)
+  #define RH_ROUTER_FORWARD_QUEUE_MSG_LEN 64
+ #else
+  #define RH_ROUTER_FORWARD_QUEUE_MSG_LEN RH_MAX_MESSAGE_LEN
+ #endif
+#endif
+
+// While there are messages in the forwarding queue, waitAvailableTimeout() services it at least this often (milliseconds)
+#ifndef RH_ROUTER_FORWARD_POLL
+#define RH_ROUTER_FORWARD_POLL 5
+#endif
+
+// The maximum number of interfaces (drivers) an RHRouter can route between, including the one it was constructed with.
+// Each has its own forwarding queue, so only define it larger if you will call addInterface()
+#ifndef RH_ROUTER_MAX_INTERFACES
+#define RH_ROUTER_MAX_INTERFACES 1
+#endif
+
+// The number of alternate next hops kept for each route, to try if the next hop fails. 
+// 0 disables failover
+#ifndef RH_ROUTER_ALTERNATE_HOPS
+#define RH_ROUTER_ALTERNATE_HOPS 2
+#endif
+
+// The number of hops assumed to a destination whose route has no metric, when computing how long 
+// sendtoWait() waits for an end-to-end acknowledgement
+#ifndef RH_ROUTER_E2E_DEFAULT_HOPS
+#define RH_ROUTER_E2E_DEFAULT_HOPS 3
+#endif
+
+// The number of originators whose last end-to-end acknowledged message ID is remembered, 
+// to detect end-to-end retransmissions
+#ifndef RH_ROUTER_E2E_DUP_TABLE_SIZE
+#define RH_ROUTER_E2E_DUP_TABLE_SIZE 4
+#endif
+
+// The maximum length of a message (including the RHRouter header) for this node that can be kept 
+// while sendtoWait() waits for an end-to-end acknowledgement. Longer ones are not acknowledged to 
+// the previous hop, which will retransmit them later
+#ifndef RH_ROUTER_E2E_HOLD_LEN
+#define RH_ROUTER_E2E_HOLD_LEN 64
+#endif
+
+// The version of the format of the routing table snapshots made by saveRoutingTable(). 
+// restoreRoutingTable() ignores snapshots with a different version
+#define RH_ROUTER_SNAPSHOT_VERSION 1
+
+// The maximum length of a routing table snapshot: a header of VERSION, ADDRESS and COUNT, 
+// 4 octets for each route and a 2 octet CRC
+#define RH_ROUTER_SNAPSHOT_LEN (3 + 4 * RH_ROUTING_TABLE_SIZE + 2)
+
+// Bits in the FLAGS field of the RHRouter header used by RHRouter itself. 
+// The others are available to subclasses and applications
+#define RH_ROUTER_FLAGS_RESERVED          0xc0
+#define RH_ROUTER_FLAGS_E2E_ACK_REQUEST   0x80
+#define RH_ROUTER_FLAGS_E2E_ACK           0x40
 
 // Error codes
 #define RH_ROUTER_ERROR_NONE              0
@@ -23,10 +119,14 @@
 #define RH_ROUTER_ERROR_NO_REPLY          4
 #define RH_ROUTER_ERROR_UNABLE_TO_DELIVER 5
 
+// The maximum length of the application data in an RHRouter message. Each RHRouter (and RHMesh) 
+// instance has message buffers of this size.
 // This size of RH_ROUTER_MAX_MESSAGE_LEN is OK for Arduino Mega, but too big for
 // Duemilanova. Size of 50 works with the sample router programs on Duemilanova.
+#ifndef RH_ROUTER_MAX_MESSAGE_LEN
 #define RH_ROUTER_MAX_MESSAGE_LEN (RH_MAX_MESSAGE_LEN - sizeof(RHRouter::RoutedMessageHeader))
 //#define RH_ROUTER_MAX_MESSAGE_LEN 50
+#endif
 
 // These allow us to define a simulated network topology for testing purposes
 // See RHRouter.cpp for details
@@ -70,9 +170,9 @@
 /// call recvfromAck() or recvfromAckTimeout() frequently in your main loop. recvfromAck() will return 
 /// false if it receives a message but it is not for this node.
 ///
-/// RHRouter does not provide reliable end-to-end delivery, but uses reliable hop-to-hop delivery. 
+/// By default, RHRouter does not provide reliable end-to-end delivery, but uses reliable hop-to-hop delivery. 
 /// If a message is unable to be delivered to an end node during to a delivery failure between 2 hops, 
-/// the source node will not be told about it.
+/// the source node will not be told about it. See End-to-end Acknowledgements below if you need to know.
 ///
 /// Note: This class is most useful for networks of nodes that are essentially static 
 /// (i.e. the nodes dont move around), and for which the 
@@ -90,10 +190,115 @@
 /// You can also use addRouteTo() to change a route and 
 /// deleteRouteTo() to delete a route at run time. Youcan also clear the entire routing table
 ///
-/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10)
-/// if more than RH_ROUTING_TABLE_SIZE are added, the oldest (first) one will be removed by calling 
+/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10 by default)
+/// if more than RH_ROUTING_TABLE_SIZE are added, the least recently used one will be removed by calling 
 /// retireOldestRoute()
 ///
+/// A route is used when it is added, updated or looked up with getRouteTo() (which happens 
+/// for every message sent or forwarded). The routes are kept on a list in the order they were last used, 
+/// so the least recently used route can be found at once. If you call setRouteTimeout(), routes that 
+/// have not been used for that long expire, and are deleted the next time they are looked up, 
+/// or when a new route is added. This includes routes you added yourself, so a node with a fixed
+/// routing table should leave the timeout at 0 (never expire).
+/// routeHits(), routeMisses(), routeEvictions() and routeExpiries() tell you how well the routing table 
+/// suits your network.
+///
+/// Each route can have a metric, which is its cost (lower is better). RHMesh uses the number of hops 
+/// to the destination. A route can also keep up to RH_ROUTER_ALTERNATE_HOPS alternate next hops, 
+/// with their metrics, best first. When a route to a destination is added with a metric, 
+/// and there is already a route to it via a different next hop with a known metric, 
+/// the better of the two becomes the route and the other becomes an alternate. 
+/// Adding a route with no metric (0) simply replaces the next hop, as earlier versions did.
+/// If the next hop does not acknowledge a message, route() drops it and immediately tries 
+/// the best alternate, and so on until there are no more, before returning RH_ROUTER_ERROR_UNABLE_TO_DELIVER.
+/// routeFailovers() counts how often this happens.
+///
+/// Routes are looked up for every message sent or forwarded, and in a large network a table that is too 
+/// small will be constantly losing routes that are still needed (which RHMesh then has to rediscover
+/// with a broadcast flood), so you should define RH_ROUTING_TABLE_SIZE to suit your network. 
+/// By default, the table is a hash table (with open addressing and linear probing) 
+/// which holds up to RH_ROUTING_TABLE_SIZE routes to any destinations in 
+/// RH_ROUTING_TABLE_SLOTS entries, and finds, adds and deletes routes in constant time.
+/// On 8 bit processors each entry costs 15 octets plus 2 for each of the RH_ROUTER_ALTERNATE_HOPS 
+/// alternate next hops: 19 octets by default, so the default table of 13 slots takes 247 octets of RAM.
+/// Define RH_ROUTER_ALTERNATE_HOPS to 0 to save 4 octets per entry if you do not need failover.
+/// If your node addresses are all small numbers, you can define RH_ROUTING_TABLE_DENSE to 1, and 
+/// the table is indexed directly by destination address instead. It then has an entry for every 
+/// address less than RH_ROUTING_TABLE_SIZE (so define that as the highest address in your network plus one), 
+/// and routes to higher addresses (including RH_BROADCAST_ADDRESS) are not kept: addRouteTo() returns false for them, 
+/// and messages to them fail with RH_ROUTER_ERROR_NO_ROUTE unless they carry their own route.
+///
+/// \par Forwarding
+///
+/// A message received for another node is forwarded to the next hop towards its destination. 
+/// Earlier versions did this inside recvfromAck(), which blocked until the next hop acknowledged 
+/// or the retries ran out, and meanwhile the relay could neither receive nor acknowledge anything else.
+/// Now the message is copied into a forwarding queue of RH_ROUTER_FORWARD_QUEUE_SIZE messages (one for each interface), 
+/// and sent with RHReliableDatagram::sendtoAsync(), one at a time, by serviceForwardQueue(). 
+/// This is called by recvfromAck(), recvfromAckTimeout() and waitAvailableTimeout(), so a relay that 
+/// calls these in its loop keeps receiving and acknowledging while the queue drains.
+/// If the next hop fails, any alternate next hops are tried (see below), and if they fail too, routeFailed() 
+/// is called, which lets RHMesh report the failure to the originator.
+/// While the queue is full, messages to be forwarded are not acknowledged (so the previous hop will retransmit them 
+/// later), and are counted by forwardQueueDropped(). 
+/// Messages longer than RH_ROUTER_FORWARD_QUEUE_MSG_LEN are forwarded synchronously as before.
+/// Defining RH_ROUTER_FORWARD_QUEUE_SIZE to 0 disables the queue and saves its memory.
+/// Subclasses can forward messages that carry their own route without looking in the routing table, 
+/// by overriding pathNextHop() (RHMesh does this for source routing).
+///
+/// \par End-to-end Acknowledgements
+///
+/// If sendtoWait() is called with RH_ROUTER_FLAGS_E2E_ACK_REQUEST in flags, the destination 
+/// acknowledges the message as soon as it receives it, with an RHRouter header and no data 
+/// (with RH_ROUTER_FLAGS_E2E_ACK in FLAGS, and the ID of the message), routed back to the source. 
+/// sendtoWait() waits for this acknowledgement, and if it does not arrive, sends the message again with the same ID,
+/// up to the number of retries set by setRetries(). The first wait is twice the acknowledgement timeout 
+/// of the next hop for every hop to the destination (the metric of the route, or RH_ROUTER_E2E_DEFAULT_HOPS if 
+/// it has none), and it doubles for each retry. The destination remembers the ID of the last such message from
+/// each of RH_ROUTER_E2E_DUP_TABLE_SIZE sources, and acknowledges repeated messages again without 
+/// delivering them. e2eRetransmissions() and e2eDuplicates() count these. 
+/// Messages for this node that arrive while sendtoWait() is waiting are kept (one at a time, up to 
+/// RH_ROUTER_E2E_HOLD_LEN octets long) and returned by the next call to recvfromAck(). Others are 
+/// not acknowledged to the previous hop, which will retransmit them later. Messages of the routing protocol 
+/// of a subclass (see isControlMessage()), such as RHMesh route discovery requests, are handled at once.
+/// The acknowledgement needs a route back to the source, so the destination, and every node that 
+/// forwards the message, adds a route to the source via the node the message came from if it has none.
+///
+/// \par Interfaces
+///
+/// An RHRouter normally sends and receives through the driver it was constructed with, but it can also 
+/// route between several drivers, for example in a gateway with a long range radio, a short range radio 
+/// and an RH_Serial link to a host. Each other driver needs its own RHReliableDatagram, which you pass to 
+/// addInterface(). Up to RH_ROUTER_MAX_INTERFACES interfaces are possible, numbered in the order they 
+/// were added, and interface 0 is the router's own driver. RH_ROUTER_MAX_INTERFACES defaults to 1, 
+/// so you must define it to the number of interfaces you need when you compile the library. Each route records the interface its next hop 
+/// is reached through (see addRouteTo()), and its alternate next hops are on the same interface.
+/// recvfromAck() receives from all the interfaces, and messages for other nodes are forwarded through 
+/// the interface of their route, so a gateway needs no application code to bridge its radios.
+/// Each interface has its own forwarding queue, so a slow interface does not hold up the others, 
+/// and a message that is longer than the maximum message length of the interface it has to go through 
+/// is not sent (route() returns RH_ROUTER_ERROR_INVALID_LENGTH). 
+/// Broadcasts are sent through every interface.
+/// All the interfaces have the address of the router.
+///
+/// \par Saving the Routing Table
+///
+/// After a reset or a brownout, a node starts with an empty routing table, and (in an RHMesh network)
+/// has to rediscover every route with a broadcast flood, all at once if many nodes restart together.
+/// saveRoutingTable() makes a compact snapshot of the routing table (RH_ROUTER_SNAPSHOT_LEN octets at most: 
+/// a version stamp, the address of this node, and the destination, next hop, metric and interface of each route, 
+/// with a CRC), and restoreRoutingTable() adds the routes in a snapshot to the routing table. 
+/// On AVR, saveRoutingTableToEEPROM() and restoreRoutingTableFromEEPROM() keep the snapshot in EEPROM, and on Linux, 
+/// saveRoutingTableToFile() and restoreRoutingTableFromFile() keep it in a file. On other platforms, you 
+/// can keep the snapshot wherever suits, such as in flash. Saving it now and then (not for every change: EEPROM 
+/// and flash wear out) is enough.
+/// The network may have changed while the node was down, so restored routes are not trusted blindly: they have the 
+/// state Stale, and are used as usual, but become Valid only when a message has been successfully sent to their next hop, 
+/// or when the route is learned again. If their next hop does not acknowledge, they fail like any other route
+/// (and RHMesh deletes them and discovers a new route), and a route learned with addRouteTo() replaces a stale route 
+/// whatever its metric.
+/// A snapshot is ignored if it has a different version, or was made by a node with a different address, or is corrupt.
+///
 /// \par Message Format
 ///
 /// RHRouter add to the lower level RHReliableDatagram (and even lower level RH) class message formats. 
@@ -108,7 +313,8 @@
 /// - 1 octet HOPS, the number of hops this message has traversed so far.
 /// - 1 octet ID, an incrementing message ID for end-to-end message tracking for use by subclasses. 
 ///   Not used by RHRouter.
-/// - 1 octet FLAGS, a bitmask for use by subclasses. Not used by RHRouter.
+/// - 1 octet FLAGS, a bitmask for use by subclasses. RHRouter uses the bits in RH_ROUTER_FLAGS_RESERVED
+///   for end-to-end acknowledgements.
 /// - 0 or more octets DATA, the application payload data. The length of this data is implicit 
 ///   in the length of the entire message.
 ///
@@ -156,7 +362,8 @@ public:
     {
 	Invalid = 0,           ///< No valid route is known
 	Discovering,           ///< Discovering a route (not currently used)
-	Valid                  ///< Route is valid
+	Valid,                 ///< Route is valid
+	Stale                  ///< Route was restored by restoreRoutingTable() and has not been used successfully since
     } RouteState;
 
     /// Defines an entry in the routing table
@@ -165,6 +372,16 @@ public:
 	uint8_t      dest;      ///< Destination node address
 	uint8_t      next_hop;  ///< Send via this next hop address
 	uint8_t      state;     ///< State of this route, one of RouteState
+	uint8_t      older;     ///< Index of the route used next less recently, used internally
+	uint8_t      newer;     ///< Index of the route used next more recently, used internally
+	uint8_t      metric;    ///< Cost of the route, such as the number of hops. Lower is better. 0 if not known
+	uint8_t      iface;     ///< The interface next_hop is reached through. 0 is the router's own driver
+#if RH_ROUTER_ALTERNATE_HOPS
+	uint8_t      alternate[RH_ROUTER_ALTERNATE_HOPS];       ///< Other next hops, best first. RH_BROADCAST_ADDRESS if unused
+	uint8_t      alternateMetric[RH_ROUTER_ALTERNATE_HOPS]; ///< Cost of the route via each alternate next hop
+#endif
+	unsigned long added;    ///< Value of millis() when this route was added
+	unsigned long lastUsed; ///< Value of millis() when this route was last used
     } RoutingTableEntry;
 
     /// Constructor. 
@@ -185,11 +402,22 @@ public:
     void setMaxHops(uint8_t max_hops);
 
     /// Adds a route to the local routing table, or updates it if already present.
-    /// If there is not enough room the oldest (first) route will be deleted by calling retireOldestRoute().
-    /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted.
+    /// If there is not enough room an old route will be deleted by calling retireOldestRoute().
+    /// Adding a route with a state of Invalid deletes any route to dest.
+    /// If RH_ROUTING_TABLE_DENSE is 1, there is no room for routes to addresses of RH_ROUTING_TABLE_SIZE 
+    /// or more, so they are not added and this returns false.
+    /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted, but only kept
+    /// in the hash table (route() always broadcasts to every interface, so such a route is never used).
     /// \param [in] next_hop The address of the next hop to send messages destined for dest
     /// \param [in] state The satte of the route. Defaults to Valid
-    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid);
+    /// \param [in] metric The cost of the route via next_hop, such as the number of hops. 
+    /// If 0 (the default), next_hop replaces any next hop already in the route. Otherwise, it 
+    /// replaces it only if it is cheaper, and else becomes an alternate next hop (or is ignored, 
+    /// if it is on a different interface).
+    /// \param [in] iface The interface next_hop is reached through. Defaults to 0, the router's own driver
+    /// \return true if the route is now in the routing table (or was deleted, if state is Invalid), 
+    /// false if there is no room for a route to dest
+    bool addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid, uint8_t metric = 0, uint8_t iface = 0);
 
     /// Finds and returns a RoutingTableEntry for the given destination node
     /// \param [in] dest The desired destination node address.
@@ -201,14 +429,103 @@ public:
     /// \return true if the route was present
     bool deleteRouteTo(uint8_t dest);
 
-    /// Deletes the oldest (first) route from the 
-    /// local routing table
+    /// Deletes the least recently used route from the local routing table
+    /// to make room for a new one.
     void retireOldestRoute();
 
+    /// Sets the time after which a route that has not been used expires.
+    /// Defaults to RH_ROUTER_ROUTE_TIMEOUT.
+    /// \param [in] timeout The time in milliseconds. 0 means routes never expire
+    void setRouteTimeout(unsigned long timeout);
+
+    /// Returns the number of times getRouteTo() found a route
+    /// since starting or since the last call to resetRouteStats().
+    /// \return The number of hits
+    uint32_t routeHits();
+
+    /// Returns the number of times getRouteTo() found no route (including expired routes)
+    /// \return The number of misses
+    uint32_t routeMisses();
+
+    /// Returns the number of routes that were retired by retireOldestRoute() to make room for another
+    /// \return The number of evictions
+    uint32_t routeEvictions();
+
+    /// Returns the number of routes that were deleted because they had expired
+    /// \return The number of expiries
+    uint32_t routeExpiries();
+
+    /// Returns the number of times route() tried an alternate next hop because the next hop failed
+    /// \return The number of failovers
+    uint32_t routeFailovers();
+
+    /// Returns the number of times sendtoWait() sent a message again because the destination 
+    /// did not acknowledge it end-to-end in time
+    /// \return The number of end-to-end retransmissions
+    uint32_t e2eRetransmissions();
+
+    /// Returns the number of end-to-end acknowledged messages received again and not delivered
+    /// \return The number of duplicates
+    uint32_t e2eDuplicates();
+
+    /// Resets the counts returned by routeHits(), routeMisses(), routeEvictions(), routeExpiries(), 
+    /// routeFailovers(), e2eRetransmissions() and e2eDuplicates() to 0.
+    void resetRouteStats();
+
     /// Clears all entries from the 
     /// local routing table
     void clearRoutingTable();
 
+    /// Makes a compact snapshot of the routing table, which restoreRoutingTable() can restore, 
+    /// for example after a reset. Routes that are being discovered are not included.
+    /// \param [out] buf Location to copy the snapshot to
+    /// \param [in] len Available space in buf. RH_ROUTER_SNAPSHOT_LEN is always enough
+    /// \return The length of the snapshot in octets, or 0 if it does not fit in len
+    uint16_t saveRoutingTable(uint8_t* buf, uint16_t len);
+
+    /// Adds the routes in a snapshot made by saveRoutingTable() to the routing table, with the state Stale, 
+    /// in the order they were last used. Routes that are already in the routing table are not changed.
+    /// \param [in] buf The snapshot
+    /// \param [in] len The length of the snapshot in octets
+    /// \return true if the snapshot was valid, false if it has a different RH_ROUTER_SNAPSHOT_VERSION, 
+    /// was made by a node with a different address, or is truncated or corrupt
+    bool restoreRoutingTable(uint8_t* buf, uint16_t len);
+
+#if defined(__AVR__)
+    /// Saves a snapshot of the routing table to EEPROM, with saveRoutingTable(). 
+    /// Only octets that have changed are written.
+    /// \param [in] address The EEPROM address to write the snapshot at. RH_ROUTER_SNAPSHOT_LEN octets are needed
+    void saveRoutingTableToEEPROM(uint16_t address);
+
+    /// Restores the routing table from a snapshot in EEPROM, with restoreRoutingTable()
+    /// \param [in] address The EEPROM address the snapshot was saved at
+    /// \return true if the snapshot was valid
+    bool restoreRoutingTableFromEEPROM(uint16_t address);
+#endif
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+    /// Saves a snapshot of the routing table to a file, with saveRoutingTable(). 
+    /// \param [in] filename The name of the file, which is replaced
+    /// \return true if the snapshot was saved
+    bool saveRoutingTableToFile(const char* filename);
+
+    /// Restores the routing table from a snapshot in a file, with restoreRoutingTable()
+    /// \param [in] filename The name of the file the snapshot was saved in
+    /// \return true if the snapshot was valid
+    bool restoreRoutingTableFromFile(const char* filename);
+#endif
+
+    /// Adds another interface to route messages through.
+    /// The new interface is numbered interfaceCount() before it is added.
+    /// \param [in] manager An RHReliableDatagram for the driver of the interface, which must already be initialised. 
+    /// Its address is set to the address of this node
+    /// \return true if the interface was added, false if there are already RH_ROUTER_MAX_INTERFACES
+    bool addInterface(RHReliableDatagram& manager);
+
+    /// Returns the number of interfaces, including the router's own driver
+    /// \return The number of interfaces
+    uint8_t interfaceCount();
+
     /// If RH_HAVE_SERIAL is defined, this will print out the contents of the local 
     /// routing table using Serial
     void printRoutingTable();
@@ -217,18 +534,24 @@ public:
     /// (the SOURCE address is set to the address of this node, HOPS to 0) and calls 
     /// route() which looks up in the routing table the next hop to deliver to and sends the 
     /// message to the next hop. Waits for an acknowledgement from the next hop 
-    /// (but not from the destination node (if that is different).
+    /// (but not from the destination node (if that is different), unless flags includes 
+    /// RH_ROUTER_FLAGS_E2E_ACK_REQUEST, in which case it also waits for an end-to-end acknowledgement 
+    /// from the destination node, retransmitting the message if necessary.
     /// \param [in] buf The application message data
     /// \param [in] len Number of octets in the application message data. 0 is permitted
     /// \param [in] dest The destination node address
     /// \param [in] flags Optional flags for use by subclasses or application layer, 
     ///             delivered end-to-end to the dest address. The receiver can recover the flags with recvFromAck().
+    ///             The bits in RH_ROUTER_FLAGS_RESERVED are not delivered. 
     /// \return The result code:
     ///         - RH_ROUTER_ERROR_NONE Message was routed and delivered to the next hop 
-    ///           (not necessarily to the final dest address)
+    ///           (not necessarily to the final dest address), or to the dest address if 
+    ///           RH_ROUTER_FLAGS_E2E_ACK_REQUEST was set
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
+    ///         - RH_ROUTER_ERROR_NO_REPLY RH_ROUTER_FLAGS_E2E_ACK_REQUEST was set, and the dest address did not 
+    ///           acknowledge the message end-to-end, even after retries
     uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
 
     /// Similar to sendtoWait() above, but spoofs the source address.
@@ -269,6 +592,26 @@ public:
     /// \return true if a valid message was recvived for this node copied to buf
     bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
+    /// Sends messages waiting in the forwarding queue on towards their destinations, and handles
+    /// acknowledgements and retransmissions for the one in flight. Never blocks waiting for the next hop.
+    /// Called by recvfromAck(), recvfromAckTimeout() and waitAvailableTimeout(), but 
+    /// you can call it yourself if you do not call those often enough.
+    void serviceForwardQueue();
+
+    /// Returns the number of messages in the forwarding queues of all the interfaces, including any in flight
+    /// \return The number of messages. Always 0 if RH_ROUTER_FORWARD_QUEUE_SIZE is 0
+    uint8_t forwardQueueLength();
+
+    /// Returns the number of messages to be forwarded that were refused or dropped because the forwarding queue was full, 
+    /// or because they were too long for the interface they had to go through
+    /// \return The number of messages dropped
+    uint32_t forwardQueueDropped();
+
+    /// Like RHReliableDatagram::waitAvailableTimeout(), but keeps servicing the forwarding queue while waiting
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if a message is available
+    bool waitAvailableTimeout(uint16_t timeout);
+
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. 
@@ -292,6 +635,24 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual void peekAtMessage(RoutedMessage* message, uint8_t messageLen);
 
+    /// Lets subclasses say which messages belong to their routing protocol (such as RHMesh route 
+    /// discovery requests) rather than to the application. Such messages for this node, or broadcast, are 
+    /// passed to handleControlMessage() at once by recvfromAck() instead of being delivered, so they are 
+    /// not held back or refused while sendtoWait() waits for an end-to-end acknowledgement.
+    /// Must not change the message. The default returns false.
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    /// \return true if the message is for the routing protocol
+    virtual bool isControlMessage(RoutedMessage* message, uint8_t messageLen);
+
+    /// Handles a message for which isControlMessage() returned true, after peekAtMessage(). 
+    /// It may be called while sendtoWait() is waiting for an end-to-end acknowledgement, so it must not 
+    /// wait for one itself. The message is in the buffer RHRouter uses for sending, so it is lost 
+    /// if a message is sent. The default does nothing.
+    /// \param [in] message Pointer to the RHRouter message that was received.
+    /// \param [in] messageLen Length of message in octets
+    virtual void handleControlMessage(RoutedMessage* message, uint8_t messageLen);
+
     /// Finds the next-hop route and sends the message via RHReliableDatagram::sendtoWait().
     /// This is virtual, which lets subclasses override or intercept the route() function.
     /// Called by sendtoWait after the message header has been filled in.
@@ -299,30 +660,249 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
+    /// Lets subclasses route messages that carry their own route (such as RHMesh source routed messages)
+    /// without looking in the routing table. Called by route() and serviceForwardQueue() before they look up 
+    /// the route to the destination of a message. The default returns RH_BROADCAST_ADDRESS.
+    /// \param [in] message Pointer to the RHRouter message to be sent or forwarded. HOPS is the number of 
+    /// hops it has already taken
+    /// \param [in] messageLen Length of message in octets
+    /// \return The address of the next hop, or RH_BROADCAST_ADDRESS to use the routing table
+    virtual uint8_t pathNextHop(RoutedMessage* message, uint8_t messageLen);
+
+    /// Returns the maximum message length (including the RHRouter header) that can be sent to a next hop, 
+    /// which is that of the interface of the route to it
+    /// \param [in] next_hop The address of the next hop
+    /// \return The maximum message length in octets
+    uint8_t maxMessageLengthTo(uint8_t next_hop);
+
+    /// Similar to sendtoFromSourceWait() above, but also sets the ID and HOPS of the message, so that a 
+    /// subclass relaying a broadcast can keep the ID given to it by its originator, and count its hops.
+    /// \param [in] buf The application message data.
+    /// \param [in] len Number of octets in the application message data. 0 is permitted.
+    /// \param [in] dest The destination node address.
+    /// \param [in] source The (fake) originating node address.
+    /// \param [in] flags Flags for use by subclasses or application layer
+    /// \param [in] id The ID of the message
+    /// \param [in] hops The HOPS field of the message. Defaults to 0
+    /// \return The result code, as for sendtoFromSourceWait() above
+    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags, uint8_t id, uint8_t hops = 0);
+
     /// Deletes a specific rout entry from therouting table
     /// \param [in] index The 0 based index of the routing table entry to delete
     void deleteRoute(uint8_t index);
 
+    /// Finds the index in the routing table of the entry for a destination, or where it would go
+    /// \param [in] dest The destination node address
+    /// \return The index of the entry for dest if there is one, else the index of the free 
+    /// entry where it would be added. RH_ROUTING_TABLE_SLOTS if dest cannot be kept in the table
+    uint8_t findRoute(uint8_t dest);
+
+    /// Deletes routes that have not been used within the route timeout, 
+    /// starting with the least recently used
+    void expireRoutes();
+
+    /// Called when a message from the forwarding queue could not be delivered to the next hop towards 
+    /// its destination (RHMesh also calls it when route() fails). 
+    /// Subclasses may override to repair routes or report the failure. The default does nothing.
+    /// \param [in] message Pointer to the RHRouter message that could not be delivered
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node the message was received from, or this node if it originated here
+    /// \param [in] iface The interface the message was received through
+    virtual void routeFailed(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface);
+
+    /// Refuses messages to be forwarded while the forwarding queue of their interface is full, 
+    /// and messages for this node that cannot be held while sendtoWait() waits for an end-to-end 
+    /// acknowledgement, so that the previous hop keeps them and tries again later.
+    /// Also called for the messages received through the interfaces added with addInterface()
+    /// \param[in] buf The message
+    /// \param[in] len The length of the message
+    /// \param[in] from The address of the sender of the message
+    /// \param[in] to The address the message was sent to
+    /// \param[in] id The ID of the message
+    /// \return true if the message can be kept
+    virtual bool acceptMessage(uint8_t* buf, uint8_t len, uint8_t from, uint8_t to, uint8_t id);
+
+    /// Queues a received message to be forwarded towards its destination by serviceForwardQueue(), 
+    /// or forwards it synchronously with route() if it is too long for the queue or the queue is disabled
+    /// \param [in] message Pointer to the RHRouter message to forward
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node the message was received from
+    /// \param [in] iface The interface the message was received through
+    void forward(RoutedMessage* message, uint8_t messageLen, uint8_t from, uint8_t iface);
+
+    /// Replaces the next hop of the route to dest with its best alternate next hop, if it has one.
+    /// Called by route() when the next hop fails to acknowledge
+    /// \param [in] dest The destination node address
+    /// \return The route with its new next hop, or NULL if there were no alternates 
+    /// (in which case the route is unchanged)
+    RoutingTableEntry* failoverRoute(uint8_t dest);
+
+    /// Similar to sendtoWait(), but sends the message to the given next hop rather than the one in 
+    /// the routing table, falling back to the routing table if next_hop does not acknowledge.
+    /// Used by RHMesh to send route discovery replies back the way the request came.
+    /// \param [in] buf The application message data.
+    /// \param [in] len Number of octets in the application message data. 0 is permitted.
+    /// \param [in] dest The destination node address.
+    /// \param [in] next_hop The address of the next hop to try first
+    /// \param [in] iface The interface next_hop is reached through
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendtoViaWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t next_hop, uint8_t iface);
+
+    /// Waits for the end-to-end acknowledgement of a message sent with RH_ROUTER_FLAGS_E2E_ACK_REQUEST, 
+    /// receiving and forwarding other messages meanwhile. Messages for this node are kept for the next 
+    /// call to recvfromAck() if there is room.
+    /// \param [in] dest The destination the message was sent to
+    /// \param [in] id The ID in the RHRouter header of the message
+    /// \param [in] timeout Maximum time to wait in milliseconds
+    /// \return true if the acknowledgement was received
+    bool waitE2EAck(uint8_t dest, uint8_t id, uint16_t timeout);
+
+    /// Sends an end-to-end acknowledgement for a received message back to its source, 
+    /// through the forwarding queue
+    /// \param [in] source The source of the message being acknowledged
+    /// \param [in] id The ID in the RHRouter header of the message being acknowledged
+    void sendE2EAck(uint8_t source, uint8_t id);
+
+    /// Checks whether a message with RH_ROUTER_FLAGS_E2E_ACK_REQUEST has been received before, 
+    /// and remembers its ID as the last one from its source
+    /// \param [in] source The source of the message
+    /// \param [in] id The ID in the RHRouter header of the message
+    /// \return true if it is the same as the last such message from source
+    bool isE2EDuplicate(uint8_t source, uint8_t id);
+
     /// The last end-to-end sequence number to be used
     /// Defaults to 0
     uint8_t _lastE2ESequenceNumber;
 
+    /// The node and the interface the last message received by recvfromAck() came from.
+    /// Subclasses should use these instead of headerFrom(), which only knows about interface 0
+    uint8_t _rxFrom;
+    uint8_t _rxInterface;
+
     /// The maximum number of hops permitted in routed messages.
     /// If a routed message would exceed this number of hops it is dropped and ignored.
     uint8_t              _max_hops;
 
 private:
 
-    /// Temporary mesage buffer
-    static RoutedMessage _tmpMessage;
+    /// Temporary mesage buffer. Not static, so that several instances can be used at once
+    RoutedMessage        _tmpMessage;
 
     /// Local routing table
-    RoutingTableEntry    _routes[RH_ROUTING_TABLE_SIZE];
+    RoutingTableEntry    _routes[RH_ROUTING_TABLE_SLOTS];
+
+    /// Removes the route at index from the list of routes in order of use
+    void unlinkRoute(uint8_t index);
+
+    /// Adds the route at index to the list of routes in order of use, as the most recently used
+    void linkRoute(uint8_t index);
+
+    /// Adds next_hop to the alternate next hops of the route at index, in order of metric,
+    /// or updates its metric if already there
+    void addAlternate(uint8_t index, uint8_t next_hop, uint8_t metric);
+
+    /// Removes next_hop from the alternate next hops of the route at index, if it is there
+    void removeAlternate(uint8_t index, uint8_t next_hop);
+
+    /// Returns the interface of the route to dest, without counting it as a use of the route
+    /// \return The interface, or 0 if there is no route
+    uint8_t routeInterface(uint8_t dest);
+
+    /// Returns the interface a message will be forwarded through: that of the route to its next hop 
+    /// if pathNextHop() gives one, else that of the route to its destination
+    /// \return The interface
+    uint8_t forwardInterface(RoutedMessage* message, uint8_t messageLen);
+
+    /// Marks the route to dest Valid if it is Stale, after a message was successfully sent to its next hop
+    void confirmRoute(uint8_t dest);
+
+    /// Copies the application data and header fields of the message of messageLen octets in 
+    /// _tmpMessage to the arguments of recvfromAck()
+    /// \return true
+    bool deliverMessage(uint8_t messageLen, uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags);
+
+    /// Number of valid routes in _routes
+    uint8_t              _routeCount;
+
+    /// Indexes of the least and most recently used routes.
+    /// RH_ROUTING_TABLE_SLOTS if there are none
+    uint8_t              _oldestRoute;
+    uint8_t              _newestRoute;
+
+    /// Time after which an unused route expires, or 0
+    unsigned long        _routeTimeout;
+
+    /// The interfaces. _interfaces[0] is this router
+    RHReliableDatagram*  _interfaces[RH_ROUTER_MAX_INTERFACES];
+
+    /// Number of entries in _interfaces
+    uint8_t              _interfaceCount;
+
+#if RH_ROUTER_FORWARD_QUEUE_SIZE > 0
+    /// A message in a forwarding queue
+    typedef struct
+    {
+	uint8_t       len;       ///< Length of the message
+	uint8_t       from;      ///< The node it was received from
+	uint8_t       iface;     ///< The interface it was received through
+	uint8_t       data[RH_ROUTER_FORWARD_QUEUE_MSG_LEN]; ///< The RHRouter message
+    } ForwardedMessage;
+
+    /// The forwarding queue of an interface
+    typedef struct
+    {
+	ForwardedMessage messages[RH_ROUTER_FORWARD_QUEUE_SIZE]; ///< The messages
+	uint8_t       head;      ///< Index of the oldest message, which is the one in flight
+	uint8_t       count;     ///< Number of messages
+	uint8_t       handle;    ///< Handle from RHReliableDatagram::sendtoAsync() for the message in flight, or RH_ASYNC_INVALID_HANDLE
+	uint8_t       sentVia;   ///< The interface the message in flight was sent through
+    } ForwardQueue;
+
+    /// The forwarding queues, one for each interface
+    ForwardQueue         _forwardQueues[RH_ROUTER_MAX_INTERFACES];
+#endif
+
+    /// Number of messages dropped because a forwarding queue was full
+    uint32_t             _forwardQueueDropped;
+
+    /// Counts of routing table lookups and deletions
+    uint32_t             _routeHits;
+    uint32_t             _routeMisses;
+    uint32_t             _routeEvictions;
+    uint32_t             _routeExpiries;
+    uint32_t             _routeFailovers;
+
+    /// The destination and ID of the message waitE2EAck() is waiting to be acknowledged. 
+    /// _e2eWaitDest is RH_BROADCAST_ADDRESS when not waiting
+    uint8_t              _e2eWaitDest;
+    uint8_t              _e2eWaitId;
+
+    /// Set when the acknowledgement waitE2EAck() is waiting for arrives
+    bool                 _e2eAcked;
+
+    /// Message for this node received while waiting for an end-to-end acknowledgement
+    uint8_t              _e2eHeld[RH_ROUTER_E2E_HOLD_LEN];
+
+    /// Length of the message in _e2eHeld, or 0 if none
+    uint8_t              _e2eHeldLen;
+
+    /// Sources and IDs of the last end-to-end acknowledged messages received. 
+    /// Unused entries have a source of RH_BROADCAST_ADDRESS
+    uint8_t              _e2eSeenSource[RH_ROUTER_E2E_DUP_TABLE_SIZE];
+    uint8_t              _e2eSeenId[RH_ROUTER_E2E_DUP_TABLE_SIZE];
+
+    /// Index of the entry to reuse for the next new source
+    uint8_t              _e2eSeenNext;
+
+    /// Counts of end-to-end retransmissions and duplicates
+    uint32_t             _e2eRetransmissions;
+    uint32_t             _e2eDuplicates;
 };
 
 /// @example rf22_router_client.pde
 /// @example rf22_router_server1.pde
 /// @example rf22_router_server2.pde
 /// @example rf22_router_server3.pde
+/// @example simulator_router_benchmark.pde
 #endif
 
@@ -287,14 +287,14 @@ bool RH_TCP::sendPacket(const uint8_t* data, uint8_t len)
     if (_socket < 0)
 	return false;
     RHTcpPacket m;
-    m.length = htonl(len + 4);
+    m.length = htonl(len + 5); // type, to, from, id, flags and the data
     m.type  = RH_TCP_MESSAGE_TYPE_PACKET;
     m.to    = _txHeaderTo;
     m.from  = _txHeaderFrom;
     m.id    = _txHeaderId;
     m.flags = _txHeaderFlags;
     memcpy(m.payload, data, len);
-    ssize_t sent = write(_socket, &m, len + 8);
+    ssize_t sent = write(_socket, &m, len + 9);
     return sent > 0;
 }
 
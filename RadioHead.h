@@ -137,6 +137,13 @@
 /// - RHMesh
 /// Multi-hop delivery with automatic route discovery and rediscovery.
 ///
+/// - RHDistanceVector
+/// Multi-hop delivery with routes to all nodes kept up to date in advance by periodic beacons.
+///
+/// - RHFragment
+/// Messages of up to 64k octets, sent as a series of fragments with any of RHReliableDatagram, 
+/// RHRouter or RHMesh.
+///
 /// Any Manager may be used with any Driver.
 ///
 /// \par Platforms
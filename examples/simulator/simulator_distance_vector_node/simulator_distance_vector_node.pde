@@ -0,0 +1,82 @@
+// simulator_distance_vector_node.pde
+// -*- mode: C++ -*-
+// Example sketch showing how to create a node in a network with proactive distance vector routing
+// with the RHDistanceVector class, using the RH_SIMULATOR driver to control a SIMULATOR radio.
+// Run one for each node in the network, each with its own address. A node given a destination
+// sends it an alarm message every 5 seconds, and prints how long it took to be acknowledged 
+// end-to-end, and how many messages this node has sent for routing.
+// Build with -DUSE_RHMESH to compare with RHMesh, which has to discover the route first.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild examples/simulator/simulator_distance_vector_node/simulator_distance_vector_node.pde
+// Run with ./simulator_distance_vector_node address [destination]
+// Make sure you also have the 'Luminiferous Ether' simulator tools/etherSimulator.pl running,
+// with a config file that limits which nodes can hear each other
+
+#include <RHDistanceVector.h>
+#include <RHMesh.h>
+#include <RH_TCP.h>
+
+// Singleton instance of the radio driver
+RH_TCP driver;
+
+// Class to manage message delivery and receipt, using the driver declared above
+#ifdef USE_RHMESH
+RHMesh manager(driver, 1);
+#else
+RHDistanceVector manager(driver, 1);
+#endif
+
+uint8_t destination = RH_BROADCAST_ADDRESS;
+unsigned long lastAlarm = 0;
+uint8_t data[] = "Alarm!";
+// Dont put this on the stack:
+uint8_t buf[RH_TCP_MAX_MESSAGE_LEN];
+
+void setup() 
+{
+  Serial.begin(9600);
+  if (!manager.init())
+    Serial.println("init failed");
+  if (_simulator_argc >= 2)
+     manager.setThisAddress(atoi(_simulator_argv[1]));
+  if (_simulator_argc >= 3)
+     destination = atoi(_simulator_argv[2]);
+}
+
+void loop()
+{
+  if (destination != RH_BROADCAST_ADDRESS && millis() - lastAlarm > 5000)
+  {
+    lastAlarm = millis();
+    uint16_t dataTx = driver.txGood();
+    unsigned long start = millis();
+    uint8_t ret = manager.sendtoWait(data, sizeof(data), destination, RH_ROUTER_FLAGS_E2E_ACK_REQUEST);
+    Serial.print("sendtoWait returned ");
+    Serial.print(ret, DEC);
+    Serial.print(" after ");
+    Serial.print((unsigned int)(millis() - start));
+    Serial.print(" ms, sending ");
+    Serial.print((unsigned int)(driver.txGood() - dataTx));
+    Serial.println(" messages");
+#ifndef USE_RHMESH
+    Serial.print("Beacons sent: ");
+    Serial.print((unsigned int)manager.beaconsSent());
+    Serial.print(" messages, ");
+    Serial.print((unsigned int)manager.beaconOctets());
+    Serial.println(" octets");
+#endif
+  }
+
+  // Relay messages for other nodes, send beacons, and receive alarms for this node
+  uint8_t len = sizeof(buf);
+  uint8_t from;
+  if (manager.recvfromAckTimeout(buf, &len, 100, &from))
+  {
+    Serial.print("got alarm from : 0x");
+    Serial.print(from, HEX);
+    Serial.print(": ");
+    Serial.println((char*)buf);
+  }
+}
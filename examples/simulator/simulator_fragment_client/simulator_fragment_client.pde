@@ -0,0 +1,63 @@
+// simulator_fragment_client.pde
+// -*- mode: C++ -*-
+// Example sketch showing how to send messages much longer than the radio can carry
+// with the RHFragment class, using the RH_SIMULATOR driver to control a SIMULATOR radio.
+// It is designed to work with the other example simulator_fragment_server
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild examples/simulator/simulator_fragment_client/simulator_fragment_client.pde
+// Run with ./simulator_fragment_client
+// Make sure you also have the 'Luminiferous Ether' simulator tools/etherSimulator.pl running
+
+#include <RHReliableDatagram.h>
+#include <RHFragment.h>
+#include <RH_TCP.h>
+
+#define CLIENT_ADDRESS 1
+#define SERVER_ADDRESS 2
+
+// Singleton instance of the radio driver
+RH_TCP driver;
+
+// Class to manage message delivery and receipt, using the driver declared above
+RHReliableDatagram manager(driver, CLIENT_ADDRESS);
+
+// Class to split long messages into fragments, using the manager declared above
+RHFragment fragment(manager);
+
+// Dont put this on the stack:
+uint8_t data[2000];
+
+void setup() 
+{
+  Serial.begin(9600);
+  if (!manager.init())
+    Serial.println("init failed");
+  // Defaults after init are 434.0MHz, 0.05MHz AFC pull-in, modulation FSK_Rb2_4Fd36
+
+  uint16_t i;
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = i & 0xff;
+}
+
+void loop()
+{
+  Serial.println("Sending to simulator_fragment_server");
+    
+  // Send a long message to the server
+  uint8_t result = fragment.sendtoWait(data, sizeof(data), SERVER_ADDRESS);
+  if (result == RH_FRAGMENT_ERROR_NONE)
+  {
+    Serial.print("sent in fragments of ");
+    Serial.print(fragment.maxFragmentLength());
+    Serial.print(" octets at ");
+    Serial.print((unsigned int)fragment.goodput());
+    Serial.print(" octets per second, retransmitted fragments: ");
+    Serial.print((unsigned int)fragment.retransmissions());
+    Serial.println("");
+  }
+  else
+    Serial.println("sendtoWait failed, is simulator_fragment_server running?");
+  delay(2000);
+}
@@ -0,0 +1,58 @@
+// simulator_fragment_server.pde
+// -*- mode: C++ -*-
+// Example sketch showing how to receive messages much longer than the radio can carry
+// with the RHFragment class, using the RH_SIMULATOR driver to control a SIMULATOR radio.
+// It is designed to work with the other example simulator_fragment_client
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild examples/simulator/simulator_fragment_server/simulator_fragment_server.pde
+// Run with ./simulator_fragment_server
+// Make sure you also have the 'Luminiferous Ether' simulator tools/etherSimulator.pl running
+
+#include <RHReliableDatagram.h>
+#include <RHFragment.h>
+#include <RH_TCP.h>
+
+#define CLIENT_ADDRESS 1
+#define SERVER_ADDRESS 2
+
+// Singleton instance of the radio driver
+RH_TCP driver;
+
+// Class to manage message delivery and receipt, using the driver declared above
+RHReliableDatagram manager(driver, SERVER_ADDRESS);
+
+// Class to reassemble long messages from fragments, using the manager declared above
+RHFragment fragment(manager);
+
+// Dont put this on the stack. Needs room for the fragment header as well as the message
+uint8_t buf[4000 + RH_FRAGMENT_HEADER_LEN];
+
+void setup() 
+{
+  Serial.begin(9600);
+  if (!manager.init())
+    Serial.println("init failed");
+  // Defaults after init are 434.0MHz, 0.05MHz AFC pull-in, modulation FSK_Rb2_4Fd36
+}
+
+void loop()
+{
+  // Wait for fragments addressed to us from the client
+  manager.waitAvailable();
+
+  // Always pass the same buffer until a message is complete
+  uint16_t len = sizeof(buf);
+  uint8_t from;
+  if (fragment.recvfrom(buf, &len, &from))
+  {
+    Serial.print("got message from : 0x");
+    Serial.print(from, HEX);
+    Serial.print(": ");
+    Serial.print((unsigned int)len);
+    Serial.print(" octets at ");
+    Serial.print((unsigned int)fragment.goodput());
+    Serial.println(" octets per second");
+  }
+}
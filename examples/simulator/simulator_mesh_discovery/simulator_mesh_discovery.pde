@@ -0,0 +1,138 @@
+// simulator_mesh_discovery.pde
+// -*- mode: C++ -*-
+// Measures route discovery in RHMesh, using the RH_SIMULATOR driver to control a SIMULATOR radio.
+// Run one for each node in the network, each with its own address. The node given destinations
+// discovers the route to each of them in turn, forgetting its routes first, and prints whether
+// it was found, how long it took and how many hops away the destination is.
+// After the last one it prints how many routes it found and how long they took on average.
+// Every node prints how many broadcasts and octets (its airtime) it has sent whenever it has sent more, 
+// so adding up the last line printed by each node gives the totals for all the discoveries.
+// Build with -DRH_MESH_ROUTE_REQUEST_CACHE_SIZE=0 to rebroadcast every copy of a route request
+// that has not visited the node before, as earlier versions of RadioHead did.
+// Build with -DRH_MESH_RING_TTL_START=0 to flood every route request across the whole network
+// instead of searching in expanding rings. Nearby destinations show the difference best:
+// ./simulator_mesh_discovery 1 2 12 13 3 22 23
+// Build with -DROUNDS=3 to send to the destinations in turn 3 times without forgetting routes, so that
+// only the routes that the routing tables could not keep are discovered again, and compare 
+// the default RH_ROUTING_TABLE_SIZE of 10 with -DRH_ROUTING_TABLE_SIZE=50, big enough for the whole network:
+// ./simulator_mesh_discovery 1 `seq 21 40`
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// tools/simBuild examples/simulator/simulator_mesh_discovery/simulator_mesh_discovery.pde
+// Run with ./simulator_mesh_discovery address [destination ...]
+// Make sure you also have the 'Luminiferous Ether' simulator tools/etherSimulator.pl running.
+// tools/grid50.conf sets up a grid of 50 nodes, 10 wide and 5 high, where each node hears only its
+// 8 neighbours, with node 1 in one corner and node 50 in the other:
+// tools/etherSimulator.pl -c tools/grid50.conf &
+// for i in `seq 2 50`; do stdbuf -oL ./simulator_mesh_discovery $i > node$i.log & done
+// ./simulator_mesh_discovery 1 10 50 46 30 41 25
+
+#include <RHMesh.h>
+#include <RH_TCP.h>
+
+// How long to wait after each discovery for the last copies of its requests to die away
+#define SETTLE_TIME 2000
+
+// How many times to send to each destination. Routes are only forgotten between messages if 1
+#ifndef ROUNDS
+#define ROUNDS 1
+#endif
+
+// Counts the broadcasts and octets sent through RH_TCP
+class CountingDriver : public RH_TCP
+{
+public:
+    CountingDriver() : broadcasts(0), octets(0) {}
+    bool send(const uint8_t* data, uint8_t len)
+    {
+	if (_txHeaderTo == RH_BROADCAST_ADDRESS)
+	    broadcasts++;
+	octets += len + RH_TCP_HEADER_LEN;
+	return RH_TCP::send(data, len);
+    }
+    unsigned long broadcasts;
+    unsigned long octets;
+};
+
+// Singleton instance of the radio driver
+CountingDriver driver;
+
+// Class to manage message delivery and receipt, using the driver declared above
+RHMesh manager(driver, 1);
+
+int nextArg = 2;
+int roundsDone = 0;
+unsigned long lastDiscovery = 0;
+unsigned long reported = 0;
+unsigned int found = 0;
+unsigned long foundTime = 0;
+uint8_t data[] = "Hello";
+// Dont put this on the stack:
+uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+void setup()
+{
+  Serial.begin(9600);
+  if (!manager.init())
+    Serial.println("init failed");
+  if (_simulator_argc >= 2)
+     manager.setThisAddress(atoi(_simulator_argv[1]));
+}
+
+void loop()
+{
+  if (roundsDone < ROUNDS && nextArg < _simulator_argc && millis() - lastDiscovery > SETTLE_TIME)
+  {
+    uint8_t destination = atoi(_simulator_argv[nextArg++]);
+    if (ROUNDS == 1)
+      manager.clearRoutingTable();
+    unsigned long start = millis();
+    uint8_t ret = manager.sendtoWait(data, sizeof(data), destination);
+    lastDiscovery = millis();
+    RHRouter::RoutingTableEntry* route = manager.getRouteTo(destination);
+    Serial.print("Route to ");
+    Serial.print(destination, DEC);
+    Serial.print(ret == RH_ROUTER_ERROR_NONE ? ": found after " : ": not found after ");
+    Serial.print((unsigned int)(lastDiscovery - start));
+    Serial.print(" ms, ");
+    Serial.print((unsigned int)(route ? route->metric : 0));
+    Serial.println(" hops");
+    if (ret == RH_ROUTER_ERROR_NONE)
+    {
+      found++;
+      foundTime += lastDiscovery - start;
+    }
+    if (nextArg == _simulator_argc && ++roundsDone < ROUNDS)
+      nextArg = 2;
+    if (nextArg == _simulator_argc)
+    {
+      Serial.print("Found ");
+      Serial.print(found);
+      Serial.print(" of ");
+      Serial.print((unsigned int)((_simulator_argc - 2) * ROUNDS));
+      Serial.print(" routes, in ");
+      Serial.print((unsigned int)(found ? foundTime / found : 0));
+      Serial.println(" ms on average");
+      Serial.print("Routing table: ");
+      Serial.print((unsigned int)manager.routeMisses());
+      Serial.print(" misses, ");
+      Serial.print((unsigned int)manager.routeEvictions());
+      Serial.println(" evictions");
+    }
+  }
+  if (driver.octets != reported)
+  {
+    reported = driver.octets;
+    Serial.print("Sent ");
+    Serial.print((unsigned int)driver.broadcasts);
+    Serial.print(" broadcasts, ");
+    Serial.print((unsigned int)driver.octets);
+    Serial.println(" octets");
+  }
+
+  // Relay the route discoveries of other nodes
+  uint8_t len = sizeof(buf);
+  uint8_t from;
+  manager.recvfromAckTimeout(buf, &len, 100, &from);
+}
@@ -0,0 +1,144 @@
+// simulator_reliable_datagram_benchmark.pde
+// -*- mode: C++ -*-
+// Benchmark of the duplicate detection in RHReliableDatagram.
+// Compares the memory use, lookup cost and accuracy of the per-peer table of recently seen IDs
+// against the array of the last seen ID from every node address used by earlier versions of RadioHead,
+// and checks that the messages of a sender that restarts its sequence are not taken as duplicates.
+// Does not need the 'Luminiferous Ether' simulator: no messages are sent.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// tools/simBuild examples/simulator/simulator_reliable_datagram_benchmark/simulator_reliable_datagram_benchmark.pde
+// Run with ./simulator_reliable_datagram_benchmark
+// Try also building with -DRH_RELIABLE_PEER_TABLE_SIZE=4 or -DRH_RELIABLE_DUP_WINDOW=32
+
+#include <RHReliableDatagram.h>
+#include <RH_TCP.h>
+
+// Number of times each traffic pattern is repeated for each peer
+#define ITERATIONS 200000
+
+// Gives access to the duplicate detection in RHReliableDatagram
+class DupBenchmark : public RHReliableDatagram
+{
+public:
+    DupBenchmark(RHGenericDriver& driver) : RHReliableDatagram(driver, 1) {}
+    bool received(uint8_t from, uint8_t id)
+    {
+	if (isDuplicate(from, id))
+	    return false;
+	markSeen(from, id);
+	return true;
+    }
+    unsigned int tableSize() { return sizeof(PeerState) * RH_RELIABLE_PEER_TABLE_SIZE; }
+    // How long IDs are remembered after the last new one, with the default timeout
+    unsigned long horizon() { return (unsigned long)(retries() + 1) * 2 * RH_DEFAULT_TIMEOUT; }
+};
+
+// The duplicate detection used by earlier versions of RadioHead
+uint8_t seenIds[256];
+bool receivedArray(uint8_t from, uint8_t id)
+{
+    if (seenIds[from] == id)
+	return false;
+    seenIds[from] = id;
+    return true;
+}
+
+// Singleton instance of the radio driver. It is never initialised
+RH_TCP driver;
+
+void printResult(const char* name, unsigned long ms, unsigned long ops, unsigned long errors)
+{
+    Serial.print(name);
+    Serial.print(": ");
+    Serial.print((unsigned int)(ms * 1000000 / ops));
+    Serial.print(" ns/message, ");
+    Serial.print((unsigned int)errors);
+    Serial.println(" misclassified");
+}
+
+// Feeds each peer a repeating pattern of 5 messages, with the ID of each and whether it is new:
+// one in order, one delivered after its successor, and 2 retransmissions of messages already received.
+// Messages from the different peers are interleaved.
+// Returns the number of messages misclassified as new or duplicate.
+unsigned long run(DupBenchmark* manager, uint8_t peers, unsigned long* ms)
+{
+    static const uint8_t offset[] = { 0, 2, 1, 2, 0 };
+    static const bool    isNew[]  = { true, true, true, false, false };
+    unsigned long errors = 0;
+    unsigned long start = millis();
+    uint32_t i;
+    for (i = 0; i < ITERATIONS; i++)
+    {
+	uint8_t base = i * 3;
+	uint8_t from, j;
+	for (j = 0; j < sizeof(offset); j++)
+	    for (from = 1; from <= peers; from++)
+	    {
+		bool result = manager ? manager->received(from, base + offset[j]) : receivedArray(from, base + offset[j]);
+		if (result != isNew[j])
+		    errors++;
+	    }
+    }
+    *ms = millis() - start;
+    return errors;
+}
+
+// A peer sends IDs 1 to 6, retransmits the last one, and then restarts, sending IDs 1 to 6 again 
+// after the retransmissions of the first ones are over. Returns the number of messages misclassified
+unsigned long restart(DupBenchmark* manager)
+{
+    unsigned long errors = 0;
+    uint8_t id;
+    for (id = 1; id <= 6; id++)
+	if (!manager->received(2, id))
+	    errors++;
+    if (manager->received(2, 6))
+	errors++; // A retransmission
+    delay(manager->horizon() + 100);
+    for (id = 1; id <= 6; id++)
+	if (!manager->received(2, id))
+	    errors++;
+    return errors;
+}
+
+void setup()
+{
+    Serial.begin(9600);
+    DupBenchmark manager(driver);
+
+    Serial.print("Per-peer table: ");
+    Serial.print(manager.tableSize());
+    Serial.print(" octets for ");
+    Serial.print((unsigned int)RH_RELIABLE_PEER_TABLE_SIZE);
+    Serial.print(" peers, window of ");
+    Serial.print((unsigned int)RH_RELIABLE_DUP_WINDOW);
+    Serial.println(" IDs");
+    Serial.print("Last seen array: ");
+    Serial.print((unsigned int)sizeof(seenIds));
+    Serial.println(" octets");
+
+    uint8_t peers;
+    for (peers = 1; peers <= 16; peers *= 2)
+    {
+	unsigned long ms, errors;
+	unsigned long ops = (unsigned long)ITERATIONS * 5 * peers;
+	Serial.print((unsigned int)peers);
+	Serial.println(" peers:");
+	errors = run(&manager, peers, &ms);
+	printResult("  Per-peer table ", ms, ops, errors);
+	errors = run(NULL, peers, &ms);
+	printResult("  Last seen array", ms, ops, errors);
+    }
+
+    DupBenchmark restarted(driver);
+    Serial.print("Restarting sender: ");
+    Serial.print((unsigned int)restart(&restarted));
+    Serial.println(" misclassified");
+    exit(0);
+}
+
+void loop()
+{
+}
@@ -0,0 +1,140 @@
+// simulator_router_benchmark.pde
+// -*- mode: C++ -*-
+// Benchmark of the routing table in RHRouter.
+// Compares the time to find and add routes in the hash (or directly indexed) routing table
+// against the linearly searched table used by earlier versions of RadioHead, 
+// and counts how many lookups miss because the route has been retired to make room for another.
+// In RHMesh, each of those misses would cause a route discovery.
+// Does not need the 'Luminiferous Ether' simulator: no messages are sent.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// tools/simBuild examples/simulator/simulator_router_benchmark/simulator_router_benchmark.pde
+// Run with ./simulator_router_benchmark
+// Try also building with -DRH_ROUTING_TABLE_SIZE=100 or -DRH_ROUTING_TABLE_DENSE=1
+
+#include <RHRouter.h>
+#include <RH_TCP.h>
+
+// Number of lookups for each number of destinations
+#define ITERATIONS 2000000
+
+// The routing table used by earlier versions of RadioHead
+class LinearTable
+{
+public:
+    typedef struct
+    {
+	uint8_t      dest;
+	uint8_t      next_hop;
+	uint8_t      state;
+    } Entry;
+    LinearTable()
+    {
+	for (uint8_t i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+	    _routes[i].state = RHRouter::Invalid;
+    }
+    void addRouteTo(uint8_t dest, uint8_t next_hop)
+    {
+	uint8_t i;
+	for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+	    if (_routes[i].dest == dest)
+	    {
+		_routes[i].next_hop = next_hop;
+		_routes[i].state = RHRouter::Valid;
+		return;
+	    }
+	for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+	    if (_routes[i].state == RHRouter::Invalid)
+	    {
+		_routes[i].dest = dest;
+		_routes[i].next_hop = next_hop;
+		_routes[i].state = RHRouter::Valid;
+		return;
+	    }
+	// Retire the oldest (first)
+	memmove(&_routes[0], &_routes[1], sizeof(Entry) * (RH_ROUTING_TABLE_SIZE - 1));
+	_routes[RH_ROUTING_TABLE_SIZE - 1].dest = dest;
+	_routes[RH_ROUTING_TABLE_SIZE - 1].next_hop = next_hop;
+	_routes[RH_ROUTING_TABLE_SIZE - 1].state = RHRouter::Valid;
+    }
+    Entry* getRouteTo(uint8_t dest)
+    {
+	for (uint8_t i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+	    if (_routes[i].dest == dest && _routes[i].state != RHRouter::Invalid)
+		return &_routes[i];
+	return NULL;
+    }
+private:
+    Entry _routes[RH_ROUTING_TABLE_SIZE];
+};
+
+// Singleton instance of the radio driver. It is never initialised
+RH_TCP driver;
+
+// Looks up the route to a random destination (as if forwarding a message to it), 
+// and adds one if there is none (as if RHMesh had discovered it). 
+// Returns the number of lookups that missed.
+template <class T> unsigned long run(T* table, unsigned int destinations, unsigned long* ms)
+{
+    unsigned long misses = 0;
+    unsigned long start = millis();
+    uint32_t i;
+    for (i = 0; i < ITERATIONS; i++)
+    {
+	uint8_t dest = random(destinations);
+	if (!table->getRouteTo(dest))
+	{
+	    misses++;
+	    table->addRouteTo(dest, dest);
+	}
+    }
+    *ms = millis() - start;
+    return misses;
+}
+
+void printResult(const char* name, unsigned long ms, unsigned long misses)
+{
+    Serial.print(name);
+    Serial.print(": ");
+    Serial.print((unsigned int)(ms * 1000000 / ITERATIONS));
+    Serial.print(" ns/lookup, ");
+    Serial.print((unsigned int)misses);
+    Serial.println(" misses");
+}
+
+void setup()
+{
+    Serial.begin(9600);
+    Serial.print("Routing table: ");
+    Serial.print((unsigned int)RH_ROUTING_TABLE_SIZE);
+    Serial.print(" routes in ");
+    Serial.print((unsigned int)(RH_ROUTING_TABLE_SLOTS * sizeof(RHRouter::RoutingTableEntry)));
+    Serial.println(RH_ROUTING_TABLE_DENSE ? " octets, directly indexed" : " octets, hashed");
+    Serial.print("Linear table: ");
+    Serial.print((unsigned int)RH_ROUTING_TABLE_SIZE);
+    Serial.print(" routes in ");
+    Serial.print((unsigned int)(RH_ROUTING_TABLE_SIZE * sizeof(LinearTable::Entry)));
+    Serial.println(" octets");
+
+    unsigned int destinations;
+    for (destinations = 5; destinations <= 160; destinations *= 2)
+    {
+	unsigned long ms, misses;
+	RHRouter router(driver, 254);
+	LinearTable linear;
+	Serial.print(destinations);
+	Serial.println(" destinations:");
+	srandom(1);
+	misses = run(&router, destinations, &ms);
+	printResult("  Routing table", ms, misses);
+	srandom(1);
+	misses = run(&linear, destinations, &ms);
+	printResult("  Linear table ", ms, misses);
+    }
+    exit(0);
+}
+
+void loop()
+{
+}